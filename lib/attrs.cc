@@ -0,0 +1,257 @@
+// Typed node attributes.
+
+#include <cstring>
+#include "attrs.hh"
+
+namespace asure {
+namespace tree {
+
+namespace {
+
+char const* const fieldNames[Attrs::FIELD_COUNT] = {
+  "ctime", "ctimens", "devmaj", "devmin", "gid", "ino", "kind", "mtime", "mtimens",
+  "nlink", "perm", "size", "targ", "uid", 0
+};
+
+char const* const kindNames[] = {
+  "dir", "file", "lnk", "sock", "fifo", "blk", "chr"
+};
+size_t const kindCount = sizeof(kindNames) / sizeof(kindNames[0]);
+
+// Parse a decimal number only if it would be written back the same way.
+bool parseNumber(std::string const& text, bool isSigned, int64_t& value)
+{
+  char const* pos = text.data();
+  char const* const end = pos + text.size();
+  bool const negative = isSigned && pos != end && *pos == '-';
+  if (negative)
+    ++pos;
+  if (pos == end || *pos < '0' || *pos > '9' || (*pos == '0' && end - pos > 1))
+    return false;
+
+  uint64_t result = 0;
+  if (end - pos < 19) {
+    // Too few digits to overflow.
+    for (; pos != end; ++pos) {
+      unsigned const digit = *pos - '0';
+      if (digit > 9)
+        return false;
+      result = result * 10 + digit;
+    }
+  } else {
+    uint64_t const limit = negative ? uint64_t(1) << 63 :
+      isSigned ? (uint64_t(1) << 63) - 1 : ~uint64_t(0);
+    for (; pos != end; ++pos) {
+      unsigned const digit = *pos - '0';
+      if (digit > 9 || __builtin_mul_overflow(result, 10, &result) ||
+          __builtin_add_overflow(result, digit, &result) || result > limit)
+        return false;
+    }
+  }
+  if (negative && result == 0)
+    return false;
+  value = negative ? int64_t(0 - result) : int64_t(result);
+  return true;
+}
+
+int unhex(char ch)
+{
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  return -1;
+}
+
+// Parse a digest, as Hash writes it.
+bool parseDigest(std::string const& text, Hash& hash)
+{
+  size_t const length = text.size() / 2;
+  if (text.size() % 2 != 0 || length == 0 || length > sizeof(hash.data))
+    return false;
+  for (size_t i = 0; i < length; ++i) {
+    int const high = unhex(text[2 * i]);
+    int const low = unhex(text[2 * i + 1]);
+    if (high < 0 || low < 0)
+      return false;
+    hash.data[i] = (high << 4) | low;
+  }
+  hash.length = length;
+  return true;
+}
+
+}
+
+std::string formatNumber(uint64_t value)
+{
+  char buf[24];
+  char* const end = buf + sizeof(buf);
+  char* pos = end;
+  do {
+    *--pos = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  return std::string(pos, end);
+}
+
+std::string formatNumber(int64_t value)
+{
+  if (value < 0)
+    return '-' + formatNumber(0 - uint64_t(value));
+  return formatNumber(uint64_t(value));
+}
+
+Attrs::Attrs() : present_(0), kind_(FILE), target_(), algorithm_(Digest::SHA1), digest_(),
+    extras_()
+{
+  std::memset(numbers_, 0, sizeof(numbers_));
+  digest_.length = 0;
+}
+
+void Attrs::clear()
+{
+  present_ = 0;
+  target_.clear();
+  extras_.clear();
+}
+
+bool Attrs::byName(std::string const& name, Field& field)
+{
+  // The names are in order.
+  size_t low = 0, high = DIGEST;
+  while (low < high) {
+    size_t const mid = (low + high) / 2;
+    int const order = std::strcmp(name.c_str(), fieldNames[mid]);
+    if (order == 0) {
+      field = Field(mid);
+      return true;
+    }
+    if (order < 0)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  if (Digest::isDigestKey(name)) {
+    field = DIGEST;
+    return true;
+  }
+  return false;
+}
+
+char const* Attrs::key(Field field) const
+{
+  return field == DIGEST ? Digest::name(algorithm_) : fieldNames[field];
+}
+
+void Attrs::set(std::string const& key, std::string const& value)
+{
+  Field field;
+  set(byName(key, field) ? field : FIELD_COUNT, key, value);
+}
+
+void Attrs::set(Field field, std::string const& key, std::string const& value)
+{
+  if (field != FIELD_COUNT) {
+    switch (field) {
+      case KIND:
+        for (size_t i = 0; i < kindCount; ++i) {
+          if (value == kindNames[i]) {
+            setKind(Kind(i));
+            return;
+          }
+        }
+        break;
+
+      case TARG:
+        setTarget(value);
+        return;
+
+      case DIGEST: {
+        Digest::Algorithm algorithm = Digest::SHA1;
+        Digest::byName(key, algorithm);
+        Hash hash;
+        // Only one digest is kept typed; any others are left as extras.
+        if ((!has(DIGEST) || algorithm_ == algorithm) && parseDigest(value, hash)) {
+          setDigest(algorithm, hash);
+          return;
+        }
+        break;
+      }
+
+      default: {
+        int64_t number;
+        if (parseNumber(value, Attrs::isSigned(field), number)) {
+          setNumber(field, number);
+          return;
+        }
+        break;
+      }
+    }
+  }
+
+  typedef Extras::iterator Iter;
+  for (Iter i = extras_.begin(); i != extras_.end(); ++i) {
+    if (i->first == key) {
+      i->second = value;
+      return;
+    }
+  }
+  extras_.push_back(std::make_pair(key, value));
+}
+
+void Attrs::merge(Attrs const& other)
+{
+  for (int f = 0; f < FIELD_COUNT; ++f) {
+    Field const field = Field(f);
+    if (!other.has(field))
+      continue;
+    switch (field) {
+      case KIND: setKind(other.kind_); break;
+      case TARG: setTarget(other.target_); break;
+      case DIGEST: setDigest(other.algorithm_, other.digest_); break;
+      default: setNumber(field, other.numbers_[field]); break;
+    }
+  }
+  typedef Extras::const_iterator Iter;
+  for (Iter i = other.extras_.begin(); i != other.extras_.end(); ++i)
+    set(i->first, i->second);
+}
+
+std::string Attrs::format(Field field) const
+{
+  switch (field) {
+    case KIND: return kindNames[kind_];
+    case TARG: return target_;
+    case DIGEST: return digest_;
+    default:
+      if (isSigned(field))
+        return formatNumber(numbers_[field]);
+      return formatNumber(uint64_t(numbers_[field]));
+  }
+}
+
+void Attrs::toMap(std::map<std::string, std::string>& atts) const
+{
+  for (int f = 0; f < FIELD_COUNT; ++f) {
+    if (has(Field(f)))
+      atts[key(Field(f))] = format(Field(f));
+  }
+  typedef Extras::const_iterator Iter;
+  for (Iter i = extras_.begin(); i != extras_.end(); ++i)
+    atts[i->first] = i->second;
+}
+
+bool Attrs::same(Attrs const& a, Attrs const& b, Field field)
+{
+  switch (field) {
+    case KIND: return a.kind_ == b.kind_;
+    case TARG: return a.target_ == b.target_;
+    case DIGEST:
+      return a.algorithm_ == b.algorithm_ && a.digest_.length == b.digest_.length &&
+        std::memcmp(a.digest_.data, b.digest_.data, a.digest_.length) == 0;
+    default: return a.numbers_[field] == b.numbers_[field];
+  }
+}
+
+}
+}
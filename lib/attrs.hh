@@ -0,0 +1,128 @@
+// Typed node attributes.
+
+#ifndef __ATTRS_H__
+#define __ATTRS_H__
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "hash.hh"
+
+namespace asure {
+namespace tree {
+
+// The attributes of a node, in a fixed schema: numbers are kept as numbers,
+// and the digest as raw bytes.  Anything outside the schema, or a value
+// that wouldn't print back the same, is kept as a string among the extras,
+// so that converting to and from the string form is lossless.
+class Attrs {
+ public:
+  // In the order of their names.
+  enum Field {
+    CTIME, CTIMENS, DEVMAJ, DEVMIN, GID, INO, KIND, MTIME, MTIMENS, NLINK, PERM,
+    SIZE, TARG, UID,
+    // Named after its algorithm.
+    DIGEST,
+    FIELD_COUNT
+  };
+
+  // A set of fields.
+  typedef uint32_t Mask;
+  static Mask bit(Field field) { return Mask(1) << field; }
+
+  enum Kind {
+    DIR, FILE, LNK, SOCK, FIFO, BLK, CHR
+  };
+
+  typedef std::vector<std::pair<std::string, std::string> > Extras;
+
+  Attrs();
+  void clear();
+
+  Mask present() const { return present_; }
+  bool has(Field field) const { return (present_ & bit(field)) != 0; }
+
+  // The numeric fields: all but KIND, TARG and DIGEST.
+  int64_t number(Field field) const { return numbers_[field]; }
+  void setNumber(Field field, int64_t value) {
+    numbers_[field] = value;
+    present_ |= bit(field);
+  }
+
+  // Times can be before the epoch.  The other numbers are unsigned, and
+  // kept in the int64_t by their bits.
+  static bool isSigned(Field field) { return field == CTIME || field == MTIME; }
+
+  Kind kind() const { return kind_; }
+  void setKind(Kind kind) {
+    kind_ = kind;
+    present_ |= bit(KIND);
+  }
+
+  std::string const& target() const { return target_; }
+  void setTarget(std::string const& target) {
+    target_ = target;
+    present_ |= bit(TARG);
+  }
+
+  Digest::Algorithm algorithm() const { return algorithm_; }
+  Hash const& digest() const { return digest_; }
+  void setDigest(Digest::Algorithm algorithm, Hash const& digest) {
+    algorithm_ = algorithm;
+    digest_ = digest;
+    present_ |= bit(DIGEST);
+  }
+
+  Extras const& extras() const { return extras_; }
+
+  // Set an attribute from its string form.
+  void set(std::string const& key, std::string const& value);
+
+  // The same, given the field byName() finds for the key, or FIELD_COUNT
+  // if it finds none.
+  void set(Field field, std::string const& key, std::string const& value);
+
+  // Add the attributes in 'other', replacing any already here.
+  void merge(Attrs const& other);
+
+  // The string form of every attribute.
+  void toMap(std::map<std::string, std::string>& atts) const;
+
+  // A field's string form.
+  std::string format(Field field) const;
+
+  // The attribute name of a field, which for DIGEST depends on the
+  // algorithm.
+  char const* key(Field field) const;
+
+  // Find the field an attribute is kept in.  All of the digest names give
+  // DIGEST.
+  static bool byName(std::string const& name, Field& field);
+
+  // Whether the field holds the same value in both.  Digests are only the
+  // same if they use the same algorithm.
+  static bool same(Attrs const& a, Attrs const& b, Field field);
+
+ private:
+  Mask present_;
+  int64_t numbers_[FIELD_COUNT];
+  Kind kind_;
+  std::string target_;
+  Digest::Algorithm algorithm_;
+  Hash digest_;
+  Extras extras_;
+};
+
+// Integers in decimal, as a stream would write them.
+std::string formatNumber(int64_t value);
+std::string formatNumber(uint64_t value);
+
+}
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * BLAKE3 chunk hashing across SIMD lanes.  Included by blake3.c once per
+ * lane count, with B3_LANES, B3_NAME, B3_VEC and B3_TARGET defined.  Each lane
+ * hashes one whole chunk, so B3_LANES consecutive chunks are hashed at once.
+ * The vectors use GCC's generic vector extension, and B3_TARGET selects the
+ * instruction set they compile to.
+ */
+
+typedef uint32_t B3_VEC __attribute__((vector_size(4 * B3_LANES)));
+
+#define B3_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define B3_G(a, b, c, d, mx, my) do { \
+	v[a] = v[a] + v[b] + (mx); \
+	v[d] = B3_ROR(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d]; \
+	v[b] = B3_ROR(v[b] ^ v[c], 12); \
+	v[a] = v[a] + v[b] + (my); \
+	v[d] = B3_ROR(v[d] ^ v[a], 8); \
+	v[c] = v[c] + v[d]; \
+	v[b] = B3_ROR(v[b] ^ v[c], 7); \
+} while (0)
+
+B3_TARGET
+static void B3_NAME(const unsigned char *data, uint64_t counter, uint32_t cvs[][8])
+{
+	uint32_t stage[16][B3_LANES] __attribute__((aligned(4 * B3_LANES)));
+	B3_VEC h[8], v[16], m[16], lo, hi;
+	int i, lane, block, r;
+
+	for (lane = 0; lane < B3_LANES; lane++) {
+		stage[0][lane] = (uint32_t)(counter + lane);
+		stage[1][lane] = (uint32_t)((counter + lane) >> 32);
+	}
+	memcpy(&lo, stage[0], sizeof(lo));
+	memcpy(&hi, stage[1], sizeof(hi));
+
+	for (i = 0; i < 8; i++)
+		h[i] = (B3_VEC){ 0 } + b3_iv[i];
+
+	for (block = 0; block < B3_CHUNK_LEN / B3_BLOCK_LEN; block++) {
+		uint32_t flags = 0;
+
+		if (block == 0)
+			flags |= B3_CHUNK_START;
+		if (block == B3_CHUNK_LEN / B3_BLOCK_LEN - 1)
+			flags |= B3_CHUNK_END;
+
+		for (lane = 0; lane < B3_LANES; lane++) {
+			const unsigned char *p = data + lane * B3_CHUNK_LEN + block * B3_BLOCK_LEN;
+			for (i = 0; i < 16; i++)
+				stage[i][lane] = b3_load32(p + 4 * i);
+		}
+		for (i = 0; i < 16; i++)
+			memcpy(&m[i], stage[i], sizeof(m[i]));
+
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[8 + i] = (B3_VEC){ 0 } + b3_iv[i];
+		v[12] = lo;
+		v[13] = hi;
+		v[14] = (B3_VEC){ 0 } + (uint32_t)B3_BLOCK_LEN;
+		v[15] = (B3_VEC){ 0 } + flags;
+
+		for (r = 0; r < 7; r++) {
+			const unsigned char *s = b3_schedule[r];
+			B3_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+			B3_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+			B3_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+			B3_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+			B3_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+			B3_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+			B3_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+			B3_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (i = 0; i < 8; i++)
+			h[i] = v[i] ^ v[i + 8];
+	}
+
+	for (lane = 0; lane < B3_LANES; lane++)
+		for (i = 0; i < 8; i++)
+			cvs[lane][i] = h[i][lane];
+}
+
+#undef B3_G
+#undef B3_ROR
+#undef B3_LANES
+#undef B3_NAME
+#undef B3_VEC
+#undef B3_TARGET
@@ -0,0 +1,447 @@
+/*
+ * BLAKE3, unkeyed, with the default 32-byte output.
+ *
+ * The input is split into 1 KB chunks, each hashed with its chunk number
+ * as the counter, and the chunk chaining values are combined pairwise in a
+ * binary tree.  The hasher keeps a stack of the chaining values of the
+ * complete subtrees seen so far, merging them as soon as a subtree's
+ * sibling arrives.  The last chunk is held back, so that whichever node
+ * turns out to be the root is compressed with the ROOT flag.
+ *
+ * Whenever the hasher is given several whole chunks at once, they are
+ * hashed together in SIMD lanes (4, 8 or 16, as the CPU allows).
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "blake3.h"
+#include "cpu.h"
+
+enum {
+	B3_CHUNK_START = 1 << 0,
+	B3_CHUNK_END = 1 << 1,
+	B3_PARENT = 1 << 2,
+	B3_ROOT = 1 << 3,
+};
+
+static const uint32_t b3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* The message word order for each round. */
+static const unsigned char b3_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static uint32_t b3_load32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t ror32(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void g(uint32_t v[16], int a, int b, int c, int d, uint32_t mx, uint32_t my)
+{
+	v[a] = v[a] + v[b] + mx;
+	v[d] = ror32(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];
+	v[b] = ror32(v[b] ^ v[c], 12);
+	v[a] = v[a] + v[b] + my;
+	v[d] = ror32(v[d] ^ v[a], 8);
+	v[c] = v[c] + v[d];
+	v[b] = ror32(v[b] ^ v[c], 7);
+}
+
+/* The compression function, leaving the full 16-word state in 'v'. */
+static void compress(const uint32_t cv[8], const unsigned char block[B3_BLOCK_LEN],
+		     unsigned block_len, uint64_t counter, uint32_t flags, uint32_t v[16])
+{
+	uint32_t m[16];
+	int i, r;
+
+	for (i = 0; i < 16; i++)
+		m[i] = b3_load32(block + 4 * i);
+	for (i = 0; i < 8; i++)
+		v[i] = cv[i];
+	for (i = 0; i < 4; i++)
+		v[8 + i] = b3_iv[i];
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (r = 0; r < 7; r++) {
+		const unsigned char *s = b3_schedule[r];
+		g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+		g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+		g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+		g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+		g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+		g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+		g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+}
+
+static void compress_cv(uint32_t cv[8], const unsigned char block[B3_BLOCK_LEN],
+			unsigned block_len, uint64_t counter, uint32_t flags)
+{
+	uint32_t v[16];
+	int i;
+
+	compress(cv, block, block_len, counter, flags, v);
+	for (i = 0; i < 8; i++)
+		cv[i] = v[i] ^ v[i + 8];
+}
+
+static void store_cv(unsigned char *p, const uint32_t cv[8])
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		p[4 * i + 0] = cv[i];
+		p[4 * i + 1] = cv[i] >> 8;
+		p[4 * i + 2] = cv[i] >> 16;
+		p[4 * i + 3] = cv[i] >> 24;
+	}
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8])
+{
+	unsigned char block[B3_BLOCK_LEN];
+	uint32_t cv[8];
+
+	store_cv(block, left);
+	store_cv(block + 32, right);
+	memcpy(cv, b3_iv, sizeof(cv));
+	compress_cv(cv, block, B3_BLOCK_LEN, 0, B3_PARENT);
+	memcpy(out, cv, sizeof(cv));
+}
+
+/* Hash 'lanes' whole chunks, one at a time. */
+static void hash_chunks_portable(const unsigned char *data, uint64_t counter, uint32_t cvs[][8], int lanes)
+{
+	int lane, block;
+
+	for (lane = 0; lane < lanes; lane++) {
+		memcpy(cvs[lane], b3_iv, sizeof(cvs[lane]));
+		for (block = 0; block < B3_CHUNK_LEN / B3_BLOCK_LEN; block++) {
+			uint32_t flags = 0;
+			if (block == 0)
+				flags |= B3_CHUNK_START;
+			if (block == B3_CHUNK_LEN / B3_BLOCK_LEN - 1)
+				flags |= B3_CHUNK_END;
+			compress_cv(cvs[lane], data + lane * B3_CHUNK_LEN + block * B3_BLOCK_LEN,
+				    B3_BLOCK_LEN, counter + lane, flags);
+		}
+	}
+}
+
+#define B3_LANES 4
+#define B3_NAME hash_chunks_4
+#define B3_VEC b3_vec4
+#define B3_TARGET
+#include "blake3-lanes.h"
+
+#ifdef CPU_X86
+#define B3_LANES 8
+#define B3_NAME hash_chunks_8
+#define B3_VEC b3_vec8
+#define B3_TARGET __attribute__((target("avx2")))
+#include "blake3-lanes.h"
+
+#define B3_LANES 16
+#define B3_NAME hash_chunks_16
+#define B3_VEC b3_vec16
+#define B3_TARGET __attribute__((target("avx512f")))
+#include "blake3-lanes.h"
+#endif
+
+typedef void (*hash_chunks_fn)(const unsigned char *data, uint64_t counter, uint32_t cvs[][8]);
+
+static hash_chunks_fn hash_chunks = hash_chunks_4;
+static int lanes = 4;
+static pthread_once_t lanes_once = PTHREAD_ONCE_INIT;
+
+static void select_lanes(void)
+{
+#ifdef CPU_X86
+	if (cpu_x86_avx512f()) {
+		hash_chunks = hash_chunks_16;
+		lanes = 16;
+	} else if (cpu_x86_avx2()) {
+		hash_chunks = hash_chunks_8;
+		lanes = 8;
+	}
+#endif
+}
+
+int b3_lanes(void)
+{
+	pthread_once(&lanes_once, select_lanes);
+	return lanes;
+}
+
+static void chunk_init(b3_chunk_state *chunk, uint64_t counter)
+{
+	memcpy(chunk->cv, b3_iv, sizeof(chunk->cv));
+	chunk->counter = counter;
+	chunk->buf_len = 0;
+	chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_len(const b3_chunk_state *chunk)
+{
+	return B3_BLOCK_LEN * chunk->blocks_compressed + chunk->buf_len;
+}
+
+static uint32_t chunk_start_flag(const b3_chunk_state *chunk)
+{
+	return chunk->blocks_compressed == 0 ? B3_CHUNK_START : 0;
+}
+
+static void chunk_update(b3_chunk_state *chunk, const unsigned char *in, size_t len)
+{
+	while (len > 0) {
+		size_t take;
+
+		/* Only compress a full buffer once more input shows it isn't last. */
+		if (chunk->buf_len == B3_BLOCK_LEN) {
+			compress_cv(chunk->cv, chunk->buf, B3_BLOCK_LEN, chunk->counter,
+				    chunk_start_flag(chunk));
+			chunk->blocks_compressed++;
+			chunk->buf_len = 0;
+		}
+		take = B3_BLOCK_LEN - chunk->buf_len;
+		if (take > len)
+			take = len;
+		memcpy(chunk->buf + chunk->buf_len, in, take);
+		chunk->buf_len += take;
+		in += take;
+		len -= take;
+	}
+}
+
+/*
+ * The node a chunk state or parent will be finalized from: the input
+ * chaining value and the last block, with its flags.
+ */
+struct output {
+	uint32_t cv[8];
+	unsigned char block[B3_BLOCK_LEN];
+	unsigned block_len;
+	uint64_t counter;
+	uint32_t flags;
+};
+
+static void chunk_output(const b3_chunk_state *chunk, struct output *out)
+{
+	memcpy(out->cv, chunk->cv, sizeof(out->cv));
+	memset(out->block, 0, sizeof(out->block));
+	memcpy(out->block, chunk->buf, chunk->buf_len);
+	out->block_len = chunk->buf_len;
+	out->counter = chunk->counter;
+	out->flags = chunk_start_flag(chunk) | B3_CHUNK_END;
+}
+
+static void output_cv(const struct output *out, uint32_t cv[8])
+{
+	memcpy(cv, out->cv, sizeof(out->cv));
+	compress_cv(cv, out->block, out->block_len, out->counter, out->flags);
+}
+
+/*
+ * Add the chaining value of a subtree of 2^level chunks, which brings the
+ * total to 'total' chunks.  Each set bit of the total has its subtree on the
+ * stack, so this merges the way a binary counter carries.
+ */
+static void push_cv(b3_hasher *self, const uint32_t cv[8], int level, uint64_t total)
+{
+	uint32_t merged[8];
+
+	memcpy(merged, cv, sizeof(merged));
+	total >>= level;
+	while ((total & 1) == 0) {
+		self->cv_stack_len--;
+		parent_cv(self->cv_stack[self->cv_stack_len], merged, merged);
+		total >>= 1;
+	}
+	memcpy(self->cv_stack[self->cv_stack_len], merged, sizeof(merged));
+	self->cv_stack_len++;
+}
+
+/* Move a full chunk onto the stack, now that more input has arrived. */
+static void finish_chunk(b3_hasher *self)
+{
+	struct output out;
+	uint32_t cv[8];
+	uint64_t total = self->chunk.counter + 1;
+
+	chunk_output(&self->chunk, &out);
+	output_cv(&out, cv);
+	push_cv(self, cv, 0, total);
+	chunk_init(&self->chunk, total);
+}
+
+void b3_init(b3_hasher *self)
+{
+	pthread_once(&lanes_once, select_lanes);
+	chunk_init(&self->chunk, 0);
+	self->cv_stack_len = 0;
+}
+
+void b3_update(b3_hasher *self, const void *data, size_t len)
+{
+	const unsigned char *in = data;
+
+	while (len > 0) {
+		size_t take;
+
+		if (chunk_len(&self->chunk) == B3_CHUNK_LEN)
+			finish_chunk(self);
+
+		/* Whole chunks, with more input after them, go through the lanes. */
+		while (chunk_len(&self->chunk) == 0 && len > (size_t)lanes * B3_CHUNK_LEN) {
+			uint32_t cvs[16][8];
+			uint64_t counter = self->chunk.counter;
+			int i;
+
+			hash_chunks(in, counter, cvs);
+			for (i = 0; i < lanes; i++)
+				push_cv(self, cvs[i], 0, counter + i + 1);
+			chunk_init(&self->chunk, counter + lanes);
+			in += lanes * B3_CHUNK_LEN;
+			len -= lanes * B3_CHUNK_LEN;
+		}
+
+		take = B3_CHUNK_LEN - chunk_len(&self->chunk);
+		if (take > len)
+			take = len;
+		chunk_update(&self->chunk, in, take);
+		in += take;
+		len -= take;
+	}
+}
+
+void b3_final(const b3_hasher *self, unsigned char out[B3_OUT_LEN])
+{
+	struct output node;
+	unsigned remaining = self->cv_stack_len;
+	uint32_t cv[8];
+
+	chunk_output(&self->chunk, &node);
+	while (remaining > 0) {
+		remaining--;
+		output_cv(&node, cv);
+		store_cv(node.block, self->cv_stack[remaining]);
+		store_cv(node.block + 32, cv);
+		memcpy(node.cv, b3_iv, sizeof(node.cv));
+		node.block_len = B3_BLOCK_LEN;
+		node.counter = 0;
+		node.flags = B3_PARENT;
+	}
+
+	memcpy(cv, node.cv, sizeof(cv));
+	compress_cv(cv, node.block, node.block_len, 0, node.flags | B3_ROOT);
+	store_cv(out, cv);
+}
+
+static int level_of(size_t chunks)
+{
+	int level = 0;
+
+	while (((size_t)1 << level) < chunks)
+		level++;
+	return level;
+}
+
+void b3_subtree_cv(const void *data, size_t chunks, uint64_t counter, uint32_t cv[8])
+{
+	const unsigned char *in = data;
+	b3_hasher tree;
+	size_t done = 0;
+
+	pthread_once(&lanes_once, select_lanes);
+	tree.cv_stack_len = 0;
+
+	/* A subtree of whole chunks collapses to a single stack entry. */
+	while (done < chunks) {
+		uint32_t cvs[16][8];
+		int n = chunks - done >= (size_t)lanes ? lanes : 1;
+		int i;
+
+		if (n > 1)
+			hash_chunks(in + done * B3_CHUNK_LEN, counter + done, cvs);
+		else
+			hash_chunks_portable(in + done * B3_CHUNK_LEN, counter + done, cvs, 1);
+		for (i = 0; i < n; i++)
+			push_cv(&tree, cvs[i], 0, done + i + 1);
+		done += n;
+	}
+	memcpy(cv, tree.cv_stack[0], sizeof(tree.cv_stack[0]));
+}
+
+void b3_push_subtree(b3_hasher *self, const uint32_t cv[8], size_t chunks)
+{
+	uint64_t total;
+
+	if (chunk_len(&self->chunk) == B3_CHUNK_LEN)
+		finish_chunk(self);
+	total = self->chunk.counter + chunks;
+	push_cv(self, cv, level_of(chunks), total);
+	chunk_init(&self->chunk, total);
+}
+
+int b3_self_test(void (*report)(const char *kernel, int passed))
+{
+	static unsigned char buf[16 * B3_CHUNK_LEN];
+	static const struct {
+		const char *name;
+		int lanes;
+		hash_chunks_fn fn;
+		int (*available)(void);
+	} kernels[] = {
+		{ "blake3 x4", 4, hash_chunks_4, 0 },
+#ifdef CPU_X86
+		{ "blake3 avx2 x8", 8, hash_chunks_8, cpu_x86_avx2 },
+		{ "blake3 avx512 x16", 16, hash_chunks_16, cpu_x86_avx512f },
+#endif
+	};
+	unsigned int seed = 11;
+	unsigned k;
+	int i, failures = 0;
+
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		uint32_t expect[16][8], got[16][8];
+		uint64_t counter = 0x0123456789ULL & ~15ULL;
+		int passed;
+
+		if (kernels[k].available && !kernels[k].available())
+			continue;
+		hash_chunks_portable(buf, counter, expect, kernels[k].lanes);
+		kernels[k].fn(buf, counter, got);
+		passed = memcmp(expect, got, sizeof(got[0]) * kernels[k].lanes) == 0;
+		if (!passed)
+			failures++;
+		if (report)
+			report(kernels[k].name, passed);
+	}
+	return failures;
+}
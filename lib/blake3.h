@@ -0,0 +1,61 @@
+/*
+ * BLAKE3, unkeyed, with the default 32-byte output.
+ *
+ * Besides the usual streaming interface, whole subtrees of a large input
+ * can be hashed independently (for instance on different threads) with
+ * b3_subtree_cv, and then added to a hasher in order with b3_push_subtree.
+ */
+
+#ifndef __BLAKE3_H__
+#define __BLAKE3_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define B3_OUT_LEN	32
+#define B3_BLOCK_LEN	64
+#define B3_CHUNK_LEN	1024
+#define B3_MAX_DEPTH	54
+
+typedef struct {
+	uint32_t cv[8];
+	uint64_t counter;
+	unsigned char buf[B3_BLOCK_LEN];
+	unsigned buf_len;
+	unsigned blocks_compressed;
+} b3_chunk_state;
+
+typedef struct {
+	b3_chunk_state chunk;
+	unsigned cv_stack_len;
+	uint32_t cv_stack[B3_MAX_DEPTH][8];
+} b3_hasher;
+
+void b3_init(b3_hasher *self);
+void b3_update(b3_hasher *self, const void *data, size_t len);
+void b3_final(const b3_hasher *self, unsigned char out[B3_OUT_LEN]);
+
+/*
+ * The chaining value of 'chunks' whole chunks of 'data', which begin at
+ * chunk number 'counter'.  'chunks' must be a power of two, and 'counter' a
+ * multiple of it.
+ */
+void b3_subtree_cv(const void *data, size_t chunks, uint64_t counter, uint32_t cv[8]);
+
+/*
+ * Add a subtree from b3_subtree_cv to the hasher, which must have been given
+ * exactly 'counter' chunks of input so far.  The subtree can't be the end of
+ * the input: at least one more byte must follow.
+ */
+void b3_push_subtree(b3_hasher *self, const uint32_t cv[8], size_t chunks);
+
+/* How many chunks are hashed at once in SIMD lanes. */
+int b3_lanes(void);
+
+/*
+ * Check the SIMD kernels against the portable code, as blk_SHA1_SelfTest.
+ * This must not run while other threads are hashing.
+ */
+int b3_self_test(void (*report)(const char *kernel, int passed));
+
+#endif
@@ -1,31 +1,199 @@
 // Comparing two trees.
 
+extern "C" {
+#include <time.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <deque>
 #include <map>
+#include <memory>
+#include <sstream>
 #include <stack>
 #include <iostream>
 #include <vector>
 #include "compare.hh"
+#include "delta.hh"
+#include "exn.hh"
+#include "moves.hh"
+#include "thread.hh"
 
 namespace asure {
 
+CheckOptions::CheckOptions() :
+    statFirst(false), sampleRate(0.01), seed(0),
+    ignore(tree::Attrs::bit(tree::Attrs::CTIME) | tree::Attrs::bit(tree::Attrs::CTIMENS) |
+           tree::Attrs::bit(tree::Attrs::INO)),
+    root("."), moves(false), moveMemory(64 << 20)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  seed = (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec + getpid();
+}
+
 namespace {
 
 using tree::Node;
+using tree::Attrs;
+
+// Decides which of a run of files to sample.  Samplers with the same seed,
+// asked in the same order, make the same choices.
+class Sampler {
+ public:
+  Sampler(double rate, unsigned long long seed) : rate_(rate), state_(seed) { }
+
+  bool next() {
+    // splitmix64.
+    unsigned long long z = (state_ += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0) < rate_;
+  }
+
+ private:
+  double rate_;
+  unsigned long long state_;
+};
+
+// Attributes that are only compared when both sides have them: the digest,
+// since only those made with the same algorithm can be compared, and those
+// that older surefiles don't record.
+Attrs::Mask const optionalFields =
+  Attrs::bit(Attrs::DIGEST) | Attrs::bit(Attrs::SIZE) | Attrs::bit(Attrs::NLINK) |
+  Attrs::bit(Attrs::MTIMENS) | Attrs::bit(Attrs::CTIMENS);
+
+// Whether an attribute outside the schema belongs to one of the fields in
+// 'mask', such as a second digest, or a number that didn't parse.
+bool extraIn(std::string const& key, Attrs::Mask mask)
+{
+  Attrs::Field field;
+  return Attrs::byName(key, field) && (mask & Attrs::bit(field)) != 0;
+}
+
+std::string const* findExtra(Attrs const& attrs, std::string const& key)
+{
+  typedef Attrs::Extras::const_iterator Iter;
+  for (Iter i = attrs.extras().begin(); i != attrs.extras().end(); ++i) {
+    if (i->first == key)
+      return &i->second;
+  }
+  return 0;
+}
+
+// Whether the cheap atts of the new node are the same as the old node's,
+// which has its digests among its atts as well.
+bool sameCheapAtts(Node const& oldNode, Node const& newNode)
+{
+  Attrs const& oldAttrs = oldNode.getAttrs();
+  Attrs const& newAttrs = newNode.getAttrs();
+  Attrs::Mask const cheap = ~Attrs::bit(Attrs::DIGEST);
+  if ((oldAttrs.present() & cheap) != (newAttrs.present() & cheap))
+    return false;
+  for (int f = 0; f < Attrs::DIGEST; ++f) {
+    if (oldAttrs.has(Attrs::Field(f)) && !Attrs::same(oldAttrs, newAttrs, Attrs::Field(f)))
+      return false;
+  }
+
+  typedef Attrs::Extras::const_iterator Iter;
+  size_t oldCount = 0;
+  for (Iter i = oldAttrs.extras().begin(); i != oldAttrs.extras().end(); ++i) {
+    if (!Digest::isDigestKey(i->first))
+      ++oldCount;
+  }
+  if (oldCount != newAttrs.extras().size())
+    return false;
+  for (Iter i = newAttrs.extras().begin(); i != newAttrs.extras().end(); ++i) {
+    std::string const* old = findExtra(oldAttrs, i->first);
+    if (old == 0 || *old != i->second)
+      return false;
+  }
+  return true;
+}
+
+// Whether two nodes have exactly the same attributes.
+bool sameAttrs(Attrs const& a, Attrs const& b)
+{
+  if (a.present() != b.present() || a.extras().size() != b.extras().size())
+    return false;
+  for (int f = 0; f < Attrs::FIELD_COUNT; ++f) {
+    if (a.has(Attrs::Field(f)) && !Attrs::same(a, b, Attrs::Field(f)))
+      return false;
+  }
+  typedef Attrs::Extras::const_iterator Iter;
+  for (Iter i = a.extras().begin(); i != a.extras().end(); ++i) {
+    std::string const* other = findExtra(b, i->first);
+    if (other == 0 || *other != i->second)
+      return false;
+  }
+  return true;
+}
+
+// Whether two directories are known to hold exactly the same, by their
+// tree digests.
+bool sameTree(Node const& a, Node const& b)
+{
+  Hash const* const left = a.getTreeDigest();
+  Hash const* const right = b.getTreeDigest();
+  return left != 0 && right != 0 && left->length == right->length &&
+    std::memcmp(left->data, right->data, left->length) == 0;
+}
+
+// What a merge of the old and new trees finds, in the order it finds it.
+// The Comparer, Updater and DeltaUpdater are each one, so that one merge
+// can drive several of them at once.  The nodes they are given are only
+// good until the call returns.
+class MergeSink {
+ public:
+  virtual ~MergeSink() { }
+
+  // A directory both trees have, as it is entered, when its files are
+  // reached, and as it is left.
+  virtual void enter(Node const& left, Node const& right) = 0;
+  virtual void mark(Node const& right) = 0;
+  virtual void leave(Node const& right) = 0;
+
+  // A file both trees have.
+  virtual void file(Node const& left, Node const& right) = 0;
+
+  // A directory or file only the old tree has, or only the new one.  For a
+  // directory, returns whether to be given everything within it as well,
+  // through to its LEAVE.
+  virtual bool removed(Node const& left) = 0;
+  virtual void removedWithin(Node const& /*node*/) { }
+  virtual bool added(Node const& right) = 0;
+  virtual void addedWithin(Node const& /*node*/) { }
 
-// Implementation class to help with the combining of two trees.
+  // Whether a directory that both trees have exactly the same of can be
+  // passed over without a word.
+  virtual bool skipsSame() const { return false; }
+
+  // Whether to be given what is within a directory both trees have, or to
+  // have it passed over, having been dealt with some other way.
+  virtual bool descend(Node const& /*left*/, Node const& /*right*/) { return true; }
+};
+
+// Implementation class to help with the combining of two trees.  It walks
+// both trees in step, and tells the sinks what it finds.
 class Combiner {
  public:
   Combiner(tree::NodeIterator& left_, tree::NodeIterator& right_) :
-      left(left_), right(right_)
+      left(left_), right(right_), sinks()
   {
     assert(left->getKind() == Node::ENTER);
     assert(right->getKind() == Node::ENTER);
   }
 
- protected:
+  void add(MergeSink& sink) { sinks.push_back(&sink); }
+  void dir();
+
+ private:
   tree::NodeIterator& left;
   tree::NodeIterator& right;
+  std::vector<MergeSink*> sinks;
 
   // Utility operations.
   bool isLeftMark() { return left->getKind() == Node::MARK; }
@@ -39,17 +207,39 @@ class Combiner {
 
   std::string const& leftName() { return left->getName(); }
   std::string const& rightName() { return right->getName(); }
+
+  void only(tree::NodeIterator& tree, bool old);
 };
 
-class Comparer : Combiner {
+class Comparer : public MergeSink {
  public:
-  Comparer(tree::NodeIterator& left_, tree::NodeIterator& right_) :
-      Combiner(left_, right_), path()
+  explicit Comparer(CheckOptions const& options_, std::ostream& report_ = std::cout) :
+      path(), options(options_), report(report_), sampler(options_.sampleRate, options_.seed),
+      statOnly(0), byContent(0), moves(), held()
   {
-    push(".");
+    if (options.moves)
+      moves.reset(new MoveIndex(options.moveMemory));
   }
 
-  void dir();
+  void enter(Node const& left, Node const& right);
+  void mark(Node const& /*right*/) { }
+  void leave(Node const& /*right*/) { pop(); }
+  void file(Node const& left, Node const& right);
+  bool removed(Node const& left);
+  void removedWithin(Node const& node) { index(MoveIndex::REMOVED, node); }
+  bool added(Node const& right);
+  void addedWithin(Node const& node) { index(MoveIndex::ADDED, node); }
+  bool skipsSame() const { return true; }
+
+  void summary();
+
+  // The files checked, for a summary of comparisons made apart.
+  unsigned long checkedByStat() const { return statOnly; }
+  unsigned long checkedByContent() const { return byContent; }
+  void addChecked(unsigned long byStat, unsigned long content) {
+    statOnly += byStat;
+    byContent += content;
+  }
 
   void push(std::string const& name) {
     if (path.empty())
@@ -63,96 +253,147 @@ class Comparer : Combiner {
   std::string& getPath() { return path.top(); }
  private:
   std::stack<std::string> path;
+  CheckOptions const& options;
+  std::ostream& report;
+  Sampler sampler;
 
-  void compareAtts();
+  // Files found unchanged by their cheap atts alone, and by their contents.
+  unsigned long statOnly;
+  unsigned long byContent;
 
-  void skipLeft();
-  void skipRight();
+  // When finding moves, what was removed and added goes to the index, and
+  // the other lines are held, to go into the report in order with them.
+  std::auto_ptr<MoveIndex> moves;
+  std::ostringstream held;
+
+  std::ostream& out() { return moves.get() != 0 ? held : report; }
+  void note();
+
+  void compareAtts(Node const& left, Node const& right, bool hash = true);
+  void compareExtras(Attrs const& latts, Attrs const& ratts, bool hash,
+                     std::vector<std::string>& diffs);
+  void compareFile(Node const& left, Node const& right);
+
+  void index(MoveIndex::Side side, Node const& node);
 };
 
-class Updater : Combiner {
+class Updater : public MergeSink {
  public:
-  Updater(tree::NodeIterator& left_, tree::NodeIterator& right_,
-          SurefileSaver& saver_) :
-      Combiner(left_, right_), saver(saver_) { }
+  Updater(SurefileSaver& saver_, bool reuseHashes_, size_t renameMemory) :
+      saver(saver_), reuseHashes(reuseHashes_),
+      renames(reuseHashes_ && renameMemory > 0 ? new RenameCache(renameMemory) : 0) { }
 
-  void dir();
+  void enter(Node const& /*left*/, Node const& right) { saver.writeNode(right); }
+  void mark(Node const& right) { saver.writeNode(right); }
+  void leave(Node const& right) { saver.writeNode(right); }
+  void file(Node const& left, Node const& right);
+  bool removed(Node const& left);
+  void removedWithin(Node const& node) { removed(node); }
+  bool added(Node const& right);
+  void addedWithin(Node const& node) { added(node); }
 
  private:
   SurefileSaver& saver;
 
-  void skipLeft();
-  void storeRight();
-  bool sameAtt(std::string const& aname);
+  // Whether the old tree's hashes are of the same digest as the new ones.
+  bool reuseHashes;
+
+  // The removed files, to keep the hashes of those that were renamed.
+  std::auto_ptr<RenameCache> renames;
 };
 
-void Comparer::compareAtts()
-{
-  Node::Atts latts = left->getFullAtts();
-  Node::Atts ratts = right->getFullAtts();
+class DeltaUpdater : public MergeSink {
+ public:
+  DeltaUpdater(SurefileSaver& saver_, bool reuseHashes_, size_t renameMemory) :
+      saver(saver_), reuseHashes(reuseHashes_),
+      renames(reuseHashes_ && renameMemory > 0 ? new RenameCache(renameMemory) : 0), open() { }
 
-  latts.erase("ctime");
-  ratts.erase("ctime");
-  latts.erase("ino");
-  ratts.erase("ino");
+  void enter(Node const& left, Node const& right);
+  void mark(Node const& right);
+  void leave(Node const& right);
+  void file(Node const& left, Node const& right);
+  bool removed(Node const& left);
+  void removedWithin(Node const& node);
+  bool added(Node const& right);
+  void addedWithin(Node const& node);
 
-  std::vector<std::string> diffs;
-  typedef Node::Atts::const_iterator Iter;
-
-  Iter const lend = latts.end();
-  Iter const rend = ratts.end();
-
-  Iter lpos = latts.begin();
-  Iter rpos = ratts.begin();
-
-  while (lpos != lend && rpos != rend) {
-    if (rpos == rend || (lpos != lend && lpos->first < rpos->first)) {
-      std::cout << "Missing attribute: " << lpos->first << '\n';
-      ++lpos;
-    } else if (lpos == lend || (lpos->first > rpos->first)) {
-      std::cout << "Extra attribute: " << rpos->first << '\n';
-      ++rpos;
-    } else {
-      if (lpos->second != rpos->second) {
-        diffs.push_back(lpos->first);
-      }
-      ++lpos;
-      ++rpos;
-    }
-  }
+ private:
+  SurefileSaver& saver;
+  bool reuseHashes;
+  std::auto_ptr<RenameCache> renames;
 
-  if (!diffs.empty()) {
-    int len = 0;
-    std::cout << "  [";
+  // The directories in both trees that are being walked, which are only
+  // written once something in them has changed.
+  struct Pending {
+    Pending(std::string const& name_, Attrs const& attrs_) :
+        name(name_), attrs(attrs_), written(false), files(false) { }
+    std::string name;
+    Attrs attrs;
+    bool written;
+    // Whether the MARK has been reached.
+    bool files;
+  };
+  std::vector<Pending> open;
 
-    typedef std::vector<std::string>::const_iterator DI;
-    DI const begin = diffs.begin();
-    DI const end = diffs.end();
-    for (DI i = begin; i != end; ++i) {
-      if (i != begin) {
-        ++len;
-        std::cout << ',';
-      }
-      std::cout << *i;
-      len += i->length();
-    }
-    for (; len < 20; ++len) {
-      std::cout << ' ';
-    }
-    std::cout << "] " << getPath() << '\n';
+  void flush();
+  void write(Node::Kind kind, std::string const& name, Attrs const& attrs);
+};
+
+// Compare an att of two nodes.  Returns 1 if they are the same, 0 if they
+// differ, and -1 if either node doesn't have it.
+int compareAtt(Node const& oldNode, Node const& newNode, Attrs::Field field)
+{
+  Attrs const& oldAttrs = oldNode.getAttrs();
+  Attrs const& newAttrs = newNode.getAttrs();
+  if (!oldAttrs.has(field) || !newAttrs.has(field))
+    return -1;
+  return Attrs::same(oldAttrs, newAttrs, field);
+}
+
+// Whether the file's old hash can be reused.  The inode and ctime must
+// match, and so must the size and times to the nanosecond, except with
+// older surefiles, which don't record those.
+bool unchanged(Node const& oldNode, Node const& newNode)
+{
+  if (compareAtt(oldNode, newNode, Attrs::INO) != 1 ||
+      compareAtt(oldNode, newNode, Attrs::CTIME) != 1)
+    return false;
+  Attrs::Field const more[] = { Attrs::CTIMENS, Attrs::MTIME, Attrs::MTIMENS, Attrs::SIZE };
+  for (size_t i = 0; i < sizeof(more) / sizeof(more[0]); ++i) {
+    if (compareAtt(oldNode, newNode, more[i]) == 0)
+      return false;
   }
+  return true;
 }
 
-// Called when comparing two directories, where the names match.
-void Comparer::dir()
+// Whether the file's size has changed, so that it has changed without
+// needing to be hashed.
+bool sizeDiffers(Node const& oldNode, Node const& newNode)
 {
-  compareAtts();
+  return compareAtt(oldNode, newNode, Attrs::SIZE) == 0;
+}
 
-  // std::cout << "Comparing: " << getPath() << '\n';
+// Called on two directories, where the names match.
+void Combiner::dir()
+{
   assert(isLeftEnter());
   assert(isRightEnter());
   assert(leftName() == rightName());
 
+  // Identical trees can be passed over, if nothing needs to see them.
+  bool skip = sameTree(*left, *right);
+  for (size_t i = 0; i < sinks.size() && skip; ++i)
+    skip = sinks[i]->skipsSame();
+  for (size_t i = 0; i < sinks.size() && !skip; ++i)
+    skip = !sinks[i]->descend(*left, *right);
+  if (skip) {
+    left.skipTree();
+    right.skipTree();
+    return;
+  }
+
+  for (size_t i = 0; i < sinks.size(); ++i)
+    sinks[i]->enter(*left, *right);
   ++left;
   ++right;
 
@@ -160,21 +401,19 @@ void Comparer::dir()
   while (isLeftEnter() || isRightEnter()) {
     assert(!isLeftLeave());
     assert(!isRightLeave());
-    if (!isRightEnter() || (isLeftEnter() && leftName() < rightName())) {
-      skipLeft();
-    } else if (!isLeftEnter() || leftName() > rightName()) {
-      skipRight();
-    } else {
-      // Both on the same dir.
-      push(leftName());
+    if (!isRightEnter() || (isLeftEnter() && leftName() < rightName()))
+      only(left, true);
+    else if (!isLeftEnter() || leftName() > rightName())
+      only(right, false);
+    else
       dir();
-      pop();
-    }
   }
 
   // Both nodes are sitting on mark.
   assert(isLeftMark());
   assert(isRightMark());
+  for (size_t i = 0; i < sinks.size(); ++i)
+    sinks[i]->mark(*right);
   ++left;
   ++right;
 
@@ -182,16 +421,13 @@ void Comparer::dir()
   while (isLeftNode() || isRightNode()) {
     assert(!isLeftEnter());
     assert(!isRightEnter());
-    if (!isRightNode() || (isLeftNode() && leftName() < rightName())) {
-      std::cout << "- file                   " << getPath() << '/' << leftName() << '\n';
-      ++left;
-    } else if (!isLeftNode() || leftName() > rightName()) {
-      std::cout << "+ file                   " << getPath() << '/' << rightName() << '\n';
-      ++right;
-    } else {
-      push(leftName());
-      compareAtts();
-      pop();
+    if (!isRightNode() || (isLeftNode() && leftName() < rightName()))
+      only(left, true);
+    else if (!isLeftNode() || leftName() > rightName())
+      only(right, false);
+    else {
+      for (size_t i = 0; i < sinks.size(); ++i)
+        sinks[i]->file(*left, *right);
       ++left;
       ++right;
     }
@@ -199,171 +435,813 @@ void Comparer::dir()
 
   assert(isLeftLeave());
   assert(isRightLeave());
+  for (size_t i = 0; i < sinks.size(); ++i)
+    sinks[i]->leave(*right);
   ++left;
   ++right;
 }
 
+// Called on a directory or file only one of the trees has, the old one if
+// 'old' is set, moving past it.
+void Combiner::only(tree::NodeIterator& tree, bool old)
+{
+  bool const isDir = tree->getKind() == Node::ENTER;
+  std::vector<MergeSink*> within;
+  for (size_t i = 0; i < sinks.size(); ++i) {
+    bool const wanted = old ? sinks[i]->removed(*tree) : sinks[i]->added(*tree);
+    if (wanted && isDir)
+      within.push_back(sinks[i]);
+  }
+  if (!isDir) {
+    ++tree;
+    return;
+  }
+  if (within.empty()) {
+    tree.skipTree();
+    return;
+  }
+
+  ++tree;
+  int depth = 1;
+  while (depth > 0) {
+    Node const& node = *tree;
+    if (node.getKind() == Node::ENTER)
+      ++depth;
+    else if (node.getKind() == Node::LEAVE)
+      --depth;
+    for (size_t i = 0; i < within.size(); ++i) {
+      if (old)
+        within[i]->removedWithin(node);
+      else
+        within[i]->addedWithin(node);
+    }
+    ++tree;
+  }
+}
+
+void Comparer::compareAtts(Node const& left, Node const& right, bool hash)
+{
+  Attrs lstorage, rstorage;
+  Attrs const& latts = left.getFullAttrs(lstorage);
+  Attrs const& ratts = hash ? right.getFullAttrs(rstorage) : right.getAttrs();
+
+  Attrs::Mask lpresent = latts.present() & ~options.ignore;
+  Attrs::Mask rpresent = ratts.present() & ~options.ignore;
+  Attrs::Mask const digest = Attrs::bit(Attrs::DIGEST);
+
+  std::vector<std::string> diffs;
+
+  // Without the hash, the digests are known to differ.
+  if (!hash && (lpresent & digest) != 0) {
+    diffs.push_back(latts.key(Attrs::DIGEST));
+    lpresent &= ~digest;
+  }
+  if ((lpresent & rpresent & digest) != 0 && latts.algorithm() != ratts.algorithm()) {
+    lpresent &= ~digest;
+    rpresent &= ~digest;
+  }
+
+  Attrs::Mask const unshared = (lpresent ^ rpresent) & optionalFields;
+  lpresent &= ~unshared;
+  rpresent &= ~unshared;
+
+  for (int f = 0; f < Attrs::FIELD_COUNT; ++f) {
+    Attrs::Field const field = Attrs::Field(f);
+    Attrs::Mask const bit = Attrs::bit(field);
+    if ((lpresent & bit) != 0 && (rpresent & bit) == 0)
+      out() << "Missing attribute: " << latts.key(field) << '\n';
+    else if ((lpresent & bit) == 0 && (rpresent & bit) != 0)
+      out() << "Extra attribute: " << ratts.key(field) << '\n';
+    else if ((lpresent & bit) != 0 && !Attrs::same(latts, ratts, field))
+      diffs.push_back(latts.key(field));
+  }
+  if (!latts.extras().empty() || !ratts.extras().empty())
+    compareExtras(latts, ratts, hash, diffs);
+
+  if (!diffs.empty()) {
+    std::sort(diffs.begin(), diffs.end());
+    int len = 0;
+    out() << "  [";
+
+    typedef std::vector<std::string>::const_iterator DI;
+    DI const begin = diffs.begin();
+    DI const end = diffs.end();
+    for (DI i = begin; i != end; ++i) {
+      if (i != begin) {
+        ++len;
+        out() << ',';
+      }
+      out() << *i;
+      len += i->length();
+    }
+    for (; len < 20; ++len) {
+      out() << ' ';
+    }
+    out() << "] " << getPath() << '\n';
+  }
+}
+
+// The attributes outside the schema are compared by name, as strings.
+void Comparer::compareExtras(Attrs const& latts, Attrs const& ratts, bool hash,
+                             std::vector<std::string>& diffs)
+{
+  typedef Attrs::Extras::const_iterator Iter;
+  for (Iter i = latts.extras().begin(); i != latts.extras().end(); ++i) {
+    if (extraIn(i->first, options.ignore))
+      continue;
+    if (!hash && Digest::isDigestKey(i->first)) {
+      diffs.push_back(i->first);
+      continue;
+    }
+    std::string const* other = findExtra(ratts, i->first);
+    if (other == 0) {
+      if (!extraIn(i->first, optionalFields))
+        out() << "Missing attribute: " << i->first << '\n';
+    } else if (*other != i->second) {
+      diffs.push_back(i->first);
+    }
+  }
+  for (Iter i = ratts.extras().begin(); i != ratts.extras().end(); ++i) {
+    if (extraIn(i->first, options.ignore | optionalFields))
+      continue;
+    if (findExtra(latts, i->first) == 0)
+      out() << "Extra attribute: " << i->first << '\n';
+  }
+}
+
+// Compare a file present in both trees, not reading it if its cheap atts
+// are enough.
+void Comparer::compareFile(Node const& left, Node const& right)
+{
+  if (sizeDiffers(left, right)) {
+    ++statOnly;
+    compareAtts(left, right, false);
+    return;
+  }
+  if (options.statFirst && sameCheapAtts(left, right) && !sampler.next()) {
+    ++statOnly;
+    return;
+  }
+  ++byContent;
+  compareAtts(left, right);
+}
+
+// Pass the lines held since the last to the move index.
+void Comparer::note()
+{
+  if (moves.get() == 0 || held.tellp() == 0)
+    return;
+  moves->note(held.str());
+  held.str(std::string());
+}
+
+void Comparer::summary()
+{
+  if (moves.get() != 0)
+    moves->report(report);
+  if (options.statFirst)
+    report << statOnly << " files checked by stat only, "
+      << byContent << " by content\n";
+}
+
+// Called when comparing two directories, where the names match.
+void Comparer::enter(Node const& left, Node const& right)
+{
+  push(path.empty() ? options.root : right.getName());
+  compareAtts(left, right);
+  note();
+}
+
+void Comparer::file(Node const& left, Node const& right)
+{
+  push(left.getName());
+  compareFile(left, right);
+  note();
+  pop();
+}
+
+bool Comparer::removed(Node const& left)
+{
+  if (moves.get() != 0) {
+    index(MoveIndex::REMOVED, left);
+    return true;
+  }
+  report << (left.getKind() == Node::ENTER ? "- dir                    " :
+                "- file                   ") << getPath() << '/' << left.getName() << '\n';
+  return false;
+}
+
+bool Comparer::added(Node const& right)
+{
+  if (moves.get() != 0) {
+    index(MoveIndex::ADDED, right);
+    return true;
+  }
+  report << (right.getKind() == Node::ENTER ? "+ dir                    " :
+                "+ file                   ") << getPath() << '/' << right.getName() << '\n';
+  return false;
+}
+
+// Give the move index a node of a removed or added file or directory.
+void Comparer::index(MoveIndex::Side side, Node const& node)
+{
+  if (node.getKind() == Node::ENTER) {
+    push(node.getName());
+    moves->enter(side, getPath());
+  } else if (node.getKind() == Node::LEAVE) {
+    moves->leave();
+    pop();
+  } else if (node.getKind() == Node::NODE) {
+    Attrs storage;
+    moves->file(side, getPath() + '/' + node.getName(), node.getFullAttrs(storage));
+  }
+}
+
 // A node referencing another node, with augmented attributes.
 class AttNode : public Node {
  public:
-  AttNode(Node const& other_, Node::Atts const& fullAtts_) :
-      other(other_), fullAtts(fullAtts_) { }
+  AttNode(Node const& other_, Attrs const& fullAttrs_) :
+      other(other_), fullAttrs(fullAttrs_) { }
   ~AttNode() { }
 
   Kind getKind() const { return other.getKind(); }
   std::string const& getName() const { return other.getName(); }
-  Atts const& getAtts() const { return fullAtts; }
+  Attrs const& getAttrs() const { return fullAttrs; }
 
  private:
   Node const& other;
-  Node::Atts const& fullAtts;
+  Attrs const& fullAttrs;
 };
 
-// Called to update a directory.
-void Updater::dir()
+// The attributes of an unchanged file: the current atts, which may include
+// some an older surefile lacks, with the old digests.
+void reuseDigests(Node const& oldNode, Node const& newNode, Attrs& fullAttrs)
 {
-  assert(isLeftEnter());
-  assert(isRightEnter());
-  assert(leftName() == rightName());
+  fullAttrs = newNode.getAttrs();
+  Attrs storage;
+  Attrs const& oldAttrs = oldNode.getFullAttrs(storage);
+  if (oldAttrs.has(Attrs::DIGEST))
+    fullAttrs.setDigest(oldAttrs.algorithm(), oldAttrs.digest());
+  typedef Attrs::Extras::const_iterator Iter;
+  for (Iter i = oldAttrs.extras().begin(); i != oldAttrs.extras().end(); ++i) {
+    if (Digest::isDigestKey(i->first))
+      fullAttrs.set(i->first, i->second);
+  }
+}
 
-  saver.writeNode(*right);
+// Write a node of the new tree that isn't in the old one, with the digest it
+// had under its old name if it was renamed.
+void writeAdded(SurefileSaver& saver, Node const& node, RenameCache const* renames)
+{
+  Attrs reused;
+  if (renames != 0 && node.getKind() == Node::NODE && renames->find(node.getAttrs(), reused)) {
+    AttNode tmp(node, reused);
+    saver.writeNode(tmp);
+  } else
+    saver.writeNode(node);
+}
 
-  ++left;
-  ++right;
+// Write 'right' node, possibly using the old atts.
+void Updater::file(Node const& left, Node const& right)
+{
+  if (reuseHashes && unchanged(left, right)) {
+    Attrs fullAttrs;
+    reuseDigests(left, right, fullAttrs);
+    AttNode tmp(right, fullAttrs);
+    saver.writeNode(tmp);
+  } else {
+    saver.writeNode(right);
+  }
+}
 
-  // Walk through the subdirectories of both nodes.
-  while (isLeftEnter() || isRightEnter()) {
-    assert(!isLeftLeave());
-    assert(!isRightLeave());
-    if (!isRightEnter() || (isLeftEnter() && leftName() < rightName())) {
-      // The left can just be skipped.
-      skipLeft();
-    } else if (!isLeftEnter() || leftName() > rightName()) {
-      // A new directory is just written out.
-      storeRight();
-    } else {
-      // Both on the same dir, recurse.
-      dir();
-    }
+// Removed files are only remembered, in case they were renamed.
+bool Updater::removed(Node const& left)
+{
+  if (renames.get() == 0)
+    return false;
+  if (left.getKind() == Node::NODE) {
+    Attrs storage;
+    renames->removed(left.getFullAttrs(storage));
   }
+  return true;
+}
 
-  // Both nodes are sitting on mark.
-  assert(isLeftMark());
-  assert(isRightMark());
-  saver.writeNode(*right);
-  ++left;
-  ++right;
+// A new directory or file is just written out, whole.
+bool Updater::added(Node const& right)
+{
+  writeAdded(saver, right, renames.get());
+  return true;
+}
 
-  // Compare the files themselves.
-  while (isLeftNode() || isRightNode()) {
-    assert(!isLeftEnter());
-    assert(!isRightEnter());
-    if (!isRightNode() || (isLeftNode() && leftName() < rightName())) {
-      // Removed file, nothing to do.
-      ++left;
-    } else if (!isLeftNode() || leftName() > rightName()) {
-      // Added file, write out full node information.
-      saver.writeNode(*right);
-      ++right;
-    } else {
-      // Write 'right' node, possibly using new atts.
-      if (sameAtt("ino") && sameAtt("ctime")) {
-        Node::Atts fullAtts = left->getExpensiveAtts();
-        Node::Atts const& mainAtts = left->getAtts();
-        fullAtts.insert(mainAtts.begin(), mainAtts.end());
-
-        AttNode tmp(*right, fullAtts);
-        saver.writeNode(tmp);
-      } else {
-        saver.writeNode(*right);
+// Write the directories entered that haven't been, so that what changed
+// within them can be.
+void DeltaUpdater::flush()
+{
+  for (size_t i = 0; i < open.size(); ++i) {
+    Pending& pending = open[i];
+    if (pending.written)
+      continue;
+    write(Node::ENTER, pending.name, pending.attrs);
+    if (pending.files)
+      write(Node::MARK, std::string(), Attrs());
+    pending.written = true;
+  }
+}
+
+void DeltaUpdater::write(Node::Kind kind, std::string const& name, Attrs const& attrs)
+{
+  DeltaNode node(kind, name, attrs);
+  saver.writeNode(node);
+}
+
+// Called on a directory in both trees.  Directories are held back until
+// something in them has changed, except for the root.
+void DeltaUpdater::enter(Node const& left, Node const& right)
+{
+  Attrs lstorage, rstorage;
+  Attrs const& oldAttrs = left.getFullAttrs(lstorage);
+  Attrs const& newAttrs = right.getFullAttrs(rstorage);
+  bool const same = sameAttrs(oldAttrs, newAttrs);
+  Attrs attrs;
+  if (same)
+    DeltaOp::mark(attrs, DeltaOp::KEEP);
+  else {
+    attrs = newAttrs;
+    DeltaOp::mark(attrs, oldAttrs);
+  }
+  open.push_back(Pending(right.getName(), attrs));
+  if (!same || open.size() == 1)
+    flush();
+}
+
+void DeltaUpdater::mark(Node const& /*right*/)
+{
+  open.back().files = true;
+  if (open.back().written)
+    write(Node::MARK, std::string(), Attrs());
+}
+
+void DeltaUpdater::leave(Node const& /*right*/)
+{
+  if (open.back().written)
+    write(Node::LEAVE, std::string(), Attrs());
+  open.pop_back();
+}
+
+void DeltaUpdater::file(Node const& left, Node const& right)
+{
+  Attrs reused, newStorage, oldStorage;
+  bool const reuse = reuseHashes && unchanged(left, right);
+  if (reuse)
+    reuseDigests(left, right, reused);
+  Attrs const& fileAttrs = reuse ? reused : right.getFullAttrs(newStorage);
+  Attrs const& oldFileAttrs = left.getFullAttrs(oldStorage);
+  if (!sameAttrs(oldFileAttrs, fileAttrs)) {
+    flush();
+    Attrs changed = fileAttrs;
+    DeltaOp::mark(changed, oldFileAttrs);
+    write(Node::NODE, right.getName(), changed);
+  }
+}
+
+// A directory or file only in the old tree is written with its attributes,
+// but nothing below it.
+bool DeltaUpdater::removed(Node const& left)
+{
+  flush();
+  Attrs storage;
+  Attrs attrs = left.getFullAttrs(storage);
+  DeltaOp::mark(attrs, DeltaOp::DEL);
+  write(left.getKind(), left.getName(), attrs);
+  if (left.getKind() == Node::ENTER) {
+    write(Node::MARK, std::string(), Attrs());
+    write(Node::LEAVE, std::string(), Attrs());
+  } else if (renames.get() != 0)
+    renames->removed(attrs);
+  return renames.get() != 0;
+}
+
+// What was within it is only remembered, in case it was renamed.
+void DeltaUpdater::removedWithin(Node const& node)
+{
+  if (node.getKind() == Node::NODE) {
+    Attrs storage;
+    renames->removed(node.getFullAttrs(storage));
+  }
+}
+
+// One only in the new tree is written whole, with only itself marked.
+bool DeltaUpdater::added(Node const& right)
+{
+  flush();
+  Attrs storage;
+  Attrs attrs;
+  if (renames.get() == 0 || right.getKind() != Node::NODE ||
+      !renames->find(right.getAttrs(), attrs))
+    attrs = right.getFullAttrs(storage);
+  DeltaOp::mark(attrs, DeltaOp::ADD);
+  write(right.getKind(), right.getName(), attrs);
+  return true;
+}
+
+void DeltaUpdater::addedWithin(Node const& node)
+{
+  writeAdded(saver, node, renames.get());
+}
+
+// Follows the old tree in step with the new tree as the new nodes are read
+// ahead, to predict which of them the Comparer or Updater, or both, will
+// ask to have hashed.  The merge mirrors the one in Combiner::dir.
+class HashPredictor : public tree::HashFilter {
+ public:
+  HashPredictor(tree::NodeIterator* old_, bool check_, bool update_,
+                CheckOptions const& options_ = CheckOptions(), size_t renameMemory = 0) :
+      old(old_), check(check_), update(update_), options(options_),
+      sampler(options_.sampleRate, options_.seed), matched(),
+      renames(update_ && renameMemory > 0 ? new RenameCache(renameMemory) : 0) { }
+
+  bool wanted(Node const& node);
+
+ private:
+  std::auto_ptr<tree::NodeIterator> old;
+
+  // Whether the Comparer is to be given the new tree, and whether the
+  // Updater is, which reuses the old hash of files whose ino and ctime
+  // haven't changed, and hashes every file that is new.
+  bool check;
+  bool update;
+
+  // For the Comparer, which files it will hash, making the same choices.
+  CheckOptions const options;
+  Sampler sampler;
+
+  // For each directory entered, whether the old tree also has it.
+  std::vector<bool> matched;
+
+  // For the Updater, when it keeps the hashes of renamed files, the same
+  // files it will find.
+  std::auto_ptr<RenameCache> renames;
+
+  void skipLeft();
+  void skipFile();
+};
+
+void HashPredictor::skipLeft()
+{
+  if (renames.get() != 0)
+    renames->removed(*old);
+  else
+    old->skipTree();
+}
+
+void HashPredictor::skipFile()
+{
+  if (renames.get() != 0) {
+    Attrs storage;
+    renames->removed((*old)->getFullAttrs(storage));
+  }
+  ++*old;
+}
+
+bool HashPredictor::wanted(Node const& node)
+{
+  tree::NodeIterator& left = *old;
+  bool const here = !matched.empty() && matched.back();
+  std::string const& name = node.getName();
+
+  switch (node.getKind()) {
+    case Node::ENTER:
+      if (matched.empty()) {
+        // The roots always correspond.
+        ++left;
+        matched.push_back(true);
+        return false;
       }
-      ++left;
-      ++right;
-    }
+      if (here) {
+        while (left->getKind() == Node::ENTER && left->getName() < name)
+          skipLeft();
+        if (left->getKind() == Node::ENTER && left->getName() == name) {
+          ++left;
+          matched.push_back(true);
+          return false;
+        }
+      }
+      matched.push_back(false);
+      return false;
+
+    case Node::MARK:
+      if (here) {
+        while (left->getKind() == Node::ENTER)
+          skipLeft();
+        assert(left->getKind() == Node::MARK);
+        ++left;
+      }
+      return false;
+
+    case Node::NODE:
+      if (here) {
+        while (left->getKind() == Node::NODE && left->getName() < name)
+          skipFile();
+        if (left->getKind() == Node::NODE && left->getName() == name) {
+          bool wanted = false;
+          if (check && !sizeDiffers(*left, node))
+            wanted = !options.statFirst || !sameCheapAtts(*left, node) || sampler.next();
+          if (update && !unchanged(*left, node))
+            wanted = true;
+          ++left;
+          return wanted;
+        }
+      }
+      // The Comparer hashes new files when it is matching them up as moves,
+      // and the Updater those it can't find were renamed.
+      if (check && options.moves)
+        return true;
+      if (update) {
+        Attrs reused;
+        return renames.get() == 0 || !renames->find(node.getAttrs(), reused);
+      }
+      return false;
+
+    case Node::LEAVE:
+      if (here) {
+        while (left->getKind() == Node::NODE)
+          skipFile();
+        assert(left->getKind() == Node::LEAVE);
+        ++left;
+      }
+      matched.pop_back();
+      return false;
   }
+  return false;
+}
 
-  assert(isLeftLeave());
-  assert(isRightLeave());
-  saver.writeNode(*right);
-  ++left;
-  ++right;
+// Every file gets hashed when the old hashes can't be reused.
+class HashAll : public tree::HashFilter {
+ public:
+  bool wanted(Node const& node) { return node.getKind() == Node::NODE; }
+};
+
+// Compares each directory within the root that both trees have on a worker
+// thread, into a report of its own, while this thread compares the root.
+// The reports are put back together in the order one Comparer would have
+// written them.
+class ParallelCompare : public MergeSink {
+ public:
+  ParallelCompare(TreeSource& source_, CheckOptions const& options_) :
+      source(source_), options(options_), report(), root(options_, report), started(false),
+      mutex(), changed(), jobs(), next(0), listed(false), stopping(false) { }
+
+  void run(int workers);
+
+  // The root is compared here, and each directory within it is a job.
+  void enter(Node const& left, Node const& right) { root.enter(left, right); }
+  void mark(Node const& right) { root.mark(right); }
+  void leave(Node const& right) { root.leave(right); }
+  void file(Node const& left, Node const& right) { root.file(left, right); }
+  bool removed(Node const& left) { return root.removed(left); }
+  bool added(Node const& right) { return root.added(right); }
+  bool skipsSame() const { return true; }
+  bool descend(Node const& left, Node const& right);
+
+ private:
+  struct Job {
+    Job(std::string const& path_, std::string const& before_) :
+        path(path_), before(before_), done(false), report(), error(), byStat(0), byContent(0) { }
+    std::string path;
+    // What the root's comparison reported before the directory.
+    std::string before;
+    bool done;
+    std::string report;
+    std::string error;
+    unsigned long byStat, byContent;
+  };
+
+  class Worker : public Thread {
+   public:
+    explicit Worker(ParallelCompare& owner) : owner_(owner) { }
+   protected:
+    void run() { owner_.work(); }
+   private:
+    ParallelCompare& owner_;
+  };
+
+  TreeSource& source;
+  CheckOptions const& options;
+  std::ostringstream report;
+  Comparer root;
+  bool started;
+
+  // The mutex protects the jobs, except for the results of the running ones.
+  Mutex mutex;
+  Condition changed;
+  std::deque<Job> jobs;
+  size_t next;
+  // Whether the root has been compared, so that there are no more jobs.
+  bool listed;
+  bool stopping;
+
+  void work();
+  void compare(Job& job);
+  void stop(std::vector<Worker*>& workers);
+};
+
+bool ParallelCompare::descend(Node const& /*left*/, Node const& right)
+{
+  if (!started) {
+    started = true;
+    return true;
+  }
+  Lock lock(mutex);
+  jobs.push_back(Job(right.getName(), report.str()));
+  report.str(std::string());
+  changed.signal();
+  return false;
 }
 
-// Skip a tree, assuming we're sitting on the ENTER node for it.
-void skipTree(tree::NodeIterator& tree)
+void ParallelCompare::work()
 {
-  ++tree;
-  int depth = 1;
-  while (depth > 0) {
-    if (tree->getKind() == Node::ENTER)
-      ++depth;
-    else if (tree->getKind() == Node::LEAVE)
-      --depth;
-    ++tree;
+  Lock lock(mutex);
+  while (true) {
+    while (!stopping && !listed && next == jobs.size())
+      changed.wait(mutex);
+    if (stopping || next == jobs.size())
+      return;
+    Job& job = jobs[next++];
+    mutex.unlock();
+    compare(job);
+    mutex.lock();
+    job.done = true;
+    changed.broadcast();
   }
 }
 
-void Comparer::skipLeft()
+void ParallelCompare::compare(Job& job)
 {
-  std::cout << "- dir                    " << getPath() << '/' << leftName() << '\n';
-  skipTree(left);
+  try {
+    CheckOptions jobOptions(options);
+    jobOptions.root = options.root + '/' + job.path;
+    std::auto_ptr<tree::NodeIterator> oldTree(source.oldTree(job.path));
+    std::auto_ptr<tree::NodeIterator> newTree(source.newTree(job.path, jobOptions));
+    std::ostringstream out;
+    Comparer comp(jobOptions, out);
+    Combiner merge(*oldTree, *newTree);
+    merge.add(comp);
+    merge.dir();
+    job.report = out.str();
+    job.byStat = comp.checkedByStat();
+    job.byContent = comp.checkedByContent();
+  }
+  catch (std::exception& e) {
+    job.error = e.what();
+  }
 }
 
-void Updater::skipLeft()
+void ParallelCompare::stop(std::vector<Worker*>& workers)
 {
-  skipTree(left);
+  {
+    Lock lock(mutex);
+    stopping = true;
+    changed.broadcast();
+  }
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i]->join();
+    delete workers[i];
+  }
+  workers.clear();
+}
+
+void ParallelCompare::run(int workers)
+{
+  std::vector<Worker*> threads;
+  try {
+    for (int i = 0; i < workers; ++i) {
+      threads.push_back(new Worker(*this));
+      threads.back()->start();
+    }
+
+    {
+      std::auto_ptr<tree::NodeIterator> oldRoot(source.oldTree(std::string()));
+      std::auto_ptr<tree::NodeIterator> newRoot(source.newRoot());
+      Combiner merge(*oldRoot, *newRoot);
+      merge.add(*this);
+      merge.dir();
+    }
+    {
+      Lock lock(mutex);
+      listed = true;
+      changed.broadcast();
+    }
+
+    // Each directory's report goes where the root's comparison found it.
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      Job& job = jobs[i];
+      std::cout << job.before;
+      {
+        Lock lock(mutex);
+        while (!job.done)
+          changed.wait(mutex);
+      }
+      if (!job.error.empty())
+        throw Exception_base(job.error);
+      std::cout << job.report << std::flush;
+      root.addChecked(job.byStat, job.byContent);
+      job.before.clear();
+      job.report.clear();
+    }
+    root.summary();
+    std::cout << report.str();
+  }
+  catch (...) {
+    stop(threads);
+    throw;
+  }
+  stop(threads);
+}
+
 }
 
-void Comparer::skipRight()
+tree::HashFilter* checkFilter(tree::NodeIterator* oldTree, CheckOptions const& options)
 {
-  std::cout << "+ dir                    " << getPath() << '/' << rightName() << '\n';
-  skipTree(right);
+  return new HashPredictor(oldTree, true, false, options);
 }
 
-void Updater::storeRight()
+tree::HashFilter* updateFilter(tree::NodeIterator* oldTree, bool reuseHashes,
+                               size_t renameMemory)
 {
-  saver.writeNode(*right);
-  ++right;
-  int depth = 1;
-  while (depth > 0) {
-    if (right->getKind() == Node::ENTER)
-      ++depth;
-    else if (right->getKind() == Node::LEAVE)
-      --depth;
-    saver.writeNode(*right);
-    ++right;
+  if (!reuseHashes) {
+    delete oldTree;
+    return new HashAll;
   }
+  return new HashPredictor(oldTree, false, true, CheckOptions(), renameMemory);
 }
 
-// Return true if both nodes have the named att, and the att has the same value.
-bool Updater::sameAtt(std::string const& aname)
+tree::HashFilter* checkUpdateFilter(tree::NodeIterator* oldTree, CheckOptions const& options,
+                                    bool reuseHashes, size_t renameMemory)
 {
-  typedef Node::Atts::const_iterator Iter;
-  Node::Atts const& latts = left->getAtts();
-  Iter const l = latts.find(aname);
-  if (l == latts.end())
-    return false;
-  Node::Atts const& ratts = right->getAtts();
-  Iter const r = ratts.find(aname);
-  if (r == ratts.end())
-    return false;
+  if (!reuseHashes) {
+    delete oldTree;
+    return new HashAll;
+  }
+  return new HashPredictor(oldTree, true, true, options, renameMemory);
+}
 
-  return l->second == r->second;
+void compareTrees(tree::NodeIterator& oldTree, tree::NodeIterator& newTree,
+                  CheckOptions const& options)
+{
+  Comparer comp(options);
+  Combiner merge(oldTree, newTree);
+  merge.add(comp);
+  merge.dir();
+  comp.summary();
 }
 
+void updateTree(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                bool reuseHashes, size_t renameMemory)
+{
+  Updater update(saver, reuseHashes, renameMemory);
+  Combiner merge(oldTree, newTree);
+  merge.add(update);
+  merge.dir();
+  saver.close();
 }
 
-void compareTrees(tree::NodeIterator& oldTree, tree::NodeIterator& newTree)
+void updateDelta(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                 bool reuseHashes, size_t renameMemory)
 {
-  Comparer comp(oldTree, newTree);
-  comp.dir();
+  DeltaUpdater update(saver, reuseHashes, renameMemory);
+  Combiner merge(oldTree, newTree);
+  merge.add(update);
+  merge.dir();
+  saver.close();
 }
 
-void updateTree(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver)
+void checkUpdate(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                 bool delta, CheckOptions const& options, bool reuseHashes, size_t renameMemory)
 {
-  Updater update(oldTree, newTree, saver);
-  update.dir();
+  Comparer comp(options);
+  std::auto_ptr<MergeSink> update;
+  if (delta)
+    update.reset(new DeltaUpdater(saver, reuseHashes, renameMemory));
+  else
+    update.reset(new Updater(saver, reuseHashes, renameMemory));
+  Combiner merge(oldTree, newTree);
+  merge.add(comp);
+  merge.add(*update);
+  merge.dir();
+  comp.summary();
   saver.close();
 }
 
+void compareParallel(TreeSource& source, CheckOptions const& options, int workers)
+{
+  if (options.moves || workers < 1) {
+    std::auto_ptr<tree::NodeIterator> oldTree(source.oldTree(std::string()));
+    std::auto_ptr<tree::NodeIterator> newTree(source.newTree(std::string(), options));
+    compareTrees(*oldTree, *newTree, options);
+    return;
+  }
+  ParallelCompare compare(source, options);
+  compare.run(workers);
+}
+
 }
@@ -4,12 +4,92 @@
 #define __LIB_COMPARE_H__
 
 #include "tree.hh"
+#include "lookahead.hh"
 #include "surefile.hh"
 
 namespace asure {
 
-void compareTrees(tree::NodeIterator& oldTree, tree::NodeIterator& newTree);
-void updateTree(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver);
+struct CheckOptions {
+  CheckOptions();
+
+  // Only hash files whose cheap attributes differ from the old tree, plus a
+  // random sample of the others.
+  bool statFirst;
+
+  // The fraction of unchanged looking files to hash anyway.
+  double sampleRate;
+
+  // Seeds the sample.  The comparison and its filter must agree on it.
+  unsigned long long seed;
+
+  // The attributes whose changes aren't reported.  By default the ctime and
+  // inode number, which change whenever a file is copied back from backup.
+  tree::Attrs::Mask ignore;
+
+  // The path reported for the root of the trees.
+  std::string root;
+
+  // Report what was removed and added with the same contents as moved or
+  // copied, holding up to 'moveMemory' bytes in memory to match them up,
+  // and the rest in temporary files.
+  bool moves;
+  size_t moveMemory;
+};
+
+void compareTrees(tree::NodeIterator& oldTree, tree::NodeIterator& newTree,
+                  CheckOptions const& options = CheckOptions());
+// Where compareParallel gets the trees it compares.  Directories are named
+// by their path below the root, which is "".  Its methods are called from
+// several threads at once.
+class TreeSource : boost::noncopyable {
+ public:
+  virtual ~TreeSource() { }
+
+  // The old tree, or a directory of it.  Passing over the directories within
+  // the root of the whole tree should be cheap.
+  virtual tree::NodeIterator* oldTree(std::string const& path) = 0;
+
+  // A directory of the new tree, hashed ahead for a comparison with
+  // 'options' against the same directory of the old tree.
+  virtual tree::NodeIterator* newTree(std::string const& path,
+                                      CheckOptions const& options) = 0;
+
+  // The root of the new tree, which is only walked for its own files and
+  // the names of its directories, so should pass over those cheaply.
+  virtual tree::NodeIterator* newRoot() = 0;
+};
+
+// The same comparison as compareTrees, with the same report, but with each
+// directory within the root that both trees have compared by one of
+// 'workers' threads.  Finding moves needs the whole trees, so is done on
+// this thread instead.
+void compareParallel(TreeSource& source, CheckOptions const& options, int workers);
+
+// Write the new tree to the saver.  If 'reuseHashes' is set, the old tree's
+// digests are of the same algorithm, and are kept for unchanged files.  If
+// 'renameMemory' isn't 0, they are also kept for files that were renamed,
+// remembering up to that much of the removed files to find them by.
+void updateTree(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                bool reuseHashes = true, size_t renameMemory = 0);
+// The same, but writing only what changed, to a saver writing a delta.
+void updateDelta(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                 bool reuseHashes = true, size_t renameMemory = 0);
+// Both at once, in one pass over the trees: report what changed as
+// compareTrees does, and write the new tree as updateTree does, or as
+// updateDelta does if 'delta' is set, with the same hashes.
+void checkUpdate(tree::NodeIterator& oldTree, tree::NodeIterator& newTree, SurefileSaver& saver,
+                 bool delta, CheckOptions const& options, bool reuseHashes = true,
+                 size_t renameMemory = 0);
+
+// Filters for hashing the new tree ahead of compareTrees or updateTree.  Each
+// is given its own iterator over the same old tree, which it takes ownership
+// of, so that only the files the comparison will look at get hashed.
+tree::HashFilter* checkFilter(tree::NodeIterator* oldTree,
+                              CheckOptions const& options = CheckOptions());
+tree::HashFilter* updateFilter(tree::NodeIterator* oldTree, bool reuseHashes = true,
+                               size_t renameMemory = 0);
+tree::HashFilter* checkUpdateFilter(tree::NodeIterator* oldTree, CheckOptions const& options,
+                                    bool reuseHashes = true, size_t renameMemory = 0);
 
 }
 
@@ -0,0 +1,1063 @@
+// Compressing and decompressing surefiles.
+//
+// libzstd is loaded with dlopen, since its header needn't be installed
+// where this is built.  Only its stable API is used, declared here.
+
+extern "C" {
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "zlib.h"
+
+#include "compress.hh"
+#include "exn.hh"
+#include "thread.hh"
+
+namespace asure {
+
+namespace {
+
+// The uncompressed size of each block.
+size_t const blockSize = 1024 * 1024;
+
+// The default zstd level, which its library also uses for 0.
+int const zstdDefaultLevel = 3;
+
+unsigned char const zstdMagic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+struct ZstdInBuffer {
+  void const* src;
+  size_t size;
+  size_t pos;
+};
+
+struct ZstdOutBuffer {
+  void* dst;
+  size_t size;
+  size_t pos;
+};
+
+struct Zstd {
+  size_t (*compressBound)(size_t srcSize);
+  void* (*createCCtx)();
+  size_t (*freeCCtx)(void* cctx);
+  size_t (*compressCCtx)(void* cctx, void* dst, size_t dstCapacity,
+                         void const* src, size_t srcSize, int level);
+  void* (*createDStream)();
+  size_t (*freeDStream)(void* dstream);
+  size_t (*initDStream)(void* dstream);
+  size_t (*decompressStream)(void* dstream, ZstdOutBuffer* output, ZstdInBuffer* input);
+  size_t (*dStreamInSize)();
+  unsigned (*isError)(size_t code);
+  char const* (*getErrorName)(size_t code);
+};
+
+Zstd zstd;
+bool zstdLoaded = false;
+pthread_once_t zstdOnce = PTHREAD_ONCE_INIT;
+
+template <typename Function>
+bool bind(void* library, char const* name, Function& function)
+{
+  void* const symbol = dlsym(library, name);
+  std::memcpy(&function, &symbol, sizeof(function));
+  return symbol != 0;
+}
+
+void loadZstd()
+{
+  void* const library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (library == 0)
+    return;
+  zstdLoaded =
+    bind(library, "ZSTD_compressBound", zstd.compressBound) &&
+    bind(library, "ZSTD_createCCtx", zstd.createCCtx) &&
+    bind(library, "ZSTD_freeCCtx", zstd.freeCCtx) &&
+    bind(library, "ZSTD_compressCCtx", zstd.compressCCtx) &&
+    bind(library, "ZSTD_createDStream", zstd.createDStream) &&
+    bind(library, "ZSTD_freeDStream", zstd.freeDStream) &&
+    bind(library, "ZSTD_initDStream", zstd.initDStream) &&
+    bind(library, "ZSTD_decompressStream", zstd.decompressStream) &&
+    bind(library, "ZSTD_DStreamInSize", zstd.dStreamInSize) &&
+    bind(library, "ZSTD_isError", zstd.isError) &&
+    bind(library, "ZSTD_getErrorName", zstd.getErrorName);
+}
+
+Zstd const& needZstd()
+{
+  if (!Compression::zstdAvailable())
+    throw Exception_base("zstd is not available (libzstd.so.1 could not be loaded)");
+  return zstd;
+}
+
+// The index finish() is given is stored after the data, with the block
+// offsets, in containers that decoders skip: gzip members of nothing, with
+// the index in a field of their headers, or zstd skippable frames.  What
+// they hold is the block size, the block count, the offset of each block,
+// and then the index, the numbers as 64-bit little-endian.  After them, a
+// last container of a fixed size holds the magic, where the first
+// container starts, and how much they hold in all.
+char const indexMagic[8] = { 'a', 's', 'u', 'r', 'e', 'i', 'd', 'x' };
+size_t const trailerSize = sizeof(indexMagic) + 16;
+
+// The gzip header of a member with an extra field, up to its length, and
+// the empty deflate stream, CRC and size that end an empty member.
+unsigned char const gzipExtraHeader[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255 };
+unsigned char const gzipEmptyEnd[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+unsigned char const gzipSubfield[2] = { 'A', 's' };
+// The most a gzip extra subfield can hold.
+size_t const gzipMaxField = 65535 - 4;
+size_t const gzipOverhead = sizeof(gzipExtraHeader) + 2 + 4 + sizeof(gzipEmptyEnd);
+
+unsigned char const zstdSkippable[4] = { 0x5a, 0x2a, 0x4d, 0x18 };
+size_t const zstdOverhead = sizeof(zstdSkippable) + 4;
+
+void putLittle(std::string& out, uint64_t value, int bytes)
+{
+  for (int i = 0; i < bytes; ++i)
+    out += char(value >> (8 * i));
+}
+
+uint64_t getLittle(unsigned char const* data, int bytes)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; ++i)
+    value |= uint64_t(data[i]) << (8 * i);
+  return value;
+}
+
+// Put 'data' in containers of the codec, appending them to 'out'.
+void putSkippable(Compression::Codec codec, std::string const& data, std::string& out)
+{
+  size_t pos = 0;
+  do {
+    if (codec == Compression::ZSTD) {
+      out.append(reinterpret_cast<char const*>(zstdSkippable), sizeof(zstdSkippable));
+      putLittle(out, data.size(), 4);
+      out += data;
+      return;
+    }
+    size_t const length = std::min(data.size() - pos, gzipMaxField);
+    out.append(reinterpret_cast<char const*>(gzipExtraHeader), sizeof(gzipExtraHeader));
+    putLittle(out, length + 4, 2);
+    out.append(reinterpret_cast<char const*>(gzipSubfield), sizeof(gzipSubfield));
+    putLittle(out, length, 2);
+    out.append(data, pos, length);
+    out.append(reinterpret_cast<char const*>(gzipEmptyEnd), sizeof(gzipEmptyEnd));
+    pos += length;
+  } while (pos < data.size());
+}
+
+// Read the contents of the container at 'data', returning its whole size,
+// or 0 if it isn't one.
+size_t getSkippable(unsigned char const* data, size_t length, std::string& out)
+{
+  if (length >= zstdOverhead && std::memcmp(data, zstdSkippable, sizeof(zstdSkippable)) == 0) {
+    uint64_t const size = getLittle(data + 4, 4);
+    if (size > length - zstdOverhead)
+      return 0;
+    out.append(reinterpret_cast<char const*>(data + zstdOverhead), size);
+    return zstdOverhead + size;
+  }
+  if (length >= gzipOverhead &&
+      std::memcmp(data, gzipExtraHeader, sizeof(gzipExtraHeader)) == 0 &&
+      std::memcmp(data + 12, gzipSubfield, sizeof(gzipSubfield)) == 0) {
+    uint64_t const size = getLittle(data + 14, 2);
+    if (getLittle(data + 10, 2) != size + 4 || size > length - gzipOverhead ||
+        std::memcmp(data + 16 + size, gzipEmptyEnd, sizeof(gzipEmptyEnd)) != 0)
+      return 0;
+    out.append(reinterpret_cast<char const*>(data + 16), size);
+    return gzipOverhead + size;
+  }
+  return 0;
+}
+
+bool readAt(int fd, std::string const& path, uint64_t offset, size_t length, std::vector<unsigned char>& data)
+{
+  data.resize(length);
+  size_t done = 0;
+  while (done < length) {
+    ssize_t const count = pread(fd, &data[done], length - done, offset + done);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      throw IO_error("pread", path);
+    }
+    if (count == 0)
+      return false;
+    done += count;
+  }
+  return true;
+}
+
+char const* const codecNames[] = { "gzip", "zstd" };
+int const codecCount = sizeof(codecNames) / sizeof(codecNames[0]);
+
+Compression compression;
+
+// Write all of a buffer to a file.
+void writeFully(int fd, std::string const& path, char const* data, size_t length)
+{
+  while (length > 0) {
+    ssize_t const count = ::write(fd, data, length);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      throw IO_error("write", path);
+    }
+    data += count;
+    length -= count;
+  }
+}
+
+// The state each thread compresses blocks with, created when first needed.
+class BlockCompressor : boost::noncopyable {
+ public:
+  BlockCompressor(Compression const& compression) :
+      compression_(compression), haveStream_(false), cctx_(0) { }
+  ~BlockCompressor() {
+    if (haveStream_)
+      deflateEnd(&stream_);
+    if (cctx_ != 0)
+      zstd.freeCCtx(cctx_);
+  }
+
+  // Compress 'input' into 'output', returning an error message if that
+  // fails, or an empty string.
+  std::string compress(std::string const& input, std::string& output);
+
+ private:
+  Compression const& compression_;
+  z_stream stream_;
+  bool haveStream_;
+  void* cctx_;
+};
+
+std::string BlockCompressor::compress(std::string const& input, std::string& output)
+{
+  if (compression_.codec == Compression::ZSTD) {
+    if (cctx_ == 0 && (cctx_ = zstd.createCCtx()) == 0)
+      return "zstd: out of memory";
+    output.resize(zstd.compressBound(input.size()));
+    size_t const result = zstd.compressCCtx(cctx_, &output[0], output.size(), input.data(),
+                                            input.size(), compression_.level);
+    if (zstd.isError(result))
+      return std::string("zstd: ") + zstd.getErrorName(result);
+    output.resize(result);
+    return std::string();
+  }
+
+  if (!haveStream_) {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // The window bits ask for a gzip header and trailer.
+    int const level = compression_.level == 0 ? Z_DEFAULT_COMPRESSION : compression_.level;
+    if (deflateInit2(&stream_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return "deflateInit2 failed";
+    haveStream_ = true;
+  } else
+    deflateReset(&stream_);
+
+  output.resize(deflateBound(&stream_, input.size()));
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream_.avail_in = input.size();
+  stream_.next_out = reinterpret_cast<Bytef*>(&output[0]);
+  stream_.avail_out = output.size();
+  if (deflate(&stream_, Z_FINISH) != Z_STREAM_END)
+    return "deflate failed";
+  output.resize(stream_.total_out);
+  return std::string();
+}
+
+class BlockEncoder;
+
+class EncodeWorker : public Thread {
+ public:
+  EncodeWorker(BlockEncoder& owner) : owner_(owner) { }
+ protected:
+  void run();
+ private:
+  BlockEncoder& owner_;
+};
+
+// Blocks are queued in order, compressed by the workers in whatever order
+// they finish, and written from the front of the queue by the thread
+// writing to the encoder, which waits when too many are outstanding.
+class BlockEncoder : public Encoder {
+ public:
+  BlockEncoder(int fd, std::string const& path, Compression const& compression);
+  ~BlockEncoder();
+
+  void write(char const* data, size_t length);
+  void finish(std::string const& index);
+
+  // Called by the workers.
+  void work();
+
+ private:
+  struct Block {
+    Block() : input(), output(), done(false), error() { }
+    std::string input, output;
+    bool done;
+    std::string error;
+  };
+
+  int fd_;
+  std::string const path_;
+  Compression const compression_;
+  std::string current_;
+
+  // Where each block written so far starts, and where the next will.
+  std::vector<uint64_t> offsets_;
+  uint64_t written_;
+
+  // Protects the queue, the blocks' states, and stopping_.
+  Mutex mutex_;
+  Condition queued_, finished_;
+  std::deque<Block*> blocks_;
+  // The first block in 'blocks_' not yet taken by a worker.
+  size_t next_;
+  bool stopping_;
+
+  std::vector<EncodeWorker*> workers_;
+
+  void queue();
+  void drain(size_t keep);
+  void shutdown();
+};
+
+void EncodeWorker::run()
+{
+  owner_.work();
+}
+
+BlockEncoder::BlockEncoder(int fd, std::string const& path, Compression const& compression) :
+    fd_(fd), path_(path), compression_(compression), current_(), offsets_(), written_(0),
+    mutex_(), queued_(), finished_(), blocks_(), next_(0), stopping_(false), workers_()
+{
+  current_.reserve(blockSize);
+  try {
+    for (int i = 0; i < std::max(compression.threads, 1); ++i) {
+      workers_.push_back(new EncodeWorker(*this));
+      workers_.back()->start();
+    }
+  }
+  catch (...) {
+    // The file is closed by the caller.
+    fd_ = -1;
+    shutdown();
+    throw;
+  }
+}
+
+BlockEncoder::~BlockEncoder()
+{
+  shutdown();
+}
+
+void BlockEncoder::shutdown()
+{
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+    queued_.broadcast();
+  }
+
+  typedef std::vector<EncodeWorker*>::const_iterator WI;
+  for (WI i = workers_.begin(); i != workers_.end(); ++i) {
+    (*i)->join();
+    delete *i;
+  }
+  workers_.clear();
+
+  while (!blocks_.empty()) {
+    delete blocks_.front();
+    blocks_.pop_front();
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+void BlockEncoder::write(char const* data, size_t length)
+{
+  while (length > 0) {
+    size_t const count = std::min(length, blockSize - current_.size());
+    current_.append(data, count);
+    data += count;
+    length -= count;
+    if (current_.size() == blockSize)
+      queue();
+  }
+}
+
+void BlockEncoder::finish(std::string const& index)
+{
+  if (!current_.empty())
+    queue();
+  drain(0);
+
+  std::string contents;
+  putLittle(contents, blockSize, 8);
+  putLittle(contents, offsets_.size(), 8);
+  for (size_t i = 0; i < offsets_.size(); ++i)
+    putLittle(contents, offsets_[i], 8);
+  contents += index;
+
+  std::string trailer;
+  trailer.append(indexMagic, sizeof(indexMagic));
+  putLittle(trailer, written_, 8);
+  putLittle(trailer, contents.size(), 8);
+
+  std::string containers;
+  putSkippable(compression_.codec, contents, containers);
+  putSkippable(compression_.codec, trailer, containers);
+  writeFully(fd_, path_, containers.data(), containers.size());
+
+  int const fd = fd_;
+  fd_ = -1;
+  shutdown();
+  if (::close(fd) != 0)
+    throw IO_error("close", path_);
+}
+
+void BlockEncoder::queue()
+{
+  Block* block = new Block;
+  block->input.swap(current_);
+  current_.reserve(blockSize);
+  {
+    Lock lock(mutex_);
+    blocks_.push_back(block);
+    queued_.signal();
+  }
+  drain(2 * workers_.size());
+}
+
+// Write out the compressed blocks at the front of the queue, waiting for
+// more until no more than 'keep' are left.
+void BlockEncoder::drain(size_t keep)
+{
+  while (true) {
+    Block* block;
+    {
+      Lock lock(mutex_);
+      while (blocks_.size() > keep && !blocks_.front()->done)
+        finished_.wait(mutex_);
+      if (blocks_.empty() || !blocks_.front()->done)
+        return;
+      block = blocks_.front();
+      blocks_.pop_front();
+      --next_;
+    }
+
+    std::auto_ptr<Block> owned(block);
+    if (!block->error.empty())
+      throw Exception_base("compressing " + path_ + ": " + block->error);
+    offsets_.push_back(written_);
+    writeFully(fd_, path_, block->output.data(), block->output.size());
+    written_ += block->output.size();
+  }
+}
+
+void BlockEncoder::work()
+{
+  BlockCompressor compressor(compression_);
+  Lock lock(mutex_);
+  while (true) {
+    while (next_ == blocks_.size() && !stopping_)
+      queued_.wait(mutex_);
+    if (stopping_)
+      return;
+
+    Block* const block = blocks_[next_++];
+    mutex_.unlock();
+    std::string const error = compressor.compress(block->input, block->output);
+    std::string().swap(block->input);
+    mutex_.lock();
+
+    block->error = error;
+    block->done = true;
+    finished_.broadcast();
+  }
+}
+
+class GzipDecoder : public Decoder {
+ public:
+  GzipDecoder(int fd, std::string const& path) : path_(path), file_(gzdopen(fd, "rb")) {
+    if (file_ == 0) {
+      ::close(fd);
+      throw IO_error("gzdopen", path);
+    }
+    gzbuffer(file_, 128 * 1024);
+  }
+  ~GzipDecoder() { gzclose(file_); }
+
+  size_t read(char* data, size_t length) {
+    int const count = gzread(file_, data, length);
+    if (count < 0)
+      throw IO_error("gzread", path_);
+    return count;
+  }
+
+ private:
+  std::string const path_;
+  gzFile file_;
+};
+
+class ZstdDecoder : public Decoder {
+ public:
+  ZstdDecoder(int fd, std::string const& path);
+  ~ZstdDecoder();
+
+  size_t read(char* data, size_t length);
+
+ private:
+  int fd_;
+  std::string const path_;
+  void* stream_;
+  std::vector<char> buffer_;
+  ZstdInBuffer in_;
+  // What the last call to decompress returned, 0 at the end of a frame.
+  size_t pending_;
+};
+
+ZstdDecoder::ZstdDecoder(int fd, std::string const& path) :
+    fd_(fd), path_(path), stream_(0), buffer_(), in_(), pending_(0)
+{
+  try {
+    Zstd const& z = needZstd();
+    stream_ = z.createDStream();
+    if (stream_ == 0)
+      throw Exception_base("zstd: out of memory");
+    z.initDStream(stream_);
+  }
+  catch (...) {
+    ::close(fd);
+    throw;
+  }
+  buffer_.resize(zstd.dStreamInSize());
+  in_.src = &buffer_[0];
+  in_.size = 0;
+  in_.pos = 0;
+}
+
+ZstdDecoder::~ZstdDecoder()
+{
+  zstd.freeDStream(stream_);
+  ::close(fd_);
+}
+
+size_t ZstdDecoder::read(char* data, size_t length)
+{
+  ZstdOutBuffer out = { data, length, 0 };
+  while (out.pos == 0) {
+    if (in_.pos == in_.size) {
+      ssize_t const count = ::read(fd_, &buffer_[0], buffer_.size());
+      if (count < 0) {
+        if (errno == EINTR)
+          continue;
+        throw IO_error("read", path_);
+      }
+      if (count == 0) {
+        if (pending_ != 0)
+          throw Exception_base("zstd: truncated file (" + path_ + ")");
+        break;
+      }
+      in_.size = count;
+      in_.pos = 0;
+    }
+    pending_ = zstd.decompressStream(stream_, &out, &in_);
+    if (zstd.isError(pending_))
+      throw Exception_base("zstd: " + std::string(zstd.getErrorName(pending_)) +
+                           " (" + path_ + ")");
+  }
+  return out.pos;
+}
+
+// The state each thread decompresses blocks with, created when first
+// needed.
+class BlockDecompressor : boost::noncopyable {
+ public:
+  BlockDecompressor() : haveStream_(false), dstream_(0) { }
+  ~BlockDecompressor() {
+    if (haveStream_)
+      inflateEnd(&stream_);
+    if (dstream_ != 0)
+      zstd.freeDStream(dstream_);
+  }
+
+  // Decompress all of 'input', which holds whole gzip members or zstd
+  // frames, into 'output', which is expected to need about 'size' bytes.
+  // Returns an error message if that fails, or an empty string.
+  std::string decompress(Compression::Codec codec, std::vector<unsigned char> const& input,
+                         size_t size, std::string& output);
+
+ private:
+  z_stream stream_;
+  bool haveStream_;
+  void* dstream_;
+};
+
+std::string BlockDecompressor::decompress(Compression::Codec codec,
+                                          std::vector<unsigned char> const& input,
+                                          size_t size, std::string& output)
+{
+  if (input.empty()) {
+    output.clear();
+    return std::string();
+  }
+  output.resize(std::max(size, size_t(64 * 1024)));
+  size_t done = 0;
+
+  if (codec == Compression::ZSTD) {
+    if (dstream_ == 0 && (dstream_ = zstd.createDStream()) == 0)
+      return "zstd: out of memory";
+    zstd.initDStream(dstream_);
+    ZstdInBuffer in = { &input[0], input.size(), 0 };
+    size_t pending = 0;
+    while (in.pos < in.size) {
+      if (done == output.size())
+        output.resize(2 * output.size());
+      ZstdOutBuffer out = { &output[0], output.size(), done };
+      pending = zstd.decompressStream(dstream_, &out, &in);
+      if (zstd.isError(pending))
+        return std::string("zstd: ") + zstd.getErrorName(pending);
+      done = out.pos;
+    }
+    // Flush whatever the last frame still holds.
+    while (pending != 0) {
+      if (done == output.size())
+        output.resize(2 * output.size());
+      ZstdOutBuffer out = { &output[0], output.size(), done };
+      pending = zstd.decompressStream(dstream_, &out, &in);
+      if (zstd.isError(pending))
+        return std::string("zstd: ") + zstd.getErrorName(pending);
+      if (out.pos == done && pending != 0)
+        return "zstd: truncated block";
+      done = out.pos;
+    }
+    output.resize(done);
+    return std::string();
+  }
+
+  if (!haveStream_) {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // The window bits ask for a gzip header and trailer.
+    if (inflateInit2(&stream_, 15 + 16) != Z_OK)
+      return "inflateInit2 failed";
+    haveStream_ = true;
+  } else
+    inflateReset(&stream_);
+
+  stream_.next_in = const_cast<Bytef*>(&input[0]);
+  stream_.avail_in = input.size();
+  while (stream_.avail_in > 0) {
+    if (done == output.size())
+      output.resize(2 * output.size());
+    stream_.next_out = reinterpret_cast<Bytef*>(&output[done]);
+    stream_.avail_out = output.size() - done;
+    int const result = inflate(&stream_, Z_NO_FLUSH);
+    done = output.size() - stream_.avail_out;
+    if (result == Z_STREAM_END)
+      inflateReset(&stream_);
+    else if (result != Z_OK)
+      return "inflate failed";
+    else if (stream_.avail_in == 0)
+      return "truncated gzip block";
+  }
+  output.resize(done);
+  return std::string();
+}
+
+class BlockDecoder;
+
+class DecodeWorker : public Thread {
+ public:
+  DecodeWorker(BlockDecoder& owner) : owner_(owner) { }
+ protected:
+  void run();
+ private:
+  BlockDecoder& owner_;
+};
+
+// Decodes the blocks an index locates on several threads at once.  Blocks
+// are queued in order as the reader gets near them, read and decompressed
+// by the workers in whatever order they finish, and handed to the reader
+// from the front of the queue.
+class BlockDecoder : public Decoder {
+ public:
+  BlockDecoder(int fd, std::string const& path, Decoder::Index const& index,
+               Compression::Codec codec, int threads);
+  ~BlockDecoder();
+
+  size_t read(char* data, size_t length);
+
+  // Called by the workers.
+  void work();
+
+ private:
+  struct Block {
+    Block(uint64_t number_) : number(number_), output(), done(false), error() { }
+    uint64_t number;
+    std::string output;
+    bool done;
+    std::string error;
+  };
+
+  int fd_;
+  std::string const path_;
+  Compression::Codec const codec_;
+  uint64_t const blockSize_;
+  // Where each block starts, and then where the last one ends.
+  std::vector<uint64_t> offsets_;
+
+  // The block being read from, and how much of it has been.
+  std::auto_ptr<Block> current_;
+  size_t pos_;
+
+  // Protects the queue, the blocks' states, and stopping_.
+  Mutex mutex_;
+  Condition queued_, finished_;
+  std::deque<Block*> blocks_;
+  // The first block in 'blocks_' not yet taken by a worker, and the number
+  // of the next block to queue.
+  size_t next_;
+  uint64_t nextNumber_;
+  bool stopping_;
+
+  std::vector<DecodeWorker*> workers_;
+
+  void shutdown();
+};
+
+void DecodeWorker::run()
+{
+  owner_.work();
+}
+
+BlockDecoder::BlockDecoder(int fd, std::string const& path, Decoder::Index const& index,
+                           Compression::Codec codec, int threads) :
+    fd_(fd), path_(path), codec_(codec), blockSize_(index.blockSize), offsets_(index.blocks),
+    current_(), pos_(0), mutex_(), queued_(), finished_(), blocks_(), next_(0), nextNumber_(0),
+    stopping_(false), workers_()
+{
+  offsets_.push_back(index.end);
+  try {
+    for (int i = 0; i < threads; ++i) {
+      workers_.push_back(new DecodeWorker(*this));
+      workers_.back()->start();
+    }
+  }
+  catch (...) {
+    shutdown();
+    throw;
+  }
+}
+
+BlockDecoder::~BlockDecoder()
+{
+  shutdown();
+}
+
+void BlockDecoder::shutdown()
+{
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+    queued_.broadcast();
+  }
+
+  typedef std::vector<DecodeWorker*>::const_iterator WI;
+  for (WI i = workers_.begin(); i != workers_.end(); ++i) {
+    (*i)->join();
+    delete *i;
+  }
+  workers_.clear();
+
+  while (!blocks_.empty()) {
+    delete blocks_.front();
+    blocks_.pop_front();
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+size_t BlockDecoder::read(char* data, size_t length)
+{
+  while (current_.get() == 0 || pos_ == current_->output.size()) {
+    current_.reset();
+    {
+      Lock lock(mutex_);
+      // Keep two blocks queued for each worker.
+      size_t const window = 2 * workers_.size();
+      while (blocks_.size() < window && nextNumber_ + 1 < offsets_.size()) {
+        blocks_.push_back(new Block(nextNumber_++));
+        queued_.signal();
+      }
+      if (blocks_.empty())
+        return 0;
+      while (!blocks_.front()->done)
+        finished_.wait(mutex_);
+      current_.reset(blocks_.front());
+      blocks_.pop_front();
+      --next_;
+    }
+    if (!current_->error.empty())
+      throw Exception_base("decompressing " + path_ + ": " + current_->error);
+    pos_ = 0;
+  }
+
+  size_t const count = std::min(length, current_->output.size() - pos_);
+  std::memcpy(data, &current_->output[pos_], count);
+  pos_ += count;
+  return count;
+}
+
+void BlockDecoder::work()
+{
+  BlockDecompressor decompressor;
+  std::vector<unsigned char> input;
+  Lock lock(mutex_);
+  while (true) {
+    while (next_ == blocks_.size() && !stopping_)
+      queued_.wait(mutex_);
+    if (stopping_)
+      return;
+
+    Block* const block = blocks_[next_++];
+    mutex_.unlock();
+    std::string error;
+    try {
+      uint64_t const start = offsets_[block->number];
+      uint64_t const end = offsets_[block->number + 1];
+      if (end < start || !readAt(fd_, path_, start, end - start, input))
+        error = "block beyond the end of the file";
+      else
+        error = decompressor.decompress(codec_, input, blockSize_, block->output);
+    }
+    catch (Exception_base& e) {
+      error = e.what();
+    }
+    mutex_.lock();
+
+    block->error = error;
+    block->done = true;
+    finished_.broadcast();
+  }
+}
+
+}
+
+Compression::Compression() : codec(GZIP), level(0), threads(processorCount())
+{
+}
+
+char const* Compression::name(Codec codec)
+{
+  return codecNames[codec];
+}
+
+bool Compression::byName(std::string const& name, Codec& codec)
+{
+  for (int i = 0; i < codecCount; ++i) {
+    if (name == codecNames[i]) {
+      codec = Codec(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Compression::zstdAvailable()
+{
+  pthread_once(&zstdOnce, loadZstd);
+  return zstdLoaded;
+}
+
+void Compression::set(Compression const& value)
+{
+  compression = value;
+}
+
+Compression const& Compression::get()
+{
+  return compression;
+}
+
+Encoder::~Encoder()
+{
+}
+
+Encoder* Encoder::create(std::string const& path, Compression const& compression)
+{
+  Compression chosen = compression;
+  if (chosen.codec == Compression::ZSTD) {
+    needZstd();
+    if (chosen.level == 0)
+      chosen.level = zstdDefaultLevel;
+  }
+
+  int const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    throw IO_error("open", path);
+  try {
+    return new BlockEncoder(fd, path, chosen);
+  }
+  catch (...) {
+    ::close(fd);
+    throw;
+  }
+}
+
+Decoder::~Decoder()
+{
+}
+
+namespace {
+
+// Whether the file has the zstd magic at 'offset'.
+bool isZstdAt(int fd, uint64_t offset)
+{
+  unsigned char magic[sizeof(zstdMagic)];
+  ssize_t const count = pread(fd, magic, sizeof(magic), offset);
+  return count == ssize_t(sizeof(magic)) && std::memcmp(magic, zstdMagic, sizeof(magic)) == 0;
+}
+
+// Open a decoder reading from 'offset' in the file.
+Decoder* openAt(std::string const& path, uint64_t offset)
+{
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw IO_error("open", path);
+  if (offset != 0 && lseek(fd, offset, SEEK_SET) < 0) {
+    ::close(fd);
+    throw IO_error("lseek", path);
+  }
+
+  if (isZstdAt(fd, offset))
+    return new ZstdDecoder(fd, path);
+  return new GzipDecoder(fd, path);
+}
+
+}
+
+Decoder* Decoder::open(std::string const& path)
+{
+  // Files with an index can have their blocks decoded in parallel, which
+  // only pays when there is more than one thread to do it.
+  Index index;
+  if (Compression::get().threads < 2 || !readIndex(path, index))
+    return openAt(path, 0);
+  return open(path, index);
+}
+
+Decoder* Decoder::open(std::string const& path, Index const& index)
+{
+  if (Compression::get().threads < 2 || index.blocks.empty())
+    return openAt(path, 0);
+
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw IO_error("open", path);
+  Compression::Codec codec = Compression::GZIP;
+  if (isZstdAt(fd, index.blocks[0])) {
+    codec = Compression::ZSTD;
+    try {
+      needZstd();
+    }
+    catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+  return new BlockDecoder(fd, path, index, codec, std::max(Compression::get().threads, 1));
+}
+
+Decoder* Decoder::open(std::string const& path, Index const& index, uint64_t position)
+{
+  uint64_t const block = index.blockSize == 0 ? 0 : position / index.blockSize;
+  if (block >= index.blocks.size())
+    throw Parse_error("position beyond the index (" + path + ")");
+
+  std::auto_ptr<Decoder> decoder(openAt(path, index.blocks[block]));
+  std::vector<char> skipped(64 * 1024);
+  for (uint64_t left = position - block * index.blockSize; left > 0; ) {
+    size_t const count = decoder->read(&skipped[0], std::min(uint64_t(skipped.size()), left));
+    if (count == 0)
+      throw Parse_error("position beyond the end (" + path + ")");
+    left -= count;
+  }
+  return decoder.release();
+}
+
+bool Decoder::readIndex(std::string const& path, Index& index)
+{
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw IO_error("open", path);
+  struct FdCloser {
+    int fd;
+    ~FdCloser() { ::close(fd); }
+  } closer = { fd };
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    throw IO_error("fstat", path);
+  uint64_t const size = st.st_size;
+
+  // The trailer is in whichever container fits.
+  std::vector<unsigned char> data;
+  std::string trailer;
+  size_t const sizes[] = { zstdOverhead + trailerSize, gzipOverhead + trailerSize };
+  for (size_t i = 0; i < 2 && trailer.empty(); ++i) {
+    if (size >= sizes[i] && readAt(fd, path, size - sizes[i], sizes[i], data) &&
+        getSkippable(&data[0], data.size(), trailer) != sizes[i])
+      trailer.clear();
+  }
+  if (trailer.size() != trailerSize || std::memcmp(trailer.data(), indexMagic, sizeof(indexMagic)) != 0)
+    return false;
+
+  unsigned char const* const numbers = reinterpret_cast<unsigned char const*>(trailer.data()) +
+    sizeof(indexMagic);
+  uint64_t const start = getLittle(numbers, 8);
+  uint64_t const length = getLittle(numbers + 8, 8);
+  if (start > size || !readAt(fd, path, start, size - start, data))
+    throw Parse_error("invalid index (" + path + ")");
+
+  std::string contents;
+  size_t pos = 0;
+  while (contents.size() < length) {
+    size_t const used = getSkippable(&data[pos], data.size() - pos, contents);
+    if (used == 0)
+      throw Parse_error("invalid index (" + path + ")");
+    pos += used;
+  }
+
+  unsigned char const* const header = reinterpret_cast<unsigned char const*>(contents.data());
+  if (contents.size() != length || length < 16)
+    throw Parse_error("invalid index (" + path + ")");
+  index.blockSize = getLittle(header, 8);
+  uint64_t const count = getLittle(header + 8, 8);
+  if (count > (length - 16) / 8)
+    throw Parse_error("invalid index (" + path + ")");
+  index.blocks.resize(count);
+  for (uint64_t i = 0; i < count; ++i)
+    index.blocks[i] = getLittle(header + 16 + 8 * i, 8);
+  index.data.assign(contents, 16 + 8 * count, std::string::npos);
+  index.end = start;
+  return true;
+}
+
+}
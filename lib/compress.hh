@@ -0,0 +1,109 @@
+// Compressing and decompressing surefiles.
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+extern "C" {
+#include <stdint.h>
+#include <sys/types.h>
+}
+
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace asure {
+
+// How surefiles are compressed when written.  The data is cut into blocks
+// that are compressed independently, several at once, and written in order.
+// Either codec is recognized when reading, by the magic number at the start
+// of the file.
+struct Compression {
+  enum Codec {
+    // A gzip member for each block, which gunzip and zlib read as one
+    // stream.
+    GZIP,
+    // A zstd frame for each block.  libzstd is loaded when first needed, so
+    // this is only available where it is installed.
+    ZSTD
+  };
+
+  Compression();
+
+  Codec codec;
+  // The codec's compression level, or 0 for its default.
+  int level;
+  // How many blocks to compress, or decompress, at once, at least 1.
+  int threads;
+
+  static char const* name(Codec codec);
+  static bool byName(std::string const& name, Codec& codec);
+
+  // Whether libzstd could be loaded.
+  static bool zstdAvailable();
+
+  // The compression used for surefiles being written.
+  static void set(Compression const& compression);
+  static Compression const& get();
+};
+
+// Compresses what is written to it into a new file.
+class Encoder : boost::noncopyable {
+ public:
+  // Create the file at 'path', throwing IO_error if it can't be.
+  static Encoder* create(std::string const& path, Compression const& compression);
+
+  // Destroying an encoder that hasn't been finished leaves the file
+  // partially written.
+  virtual ~Encoder() = 0;
+
+  virtual void write(char const* data, size_t length) = 0;
+
+  // Write out everything, and close the file.  Then 'index', with where
+  // each block starts, is stored at the end of the file, where decoders
+  // skip over it and Decoder::readIndex() finds it.
+  virtual void finish(std::string const& index = std::string()) = 0;
+};
+
+// Decompresses a file, of either codec.  Anything else is read as it is.
+class Decoder : boost::noncopyable {
+ public:
+  // What Encoder::finish() stores at the end of a file.
+  struct Index {
+    Index() : data(), blockSize(0), blocks(), end(0) { }
+
+    // The index given to finish().
+    std::string data;
+
+    // The decompressed size of every block but the last, where in the file
+    // each block starts, and where the last one ends.
+    uint64_t blockSize;
+    std::vector<uint64_t> blocks;
+    uint64_t end;
+  };
+
+  // Open the file at 'path', throwing IO_error if it can't be.  When it has
+  // an index, and Compression::get() gives more than one thread, its blocks
+  // are decompressed ahead of the reader on that many threads.
+  static Decoder* open(std::string const& path);
+
+  // The same, for a file whose index has already been read.
+  static Decoder* open(std::string const& path, Index const& index);
+
+  // Open the file at 'path' to read from 'position' in the decompressed
+  // data, starting at the block it is in.
+  static Decoder* open(std::string const& path, Index const& index, uint64_t position);
+
+  // Read the index of the file at 'path', returning false if it has none.
+  static bool readIndex(std::string const& path, Index& index);
+
+  virtual ~Decoder() = 0;
+
+  // Read up to 'length' bytes, returning how many were read, 0 only at the
+  // end of the file.
+  virtual size_t read(char* data, size_t length) = 0;
+};
+
+}
+
+#endif
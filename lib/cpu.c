@@ -0,0 +1,70 @@
+/*
+ * Runtime detection of CPU features for the hashing kernels.
+ */
+
+#include "cpu.h"
+
+#ifdef CPU_X86
+
+#include <cpuid.h>
+
+static unsigned int leaf1_ecx(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return ecx;
+}
+
+static unsigned int leaf7_ebx(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, 0) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx;
+}
+
+/* The register state the OS saves on context switches (XCR0). */
+static unsigned int xcr0(void)
+{
+	unsigned int lo, hi;
+
+	/* OSXSAVE */
+	if (!(leaf1_ecx() & (1 << 27)))
+		return 0;
+	__asm__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return lo;
+}
+
+int cpu_x86_sha(void)
+{
+	unsigned int ecx = leaf1_ecx();
+
+	if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+		return 0;
+	return (leaf7_ebx() & (1 << 29)) != 0;
+}
+
+int cpu_x86_avx2(void)
+{
+	/* AVX */
+	if (!(leaf1_ecx() & (1 << 28)))
+		return 0;
+	if ((xcr0() & 0x06) != 0x06)
+		return 0;
+	return (leaf7_ebx() & (1 << 5)) != 0;
+}
+
+int cpu_x86_avx512f(void)
+{
+	if (!cpu_x86_avx2())
+		return 0;
+	if ((xcr0() & 0xe6) != 0xe6)
+		return 0;
+	return (leaf7_ebx() & (1 << 16)) != 0;
+}
+
+#endif
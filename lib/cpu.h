@@ -0,0 +1,21 @@
+/*
+ * Runtime detection of CPU features for the hashing kernels.
+ */
+
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CPU_X86
+
+/* SSSE3, SSE4.1 and the SHA extensions. */
+int cpu_x86_sha(void);
+
+/* AVX2, with the OS saving the YMM registers. */
+int cpu_x86_avx2(void);
+
+/* AVX-512F, with the OS saving the ZMM registers. */
+int cpu_x86_avx512f(void);
+#endif
+
+#endif
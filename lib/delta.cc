@@ -0,0 +1,377 @@
+// Deltas of surefiles.
+
+#include <memory>
+#include <vector>
+#include "delta.hh"
+#include "exn.hh"
+
+namespace asure {
+
+namespace {
+
+using tree::Node;
+using tree::NodeIterator;
+using tree::Attrs;
+
+std::string const opKey = "delta";
+std::string const oldPrefix = "old.";
+
+char const* const opNames[] = { "keep", "change", "add", "del" };
+int const opCount = sizeof(opNames) / sizeof(opNames[0]);
+
+std::string const* findOp(Attrs const& attrs)
+{
+  typedef Attrs::Extras::const_iterator Iter;
+  for (Iter i = attrs.extras().begin(); i != attrs.extras().end(); ++i) {
+    if (i->first == opKey)
+      return &i->second;
+  }
+  return 0;
+}
+
+// Move past a node, and everything below it if it's a directory.
+void skip(NodeIterator& tree)
+{
+  int depth = 0;
+  do {
+    if (tree->getKind() == Node::ENTER)
+      ++depth;
+    else if (tree->getKind() == Node::LEAVE)
+      --depth;
+    ++tree;
+  } while (depth > 0);
+}
+
+// A node of a delta, as it was before or after.  Nodes without marks are
+// given as they are.
+class SideNode : public Node {
+ public:
+  SideNode() : kind_(NODE), name_(), attrs_() { }
+
+  Node const& of(Node const& node, bool after);
+
+  Kind getKind() const { return kind_; }
+  std::string const& getName() const { return name_; }
+  Attrs const& getAttrs() const { return attrs_; }
+
+ private:
+  Kind kind_;
+  std::string name_;
+  Attrs attrs_;
+};
+
+Node const& SideNode::of(Node const& node, bool after)
+{
+  Kind const kind = node.getKind();
+  if ((kind != ENTER && kind != NODE) || findOp(node.getAttrs()) == 0)
+    return node;
+  kind_ = kind;
+  name_ = node.getName();
+  DeltaOp::side(node.getAttrs(), after, attrs_);
+  attrsChanged();
+  return *this;
+}
+
+// A directory of the tree that the delta changes something below, so that
+// its tree digest no longer holds.
+class KeptNode : public Node {
+ public:
+  KeptNode() : node_(0) { }
+
+  Node const& of(Node const& node) {
+    node_ = &node;
+    attrsChanged();
+    return *this;
+  }
+
+  Kind getKind() const { return node_->getKind(); }
+  std::string const& getName() const { return node_->getName(); }
+  Attrs const& getAttrs() const { return node_->getAttrs(); }
+  Atts getExpensiveAtts() const { return node_->getExpensiveAtts(); }
+
+ private:
+  Node const* node_;
+};
+
+// Both trees are read in step.  Within a directory that only one of them
+// has, that one is just followed.
+class MergedTree : public NodeIterator {
+ public:
+  MergedTree(NodeIterator* tree, NodeIterator* delta);
+
+  bool empty() const { return done_; }
+  void operator++();
+  Node const& operator*() const { return *current_; }
+
+ private:
+  // Which of the trees each directory entered is in, and whether its files
+  // have been reached.
+  struct Frame {
+    Frame(bool tree_, bool delta_) : tree(tree_), delta(delta_), files(false) { }
+    bool tree, delta, files;
+  };
+
+  std::auto_ptr<NodeIterator> tree_;
+  std::auto_ptr<NodeIterator> delta_;
+  std::vector<Frame> frames_;
+  SideNode side_;
+  KeptNode kept_;
+  Node const* current_;
+
+  // Which trees to move past the current node.
+  bool advanceTree_, advanceDelta_;
+  bool done_;
+
+  void next();
+};
+
+MergedTree::MergedTree(NodeIterator* tree, NodeIterator* delta) :
+    tree_(tree), delta_(delta), frames_(), side_(), kept_(), current_(0),
+    advanceTree_(false), advanceDelta_(true), done_(false)
+{
+  Node const& root = **delta_;
+  DeltaOp::Op const op = DeltaOp::of(root.getAttrs());
+  advanceTree_ = tree_.get() != 0 && (op == DeltaOp::KEEP || op == DeltaOp::CHANGE);
+  current_ = advanceTree_ && op == DeltaOp::KEEP ? &kept_.of(**tree_) : &side_.of(root, true);
+  frames_.push_back(Frame(advanceTree_, true));
+}
+
+void MergedTree::operator++()
+{
+  if (advanceTree_)
+    ++*tree_;
+  if (advanceDelta_)
+    ++*delta_;
+  advanceTree_ = advanceDelta_ = false;
+  if (frames_.empty())
+    done_ = true;
+  else
+    next();
+}
+
+void MergedTree::next()
+{
+  while (true) {
+    Frame& frame = frames_.back();
+    if (!frame.delta) {
+      current_ = &**tree_;
+      advanceTree_ = true;
+      if (current_->getKind() == Node::ENTER)
+        frames_.push_back(Frame(true, false));
+      else if (current_->getKind() == Node::LEAVE)
+        frames_.pop_back();
+      return;
+    }
+
+    Node const& change = **delta_;
+    Node::Kind const entry = frame.files ? Node::NODE : Node::ENTER;
+    bool const inTree = frame.tree && (*tree_)->getKind() == entry;
+    bool const inDelta = change.getKind() == entry;
+    if (!inTree && !inDelta) {
+      if (change.getKind() != (frame.files ? Node::LEAVE : Node::MARK))
+        throw Parse_error("Malformed delta");
+      current_ = &change;
+      advanceTree_ = frame.tree;
+      advanceDelta_ = true;
+      if (frame.files)
+        frames_.pop_back();
+      else
+        frame.files = true;
+      return;
+    }
+
+    int const order = !inDelta ? -1 : !inTree ? 1 : (*tree_)->getName().compare(change.getName());
+    if (order < 0) {
+      current_ = &**tree_;
+      advanceTree_ = true;
+      if (entry == Node::ENTER)
+        frames_.push_back(Frame(true, false));
+      return;
+    }
+
+    DeltaOp::Op const op = DeltaOp::of(change.getAttrs());
+    if (order == 0 && (op == DeltaOp::KEEP || op == DeltaOp::CHANGE)) {
+      current_ = op == DeltaOp::KEEP ? &kept_.of(**tree_) : &side_.of(change, true);
+      advanceTree_ = advanceDelta_ = true;
+      if (entry == Node::ENTER)
+        frames_.push_back(Frame(true, true));
+      return;
+    }
+
+    // Anything else the delta has replaces what the tree has.
+    if (order == 0)
+      skip(*tree_);
+    if (op == DeltaOp::DEL) {
+      skip(*delta_);
+      continue;
+    }
+    current_ = &side_.of(change, true);
+    advanceDelta_ = true;
+    if (entry == Node::ENTER)
+      frames_.push_back(Frame(false, true));
+    return;
+  }
+}
+
+// Leaves out what only the other side has.
+class DeltaSide : public NodeIterator {
+ public:
+  DeltaSide(NodeIterator* delta, bool after) :
+      delta_(delta), after_(after), side_(), current_(&side_.of(**delta_, after)) { }
+
+  bool empty() const { return delta_->empty(); }
+  void operator++();
+  Node const& operator*() const { return *current_; }
+
+ private:
+  std::auto_ptr<NodeIterator> delta_;
+  bool after_;
+  SideNode side_;
+  Node const* current_;
+};
+
+void DeltaSide::operator++()
+{
+  ++*delta_;
+  DeltaOp::Op const other = after_ ? DeltaOp::DEL : DeltaOp::ADD;
+  while (!delta_->empty()) {
+    Node const& node = **delta_;
+    if ((node.getKind() != Node::ENTER && node.getKind() != Node::NODE) ||
+        findOp(node.getAttrs()) == 0 || DeltaOp::of(node.getAttrs()) != other)
+      break;
+    skip(*delta_);
+  }
+  if (!delta_->empty())
+    current_ = &side_.of(**delta_, after_);
+}
+
+// Split a path into its names, as loadSubtree() reads it.
+void splitPath(std::string const& path, std::vector<std::string>& parts)
+{
+  for (size_t pos = 0; pos <= path.size(); ) {
+    size_t end = path.find('/', pos);
+    if (end == std::string::npos)
+      end = path.size();
+    std::string const part = path.substr(pos, end - pos);
+    if (!part.empty() && part != ".")
+      parts.push_back(part);
+    pos = end + 1;
+  }
+}
+
+// Whether a delta without the directory 'parts' leaves it as it was, which
+// it does unless it adds or removes a directory above it.
+bool untouched(std::string const& name, std::vector<std::string> const& parts)
+{
+  for (size_t count = parts.size() - 1; count > 0; --count) {
+    std::string path = parts[0];
+    for (size_t i = 1; i < count; ++i)
+      path += '/' + parts[i];
+    std::auto_ptr<NodeIterator> above(findSubtree(name, path));
+    if (above.get() != 0) {
+      DeltaOp::Op const op = DeltaOp::of((**above).getAttrs());
+      return op == DeltaOp::KEEP || op == DeltaOp::CHANGE;
+    }
+  }
+  // The root is always kept or changed.
+  return true;
+}
+
+}
+
+DeltaOp::Op DeltaOp::of(Attrs const& attrs)
+{
+  std::string const* const name = findOp(attrs);
+  if (name == 0)
+    return ADD;
+  for (int i = 0; i < opCount; ++i) {
+    if (*name == opNames[i])
+      return Op(i);
+  }
+  throw Parse_error("Unknown delta: " + *name);
+}
+
+void DeltaOp::mark(Attrs& attrs, Op op)
+{
+  attrs.set(opKey, opNames[op]);
+}
+
+void DeltaOp::mark(Attrs& attrs, Attrs const& old)
+{
+  mark(attrs, CHANGE);
+  Node::Atts atts;
+  old.toMap(atts);
+  typedef Node::Atts::const_iterator Iter;
+  for (Iter i = atts.begin(); i != atts.end(); ++i)
+    attrs.set(oldPrefix + i->first, i->second);
+}
+
+void DeltaOp::side(Attrs const& attrs, bool after, Attrs& result)
+{
+  bool const old = !after && of(attrs) == CHANGE;
+  result.clear();
+  Node::Atts atts;
+  attrs.toMap(atts);
+  typedef Node::Atts::const_iterator Iter;
+  for (Iter i = atts.begin(); i != atts.end(); ++i) {
+    bool const isOld = i->first.compare(0, oldPrefix.size(), oldPrefix) == 0;
+    if (old && isOld)
+      result.set(i->first.substr(oldPrefix.size()), i->second);
+    else if (!old && !isOld && i->first != opKey)
+      result.set(i->first, i->second);
+  }
+}
+
+tree::NodeIterator* mergeDelta(tree::NodeIterator* tree, tree::NodeIterator* delta)
+{
+  return new MergedTree(tree, delta);
+}
+
+tree::NodeIterator* deltaSide(tree::NodeIterator* delta, bool after)
+{
+  return new DeltaSide(delta, after);
+}
+
+tree::NodeIterator* loadGenerations(std::string const& baseName, std::string const& path,
+                                    Digest::Algorithm* digest, SurefileFormat::Version* format,
+                                    int generations)
+{
+  std::string const sureName = baseName + extensions::base;
+  std::vector<std::string> parts;
+  splitPath(path, parts);
+
+  // The directory may only be in some of the generations.
+  Digest::Algorithm algorithm = Digest::SHA1;
+  bool found = false;
+  std::auto_ptr<NodeIterator> tree;
+  if (parts.empty())
+    tree.reset(loadSurefile(sureName, &algorithm, format));
+  else
+    tree.reset(findSubtree(sureName, path, &algorithm));
+  found = tree.get() != 0;
+
+  if (generations < 0 || generations > countDeltas(baseName))
+    generations = countDeltas(baseName);
+  for (int generation = 1; generation <= generations; ++generation) {
+    std::string const name = deltaName(baseName, generation);
+    std::auto_ptr<NodeIterator> delta(parts.empty() ? loadSurefile(name) :
+                                      findSubtree(name, path, found ? 0 : &algorithm));
+    if (delta.get() == 0) {
+      if (!untouched(name, parts))
+        tree.reset();
+    } else if (DeltaOp::of((**delta).getAttrs()) == DeltaOp::DEL) {
+      tree.reset();
+    } else {
+      tree.reset(mergeDelta(tree.release(), delta.release()));
+      found = true;
+    }
+  }
+
+  if (tree.get() == 0)
+    throw Exception_base("no directory " + path + " in " + sureName);
+  if (digest != 0)
+    *digest = algorithm;
+  return tree.release();
+}
+
+}
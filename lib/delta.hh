@@ -0,0 +1,83 @@
+// Deltas of surefiles.
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <string>
+#include "surefile.hh"
+#include "tree.hh"
+
+namespace asure {
+
+// A delta records how a tree changed since the generation before it, as a
+// tree in either surefile format holding only what changed, and the
+// directories leading to it.  Each of its nodes has a "delta" attribute
+// saying what it does:
+//
+//   keep    A directory whose own attributes are the same.  It has no
+//           others, and only what changed within it is below it.
+//   change  A directory or file whose attributes changed.  It has the new
+//           ones, and the old ones with "old." before their names, so that
+//           the delta alone is enough to report the change.
+//   add     A new directory or file, with its attributes, and for a
+//           directory its whole tree, whose nodes have no "delta" of their
+//           own.
+//   del     A directory or file that was removed, with its old attributes.
+//           A directory has nothing below it.
+//
+// Nodes with no "delta" are added.
+struct DeltaOp {
+  enum Op {
+    KEEP, CHANGE, ADD, DEL
+  };
+
+  static Op of(tree::Attrs const& attrs);
+
+  // Mark the attributes of a node with 'op'.  For a CHANGE, the old
+  // attributes, 'old', are recorded with them.
+  static void mark(tree::Attrs& attrs, Op op);
+  static void mark(tree::Attrs& attrs, tree::Attrs const& old);
+
+  // The attributes before or after the change, without the marks.
+  static void side(tree::Attrs const& attrs, bool after, tree::Attrs& result);
+};
+
+// A node to write to a delta.
+class DeltaNode : public tree::Node {
+ public:
+  DeltaNode(Kind kind, std::string const& name, tree::Attrs const& attrs) :
+      kind_(kind), name_(name), attrs_(attrs) { }
+
+  Kind getKind() const { return kind_; }
+  std::string const& getName() const { return name_; }
+  tree::Attrs const& getAttrs() const { return attrs_; }
+
+ private:
+  Kind kind_;
+  std::string name_;
+  tree::Attrs attrs_;
+};
+
+// Return a newly allocated NodeIterator giving 'tree' with 'delta' applied
+// to it.  Takes ownership of both.  A null 'tree' stands for none, for
+// when the delta adds the whole thing.
+tree::NodeIterator* mergeDelta(tree::NodeIterator* tree, tree::NodeIterator* delta);
+
+// Return a newly allocated NodeIterator giving only what a delta changed,
+// as it was before, or after.  Comparing the two reports the changes the
+// delta records.  Takes ownership of 'delta'.
+tree::NodeIterator* deltaSide(tree::NodeIterator* delta, bool after);
+
+// Load the surefile 'baseName' with all of its deltas applied, or just the
+// directory 'path' of it, as loadSubtree() does.  The digest and format
+// are those of the surefile, when asked for.  A 'generations' that isn't
+// negative applies only that many of the deltas.
+tree::NodeIterator* loadGenerations(std::string const& baseName,
+                                    std::string const& path = std::string(),
+                                    Digest::Algorithm* digest = 0,
+                                    SurefileFormat::Version* format = 0,
+                                    int generations = -1);
+
+}
+
+#endif
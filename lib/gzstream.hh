@@ -4,73 +4,172 @@
 #ifndef __LIB_GZSTREAM_HH__
 #define __LIB_GZSTREAM_HH__
 
-#include "zlib.h"
+#include <algorithm>
+#include <cstring>
 #include <ios>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "compress.hh"
 #include "exn.hh"
 
 namespace asure {
 
+// Files are written with the compression Compression::get() gives, and
+// read with whichever codec they were written with.
+//
+// Reads and writes go through a buffer of our own, so that single
+// characters cost a few instructions rather than a call into the codec.
+// Readers can also look at the buffered data directly, with peek() and
+// skip(), to scan for delimiters a block at a time.
 class gzstream {
  public:
-  gzstream() : file(0) { }
+  gzstream() :
+      encoder(), decoder(), path(), buffer(), pos(0), limit(0), written(0), writing(false) { }
   ~gzstream() {
-    if (file != 0)
-      gzclose(file);
-    file = 0;
+    discard();
   }
 
-  void open(char const* path, char const* flags) {
-    file = gzopen(path, flags);
-    if (file == 0)
-      throw IO_error("gzstream::open", path);
+  // Open for writing if 'flags' has a 'w', otherwise for reading.
+  void open(char const* path_, char const* flags) {
+    path = path_;
+    writing = std::strchr(flags, 'w') != 0;
+    if (writing)
+      encoder.reset(Encoder::create(path, Compression::get()));
+    else
+      decoder.reset(Decoder::open(path));
+    buffer.resize(bufferSize);
+    pos = 0;
+    limit = writing ? bufferSize : 0;
+    written = 0;
   }
 
+  // Open for reading the whole of a file whose index has been read.
+  void open(char const* path_, Decoder::Index const& index) {
+    path = path_;
+    writing = false;
+    decoder.reset(Decoder::open(path, index));
+    buffer.resize(bufferSize);
+    pos = 0;
+    limit = 0;
+    written = 0;
+  }
+
+  // Open for reading from 'position' in the decompressed data, which the
+  // file's index locates.
+  void open(char const* path_, Decoder::Index const& index, uint64_t position) {
+    path = path_;
+    writing = false;
+    decoder.reset(Decoder::open(path, index, position));
+    buffer.resize(bufferSize);
+    pos = 0;
+    limit = 0;
+    written = position;
+  }
+
+  // How much has been written, or read, before compression.
+  uint64_t tell() const { return written + pos; }
+
   void put(char ch) {
-    gzputc(file, ch);
-    // TODO: Detect errors.
+    if (pos == limit)
+      flush();
+    buffer[pos++] = ch;
   }
 
   void write(char const* chars, int len) {
-    int offset = 0;
-    while (len > 0) {
-      int count = gzwrite(file, chars + offset, len);
-      if (count <= 0)
-        throw IO_error("gzstream::write", "unknown");
-      offset += count;
-      len -= count;
+    if (size_t(len) > limit - pos) {
+      flush();
+      if (size_t(len) >= limit) {
+        writeFile(chars, len);
+        return;
+      }
     }
+    std::memcpy(&buffer[pos], chars, len);
+    pos += len;
   }
 
   void get(char& ch) {
-    int tmp = gzgetc(file);
-    if (tmp == -1)
-      throw IO_error("gzstream::get", "unknown");
-    ch = tmp;
+    if (pos == limit)
+      fill();
+    ch = buffer[pos++];
   }
 
   void read(char* chars, int len) {
-    int offset = 0;
     while (len > 0) {
-      int count = gzread(file, chars + offset, len);
-      if (count <= 0)
-        throw IO_error("gzstream::read", "unknown");
-      offset += count;
+      if (pos == limit)
+        fill();
+      size_t const count = std::min(size_t(len), limit - pos);
+      std::memcpy(chars, &buffer[pos], count);
+      pos += count;
+      chars += count;
       len -= count;
     }
   }
 
-  void close() {
-    if (file != 0) {
-      gzclose(file);
-      file = 0;
+  // The data read ahead, reading more if there is none.  Returns how much
+  // there is, which is consumed by skip().
+  size_t peek(char const*& data) {
+    if (pos == limit)
+      fill();
+    data = &buffer[pos];
+    return limit - pos;
+  }
+
+  void skip(size_t count) {
+    pos += count;
+  }
+
+  // Finish the file, storing 'index' at its end if writing.
+  void close(std::string const& index = std::string()) {
+    if (encoder.get() != 0) {
+      flush();
+      encoder->finish(index);
     }
+    discard();
   }
 
-  bool isOpen() const { return file != 0; }
+  // Close without writing out what is buffered, and without raising any
+  // error, for giving up on a file.
+  void discard() {
+    encoder.reset();
+    decoder.reset();
+  }
+
+  bool isOpen() const { return encoder.get() != 0 || decoder.get() != 0; }
 
  private:
-  gzFile file;
+  static size_t const bufferSize = 128 * 1024;
+
+  std::auto_ptr<Encoder> encoder;
+  std::auto_ptr<Decoder> decoder;
+  std::string path;
+  std::vector<char> buffer;
+
+  // The next character to read or write, and the end of the data read or
+  // the space to write.  'written' is how much came before the buffer.
+  size_t pos, limit;
+  uint64_t written;
+  bool writing;
+
+  void flush() {
+    writeFile(&buffer[0], pos);
+    pos = 0;
+  }
+
+  void writeFile(char const* chars, size_t len) {
+    encoder->write(chars, len);
+    written += len;
+  }
+
+  void fill() {
+    size_t const count = decoder->read(&buffer[0], bufferSize);
+    if (count == 0)
+      throw Parse_error("unexpected end of file (" + path + ")");
+    written += limit;
+    pos = 0;
+    limit = count;
+  }
 };
 
 }
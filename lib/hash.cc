@@ -2,29 +2,47 @@
 //
 extern "C" {
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
 #include "sha1.h"
+#include "sha256.h"
+#include "blake3.h"
+#include "xxh3.h"
 }
 
+#include <algorithm>
 #include <boost/noncopyable.hpp>
+#include <cstring>
 #include <memory>
+#include <new>
 #include "hash.hh"
+#include "thread.hh"
+#include "uring.hh"
 #include "exn.hh"
 
 namespace asure {
 
-class Buffer {
+// A read buffer, aligned well enough for O_DIRECT.
+class Buffer : boost::noncopyable {
   public:
-    static const int bufsize = 4096;
+    static const size_t alignment = 4096;
     unsigned char* get() { return data_; }
-    Buffer() : data_(new unsigned char[bufsize]) { }
-    ~Buffer() { delete[] data_; }
+    Buffer(size_t size) {
+      void* data;
+      if (posix_memalign(&data, alignment, size) != 0)
+        throw std::bad_alloc();
+      data_ = static_cast<unsigned char*>(data);
+    }
+    ~Buffer() { free(data_); }
   private:
     unsigned char* data_;
-
-    Buffer(const Buffer&);
-    Buffer& operator=(const Buffer&);
 };
 
 // Wrapper around an open file that closes it properly.
@@ -46,31 +64,563 @@ class Fd : boost::noncopyable {
   int handle_;
 };
 
-void
-Hash::ofFile(std::string path)
-{
-  blk_SHA_CTX ctx;
-  blk_SHA1_Init(&ctx);
-
-  Buffer buffer;
+namespace {
 
+// Open a file for hashing, without updating its access time if possible.
+int openForHash(std::string const& path, char const* who)
+{
   errno = 0;
-  Fd fd(open(path.c_str(), O_RDONLY | O_NOATIME));
+  int fd = open(path.c_str(), O_RDONLY | O_NOATIME);
   if (fd < 0 && errno == EPERM)
     fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
-    throw IO_error("Hash::ofFile", path);
+    throw IO_error(who, path);
+  }
+  return fd;
+}
+
+}
+
+namespace {
+
+class Sha1Digest : public Digest {
+ public:
+  Sha1Digest() { blk_SHA1_Init(&ctx); }
+  void update(void const* data, size_t length) { blk_SHA1_Update(&ctx, data, length); }
+  void final(Hash& hash) {
+    blk_SHA1_Final(hash.data, &ctx);
+    hash.length = 20;
+  }
+ private:
+  blk_SHA_CTX ctx;
+};
+
+class Sha256Digest : public Digest {
+ public:
+  Sha256Digest() { sha256_init(&ctx); }
+  void update(void const* data, size_t length) { sha256_update(&ctx, data, length); }
+  void final(Hash& hash) {
+    sha256_final(hash.data, &ctx);
+    hash.length = 32;
+  }
+ private:
+  sha256_ctx ctx;
+};
+
+class Blake3Digest : public Digest {
+ public:
+  Blake3Digest() { b3_init(&ctx); }
+  void update(void const* data, size_t length) { b3_update(&ctx, data, length); }
+  void final(Hash& hash) {
+    b3_final(&ctx, hash.data);
+    hash.length = B3_OUT_LEN;
+  }
+  b3_hasher ctx;
+};
+
+class Xxh3Digest : public Digest {
+ public:
+  Xxh3Digest() { xxh3_init(&ctx); }
+  void update(void const* data, size_t length) { xxh3_update(&ctx, data, length); }
+  void final(Hash& hash) {
+    xxh3_final(hash.data, &ctx);
+    hash.length = 8;
+  }
+ private:
+  xxh3_ctx ctx;
+};
+
+char const* const names[] = { "sha1", "sha256", "blake3", "xxh3" };
+int const algorithmCount = sizeof(names) / sizeof(names[0]);
+
+int hashThreads = processorCount();
+
+}
+
+Digest::~Digest()
+{
+}
+
+Digest* Digest::create(Algorithm algorithm)
+{
+  switch (algorithm) {
+    case SHA1: return new Sha1Digest;
+    case SHA256: return new Sha256Digest;
+    case BLAKE3: return new Blake3Digest;
+    case XXH3: return new Xxh3Digest;
+  }
+  throw Exception_base("Digest::create: unknown algorithm");
+}
+
+char const* Digest::name(Algorithm algorithm)
+{
+  return names[algorithm];
+}
+
+bool Digest::byName(std::string const& name, Algorithm& algorithm)
+{
+  for (int i = 0; i < algorithmCount; ++i) {
+    if (name == names[i]) {
+      algorithm = Algorithm(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Digest::isDigestKey(std::string const& key)
+{
+  Algorithm algorithm;
+  return byName(key, algorithm);
+}
+
+void Digest::setThreads(int threads)
+{
+  hashThreads = std::max(threads, 1);
+}
+
+namespace {
+
+char const* const modeNames[] = { "auto", "buffered", "mmap", "direct", "uring" };
+int const modeCount = sizeof(modeNames) / sizeof(modeNames[0]);
+
+ReadMode::Mode readMode = ReadMode::AUTO;
+
+// Files are read this much at a time.
+size_t const readSize = 1 << 20;
+
+// The most files to read at once with io_uring.
+int const uringBatch = 32;
+
+void catchMappingFaults(ReadMode::Mode mode);
+
+}
+
+char const* ReadMode::name(Mode mode)
+{
+  return modeNames[mode];
+}
+
+bool ReadMode::byName(std::string const& name, Mode& mode)
+{
+  for (int i = 0; i < modeCount; ++i) {
+    if (name == modeNames[i]) {
+      mode = Mode(i);
+      return true;
+    }
   }
+  return false;
+}
+
+void ReadMode::set(Mode mode)
+{
+  catchMappingFaults(mode);
+  readMode = mode;
+}
+
+ReadMode::Mode ReadMode::get()
+{
+  return readMode;
+}
+
+// Small files aren't worth the cost of setting up a mapping.  Very large ones
+// are unlikely to be cached, and would push everything else out of the cache
+// if read through it.
+ReadMode::Mode ReadMode::forSize(off_t size)
+{
+  if (size < off_t(256) << 10)
+    return BUFFERED;
+  if (size < off_t(1) << 30)
+    return MMAP;
+  return DIRECT;
+}
+
+namespace {
+
+// Hash the file from 'offset' to the end with read().  If the descriptor is
+// O_DIRECT and the filesystem refuses the read, carry on without it.
+void readSequential(int fd, std::string const& path, off_t offset, Digest& digest)
+{
+  if (lseek(fd, offset, SEEK_SET) < 0)
+    throw IO_error("Hash::ofFile(lseek)", path);
+  posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+  Buffer buffer(readSize);
   while (true) {
-    ssize_t len = read(fd, buffer.get(), buffer.bufsize);
+    ssize_t len = read(fd, buffer.get(), readSize);
+    if (len < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT) != 0) {
+      if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) < 0)
+        throw IO_error("Hash::ofFile(fcntl)", path);
+      continue;
+    }
     if (len < 0)
       throw IO_error("Hash::ofFile(read)", path);
     if (len == 0)
       break;
-    blk_SHA1_Update(&ctx, buffer.get(), len);
+    digest.update(buffer.get(), len);
+  }
+}
+
+// Touching a mapping past the end of a file that has been truncated raises
+// SIGBUS.  While hashing a mapping, a thread points this at where to go
+// instead.
+__thread sigjmp_buf* mappingFault = 0;
+
+// The handler there was before ours.
+struct sigaction previousBusAction;
+
+void onBusError(int sig)
+{
+  if (mappingFault != 0)
+    siglongjmp(*mappingFault, 1);
+  // A genuine fault; fault again on return, with whatever handled it before.
+  sigaction(sig, &previousBusAction, 0);
+}
+
+pthread_once_t busHandlerOnce = PTHREAD_ONCE_INIT;
+
+void installBusHandler()
+{
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = onBusError;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, &previousBusAction);
+}
+
+// Mapped reads need the handler, which is installed for the whole process
+// the first time a mode that maps is chosen.
+void catchMappingFaults(ReadMode::Mode mode)
+{
+  if (mode == ReadMode::AUTO || mode == ReadMode::MMAP)
+    pthread_once(&busHandlerOnce, installBusHandler);
+}
+
+class Mapping : boost::noncopyable {
+ public:
+  Mapping(void* data, size_t length) : data_(data), length_(length) { }
+  ~Mapping() {
+    if (data_ != MAP_FAILED)
+      munmap(data_, length_);
+  }
+  unsigned char* get() const { return static_cast<unsigned char*>(data_); }
+  bool failed() const { return data_ == MAP_FAILED; }
+ private:
+  void* data_;
+  size_t length_;
+};
+
+// Hash the file from 'offset' (a multiple of the page size) through a
+// mapping, then read anything added since the stat.  Returns false if the
+// file shrank while it was being hashed, leaving the digest unusable.
+bool readMapped(int fd, std::string const& path, off_t offset, off_t size, Digest& digest)
+{
+  if (offset < size) {
+    size_t const length = size - offset;
+    Mapping map(mmap(0, length, PROT_READ, MAP_SHARED, fd, offset), length);
+    if (map.failed()) {
+      // Some files can't be mapped; read them instead.
+      readSequential(fd, path, offset, digest);
+      return true;
+    }
+    madvise(map.get(), length, MADV_SEQUENTIAL);
+
+    // The jump out of the handler leaves SIGBUS blocked unless the mask is
+    // restored, and a second one would then kill the process.
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1) != 0) {
+      mappingFault = 0;
+      return false;
+    }
+    mappingFault = &jump;
+    for (size_t pos = 0; pos < length; pos += readSize)
+      digest.update(map.get() + pos, std::min(readSize, length - pos));
+    mappingFault = 0;
+  }
+
+  readSequential(fd, path, std::max(offset, size), digest);
+  return true;
+}
+
+}
+
+namespace {
+
+// BLAKE3 can hash the subtrees of a large file independently.  Each thread
+// reads and hashes every Nth subtree with pread, and the chaining values are
+// then added to the hasher in order.
+size_t const subtreeChunks = 1024;
+off_t const subtreeBytes = subtreeChunks * B3_CHUNK_LEN;
+
+struct ChainingValue {
+  uint32_t cv[8];
+};
+
+class SubtreeHasher : public Thread {
+ public:
+  SubtreeHasher(int fd, int first, int step, std::vector<ChainingValue>& cvs) :
+      fd_(fd), first_(first), step_(step), cvs_(cvs), error(0), shortRead(false) { }
+
+ protected:
+  void run();
+
+ private:
+  int fd_;
+  size_t first_;
+  size_t step_;
+  std::vector<ChainingValue>& cvs_;
+
+ public:
+  int error;
+  bool shortRead;
+};
+
+void SubtreeHasher::run()
+{
+  // The descriptor may be O_DIRECT, so the buffer has to be aligned.
+  Buffer buffer(subtreeBytes);
+  for (size_t i = first_; i < cvs_.size(); i += step_) {
+    size_t got = 0;
+    while (got < size_t(subtreeBytes)) {
+      ssize_t len = pread(fd_, buffer.get() + got, subtreeBytes - got, i * subtreeBytes + got);
+      // As in readSequential, an O_DIRECT read the filesystem refuses, or
+      // one left unaligned by a short read, is retried without it.
+      if (len < 0 && errno == EINVAL && (fcntl(fd_, F_GETFL) & O_DIRECT) != 0) {
+        if (fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT) < 0) {
+          error = errno;
+          return;
+        }
+        continue;
+      }
+      if (len < 0) {
+        error = errno;
+        return;
+      }
+      if (len == 0) {
+        shortRead = true;
+        return;
+      }
+      got += len;
+    }
+    b3_subtree_cv(buffer.get(), subtreeChunks, i * subtreeChunks, cvs_[i].cv);
+  }
+}
+
+// Hash the leading subtrees of a large file in parallel, returning the offset
+// the caller should carry on hashing from.  That is 0, with nothing hashed,
+// if the file shrank underneath us.
+off_t hashSubtrees(int fd, off_t size, std::string const& path, Blake3Digest& digest)
+{
+  // At least one byte has to be left for the caller.
+  std::vector<ChainingValue> cvs((size - 1) / subtreeBytes);
+  int const threads = std::min(size_t(hashThreads), cvs.size());
+
+  std::vector<SubtreeHasher*> workers;
+  for (int i = 0; i < threads; ++i)
+    workers.push_back(new SubtreeHasher(fd, i, threads, cvs));
+  int started = 0;
+  try {
+    for (; started < threads; ++started)
+      workers[started]->start();
+  }
+  catch (...) {
+    for (int i = 0; i < started; ++i)
+      workers[i]->join();
+    for (int i = 0; i < threads; ++i)
+      delete workers[i];
+    throw;
+  }
+
+  int error = 0;
+  bool shortRead = false;
+  for (int i = 0; i < threads; ++i) {
+    workers[i]->join();
+    if (workers[i]->error != 0)
+      error = workers[i]->error;
+    shortRead = shortRead || workers[i]->shortRead;
+    delete workers[i];
+  }
+  if (error != 0) {
+    errno = error;
+    throw IO_error("Hash::ofFile(pread)", path);
+  }
+  if (shortRead)
+    return 0;
+
+  for (size_t i = 0; i < cvs.size(); ++i)
+    b3_push_subtree(&digest.ctx, cvs[i].cv, subtreeChunks);
+  return cvs.size() * subtreeBytes;
+}
+
+}
+
+void
+Hash::ofFile(std::string path, Digest::Algorithm algorithm)
+{
+  ofFile(path, algorithm, readMode);
+}
+
+void
+Hash::ofFile(std::string path, Digest::Algorithm algorithm, ReadMode::Mode mode)
+{
+  if (mode == ReadMode::URING) {
+    std::vector<UringFile> files(1, UringFile(path));
+    if (uringHash(files, algorithm)) {
+      if (files[0].error != 0) {
+        errno = files[0].error;
+        throw IO_error(files[0].call, path);
+      }
+      *this = files[0].hash;
+      return;
+    }
+    mode = ReadMode::BUFFERED;
+  }
+
+  std::auto_ptr<Digest> digest(Digest::create(algorithm));
+
+  Fd fd(openForHash(path, "Hash::ofFile"));
+
+  struct stat info;
+  if (fstat(fd, &info) != 0)
+    throw IO_error("Hash::ofFile(fstat)", path);
+
+  catchMappingFaults(mode);
+  if (mode == ReadMode::AUTO)
+    mode = ReadMode::forSize(info.st_size);
+  if (mode == ReadMode::DIRECT &&
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0)
+    mode = ReadMode::BUFFERED;
+
+  off_t offset = 0;
+  if (algorithm == Digest::BLAKE3 && hashThreads > 1 && info.st_size > 4 * subtreeBytes)
+    offset = hashSubtrees(fd, info.st_size, path, static_cast<Blake3Digest&>(*digest));
+
+  bool complete = true;
+  if (mode == ReadMode::MMAP)
+    complete = readMapped(fd, path, offset, info.st_size, *digest);
+  else
+    readSequential(fd, path, offset, *digest);
+
+  if (!complete) {
+    // The file changed size; just hash whatever is there now.
+    digest.reset(Digest::create(algorithm));
+    readSequential(fd, path, 0, *digest);
+  }
+
+  digest->final(*this);
+}
+
+off_t const HashBatch::smallFile;
+
+bool HashBatch::wants(off_t size)
+{
+  return size <= smallFile || readMode == ReadMode::URING;
+}
+
+int HashBatch::width(Digest::Algorithm algorithm)
+{
+  if (readMode == ReadMode::URING)
+    return uringBatch;
+  // Only SHA-1 has a multi-buffer implementation.
+  return algorithm == Digest::SHA1 ? blk_SHA1_MultiLanes() : 1;
+}
+
+void HashBatch::add(std::string const& path)
+{
+  entries_.push_back(Entry(path));
+}
+
+// Read the whole file into the entry, returning false if it is larger than
+// a small file should be.
+bool HashBatch::readSmall(Entry& entry)
+{
+  Fd fd(openForHash(entry.path, "HashBatch::run"));
+
+  // One byte extra to notice files that have grown.
+  entry.content.resize(smallFile + 1);
+  size_t length = 0;
+  while (length < entry.content.size()) {
+    ssize_t len = read(fd, &entry.content[length], entry.content.size() - length);
+    if (len < 0)
+      throw IO_error("HashBatch::run(read)", entry.path);
+    if (len == 0)
+      break;
+    length += len;
+  }
+  entry.content.resize(length);
+  return length <= size_t(smallFile);
+}
+
+// Hash the whole batch with io_uring, returning false if that isn't
+// available.
+bool HashBatch::runUring()
+{
+  std::vector<UringFile> files;
+  for (size_t i = 0; i < entries_.size(); ++i)
+    files.push_back(UringFile(entries_[i].path));
+  if (!uringHash(files, algorithm_))
+    return false;
+
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (files[i].error != 0) {
+      errno = files[i].error;
+      entries_[i].failed = true;
+      entries_[i].error = IO_error(files[i].call, files[i].path).what();
+    } else {
+      entries_[i].hash = files[i].hash;
+    }
+  }
+  return true;
+}
+
+void HashBatch::run()
+{
+  if (readMode == ReadMode::URING && runUring())
+    return;
+
+  std::vector<void const*> data;
+  std::vector<unsigned long> lengths;
+  std::vector<Entry*> small;
+
+  typedef std::vector<Entry>::iterator Iter;
+  for (Iter i = entries_.begin(); i != entries_.end(); ++i) {
+    try {
+      if (readSmall(*i)) {
+        data.push_back(i->content.empty() ? 0 : &i->content[0]);
+        lengths.push_back(i->content.size());
+        small.push_back(&*i);
+      } else {
+        i->content.clear();
+        i->hash.ofFile(i->path, algorithm_);
+      }
+    }
+    catch (Exception_base& e) {
+      i->failed = true;
+      i->error = e.what();
+    }
+  }
+
+  if (small.empty())
+    return;
+
+  if (algorithm_ != Digest::SHA1) {
+    for (size_t i = 0; i < small.size(); ++i) {
+      std::auto_ptr<Digest> digest(Digest::create(algorithm_));
+      digest->update(data[i], lengths[i]);
+      digest->final(small[i]->hash);
+      small[i]->content.clear();
+    }
+    return;
   }
 
-  blk_SHA1_Final(data, &ctx);
+  std::vector<unsigned char> out(20 * small.size());
+  blk_SHA1_Multi(small.size(), &data[0], &lengths[0],
+                 reinterpret_cast<unsigned char (*)[20]>(&out[0]));
+  for (size_t i = 0; i < small.size(); ++i) {
+    std::copy(&out[20*i], &out[20*i] + 20, small[i]->hash.data);
+    small[i]->hash.length = 20;
+    small[i]->content.clear();
+  }
 }
 
 namespace {
@@ -83,10 +633,10 @@ inline char itoc(unsigned char val)
 }
 }
 
-Hash::operator std::string()
+Hash::operator std::string() const
 {
-  std::string buf(40, 'X');
-  for (int i = 0; i < 20; i++) {
+  std::string buf(2 * length, 'X');
+  for (int i = 0; i < length; i++) {
     buf[2*i] = itoc(data[i] >> 4);
     buf[2*i+1] = itoc(data[i] & 0x0f);
   }
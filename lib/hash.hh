@@ -3,16 +3,126 @@
 #ifndef __HASH_H__
 #define __HASH_H__
 
+extern "C" {
+#include <sys/types.h>
+}
+
 #include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
 
 namespace asure {
 
+struct Hash;
+
+// A digest algorithm, computing a hash incrementally.
+class Digest : boost::noncopyable {
+ public:
+  enum Algorithm {
+    SHA1, SHA256, BLAKE3, XXH3
+  };
+
+  // Return a newly allocated digest using the given algorithm.
+  static Digest* create(Algorithm algorithm);
+
+  virtual ~Digest() = 0;
+  virtual void update(void const* data, size_t length) = 0;
+  virtual void final(Hash& hash) = 0;
+
+  // The algorithm's name, which is also the attribute its digests are
+  // stored under.
+  static char const* name(Algorithm algorithm);
+
+  // Find an algorithm by name, returning false if there is none.
+  static bool byName(std::string const& name, Algorithm& algorithm);
+
+  // Whether an attribute holds a digest.
+  static bool isDigestKey(std::string const& key);
+
+  // The most threads used to hash one large file, with the algorithms that
+  // can split a file up (BLAKE3).
+  static void setThreads(int threads);
+};
+
+// How file contents are read to be hashed.
+struct ReadMode {
+  enum Mode {
+    // Choose one of the others by the size of the file.
+    AUTO,
+    // Read into a large aligned buffer, advising sequential access.
+    BUFFERED,
+    // Map the file, advising sequential access.
+    MMAP,
+    // Bypass the page cache with O_DIRECT, or read buffered if the
+    // filesystem doesn't allow that.
+    DIRECT,
+    // Keep many reads, across many files, in flight with io_uring, or read
+    // buffered if the kernel doesn't support that.
+    URING
+  };
+
+  static char const* name(Mode mode);
+  static bool byName(std::string const& name, Mode& mode);
+
+  // The mode used by Hash::ofFile when none is given.  Setting, or hashing
+  // with, a mode that maps files (AUTO or MMAP) installs a SIGBUS handler
+  // for the process, so that a file truncated while it is mapped is read
+  // again instead; other faults go to the handler that was there before.
+  static void set(Mode mode);
+  static Mode get();
+
+  // The mode AUTO picks for a file of this size.
+  static Mode forSize(off_t size);
+};
+
 struct Hash {
-  unsigned char data[20];
-  operator std::string();
+  unsigned char data[32];
+  int length;
+  operator std::string() const;
 
   // Set this hash to be the contents of the given file.
-  void ofFile(std::string path);
+  void ofFile(std::string path, Digest::Algorithm algorithm = Digest::SHA1);
+  void ofFile(std::string path, Digest::Algorithm algorithm, ReadMode::Mode mode);
+};
+
+// Hash a batch of small files together, several at a time in SIMD lanes.
+// Files that turn out not to be small after all are hashed the usual way.
+// When reading with io_uring, the whole batch is read at once instead.
+class HashBatch : boost::noncopyable {
+ public:
+  // Files up to this size are worth batching, unless reading with io_uring,
+  // where every file is.
+  static off_t const smallFile = 16384;
+  static bool wants(off_t size);
+
+  // How many files to hash together, 1 if batching wouldn't help.
+  static int width(Digest::Algorithm algorithm);
+
+  HashBatch(Digest::Algorithm algorithm) : algorithm_(algorithm), entries_() { }
+
+  void add(std::string const& path);
+  void run();
+
+  // The results, by the order the files were added.  Each file either has a
+  // hash, or the message of the exception hashing it raised.
+  bool failed(int i) const { return entries_[i].failed; }
+  std::string const& error(int i) const { return entries_[i].error; }
+  Hash const& hash(int i) const { return entries_[i].hash; }
+
+ private:
+  struct Entry {
+    Entry(std::string const& p) : path(p), content(), hash(), failed(false), error() { }
+    std::string path;
+    std::vector<unsigned char> content;
+    Hash hash;
+    bool failed;
+    std::string error;
+  };
+  Digest::Algorithm algorithm_;
+  std::vector<Entry> entries_;
+
+  bool readSmall(Entry& entry);
+  bool runUring();
 };
 
 }
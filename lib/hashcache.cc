@@ -0,0 +1,377 @@
+// A persistent cache of file hashes.
+//
+// The file is a header followed by a power of two number of fixed size
+// slots, probed linearly.  Each slot carries a check word over its key and
+// digest, written last, so a slot torn by a crash is just skipped.  Every run
+// bumps the generation, and slots not used for a while are dropped when the
+// table is rewritten.  Rewriting builds a new file and renames it into
+// place, so the cache on disk is always complete.
+
+extern "C" {
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include <cstring>
+#include <iostream>
+#include "hashcache.hh"
+#include "exn.hh"
+
+namespace asure {
+
+struct HashCache::Header {
+  char magic[16];
+  uint32_t generation;
+  uint32_t pad;
+  uint64_t capacity;
+};
+
+struct HashCache::Slot {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  // Not covered by the check, so that it can be bumped on its own.
+  uint32_t generation;
+  uint8_t algorithm;
+  uint8_t length;
+  uint8_t pad[2];
+  unsigned char hash[32];
+  // Zero in an empty slot.
+  uint64_t check;
+};
+
+namespace {
+
+char const magic[16] = "asure-cache-1\n";
+
+uint64_t const minCapacity = 1024;
+
+// Slots unused for this many runs are dropped.
+uint32_t const keepRuns = 16;
+
+// Timestamps within this many nanoseconds of the start of the run are too
+// recent to trust.
+int64_t const racyWindow = 2000000000LL;
+
+inline uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t keyHash(FileKey const& key, Digest::Algorithm algorithm)
+{
+  uint64_t h = mix(key.dev ^ 0x9e3779b97f4a7c15ULL);
+  h = mix(h ^ key.ino);
+  h = mix(h ^ key.size);
+  h = mix(h ^ uint64_t(key.mtime));
+  h = mix(h ^ uint64_t(key.ctime));
+  return mix(h ^ algorithm);
+}
+
+uint64_t slotCheck(HashCache::Slot const& slot)
+{
+  FileKey key = { slot.dev, slot.ino, slot.size, slot.mtime, slot.ctime };
+  uint64_t h = keyHash(key, Digest::Algorithm(slot.algorithm)) ^ slot.length;
+  for (int i = 0; i < slot.length; ++i)
+    h = mix(h ^ slot.hash[i]);
+  return h == 0 ? 1 : h;
+}
+
+bool matches(HashCache::Slot const& slot, FileKey const& key, Digest::Algorithm algorithm)
+{
+  return slot.dev == key.dev && slot.ino == key.ino && slot.size == key.size &&
+    slot.mtime == key.mtime && slot.ctime == key.ctime && slot.algorithm == algorithm;
+}
+
+bool valid(HashCache::Slot const& slot)
+{
+  return slot.check != 0 && slot.check == slotCheck(slot) &&
+    slot.length <= sizeof(slot.hash);
+}
+
+size_t fileSize(uint64_t capacity)
+{
+  return sizeof(HashCache::Header) + capacity * sizeof(HashCache::Slot);
+}
+
+int64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+}
+
+FileKey FileKey::of(struct stat const& stat)
+{
+  FileKey key;
+  key.dev = stat.st_dev;
+  key.ino = stat.st_ino;
+  key.size = stat.st_size;
+  key.mtime = int64_t(stat.st_mtim.tv_sec) * 1000000000 + stat.st_mtim.tv_nsec;
+  key.ctime = int64_t(stat.st_ctim.tv_sec) * 1000000000 + stat.st_ctim.tv_nsec;
+  return key;
+}
+
+HashCache* HashCache::open(std::string const& path, Trust trust)
+{
+  // The table itself gets replaced on compaction, so the lock is a separate
+  // file.
+  std::string const lockName = path + ".lock";
+  int lockFd = ::open(lockName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lockFd < 0) {
+    std::cout << "warning: " << IO_error("open", lockName).what() << ", not caching\n";
+    return 0;
+  }
+  if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+    std::cout << "warning: " << path << " is in use, not caching\n";
+    close(lockFd);
+    return 0;
+  }
+
+  try {
+    return new HashCache(path, lockFd, trust);
+  }
+  catch (Exception_base& e) {
+    std::cout << "warning: " << e.what() << ", not caching\n";
+    close(lockFd);
+    return 0;
+  }
+}
+
+HashCache::HashCache(std::string const& path, int lockFd, Trust trust) :
+    path_(path), lockFd_(lockFd), trust_(trust), mutex_(),
+    fd_(-1), map_(MAP_FAILED), mapSize_(0), header_(0), slots_(0),
+    used_(0), stale_(0), recent_(nowNs() - racyWindow)
+{
+  load();
+  if (map_ == MAP_FAILED)
+    compact(minCapacity);
+  ++header_->generation;
+  count();
+}
+
+HashCache::~HashCache()
+{
+  try {
+    count();
+    if (stale_ > used_ / 4)
+      compact(minCapacity);
+  }
+  catch (Exception_base& e) {
+    std::cout << "warning: " << e.what() << '\n';
+  }
+  unmap();
+  close(lockFd_);
+}
+
+// Map the existing table, if there is a usable one.
+void HashCache::load()
+{
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd_ < 0) {
+    if (errno != ENOENT)
+      throw IO_error("open", path_);
+    return;
+  }
+
+  struct stat info;
+  if (fstat(fd_, &info) != 0)
+    throw IO_error("fstat", path_);
+  Header header;
+  if (size_t(info.st_size) < sizeof(header) ||
+      pread(fd_, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+      std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+      header.capacity < minCapacity || (header.capacity & (header.capacity - 1)) != 0 ||
+      size_t(info.st_size) != fileSize(header.capacity))
+  {
+    std::cout << "warning: " << path_ << " is damaged, starting over\n";
+    unmap();
+    return;
+  }
+
+  mapSize_ = info.st_size;
+  map_ = mmap(0, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map_ == MAP_FAILED)
+    throw IO_error("mmap", path_);
+  header_ = static_cast<Header*>(map_);
+  slots_ = reinterpret_cast<Slot*>(header_ + 1);
+}
+
+void HashCache::unmap()
+{
+  if (map_ != MAP_FAILED)
+    munmap(map_, mapSize_);
+  if (fd_ >= 0)
+    close(fd_);
+  map_ = MAP_FAILED;
+  fd_ = -1;
+}
+
+void HashCache::count()
+{
+  used_ = stale_ = 0;
+  for (uint64_t i = 0; i < header_->capacity; ++i) {
+    Slot const& slot = slots_[i];
+    if (slot.check == 0)
+      continue;
+    if (valid(slot))
+      ++used_;
+    if (!valid(slot) || slot.generation + keepRuns < header_->generation)
+      ++stale_;
+  }
+}
+
+// The slot holding the key, or the empty slot it would go in.  Returns 0 if
+// the table is full.
+HashCache::Slot* HashCache::find(FileKey const& key, Digest::Algorithm algorithm)
+{
+  uint64_t const mask = header_->capacity - 1;
+  uint64_t pos = keyHash(key, algorithm) & mask;
+  for (uint64_t probes = 0; probes <= mask; ++probes, pos = (pos + 1) & mask) {
+    Slot& slot = slots_[pos];
+    if (slot.check == 0)
+      return &slot;
+    if (matches(slot, key, algorithm) && valid(slot))
+      return &slot;
+  }
+  return 0;
+}
+
+bool HashCache::lookup(FileKey const& key, Digest::Algorithm algorithm, Hash& hash)
+{
+  if (trust_ != TRUST)
+    return false;
+
+  Lock lock(mutex_);
+  Slot* slot = find(key, algorithm);
+  if (slot == 0 || slot->check == 0)
+    return false;
+  slot->generation = header_->generation;
+  std::memcpy(hash.data, slot->hash, slot->length);
+  hash.length = slot->length;
+  return true;
+}
+
+bool HashCache::insert(FileKey const& key, Digest::Algorithm algorithm, Hash const& hash)
+{
+  Lock lock(mutex_);
+
+  if (key.mtime >= recent_ || key.ctime >= recent_)
+    return true;
+
+  if (2 * (used_ + 1) > header_->capacity)
+    compact(2 * header_->capacity);
+
+  Slot* slot = find(key, algorithm);
+  if (slot == 0)
+    return true;
+  bool agreed = true;
+  if (slot->check != 0) {
+    slot->generation = header_->generation;
+    if (slot->length == hash.length && std::memcmp(slot->hash, hash.data, hash.length) == 0)
+      return true;
+    // Overwrite it in place.  It is left invalid rather than empty while
+    // doing so, so as not to break the probe sequence through it.
+    agreed = false;
+    slot->check = slotCheck(*slot) ^ 1;
+    --used_;
+  }
+
+  slot->dev = key.dev;
+  slot->ino = key.ino;
+  slot->size = key.size;
+  slot->mtime = key.mtime;
+  slot->ctime = key.ctime;
+  slot->generation = header_->generation;
+  slot->algorithm = algorithm;
+  slot->length = hash.length;
+  std::memcpy(slot->hash, hash.data, hash.length);
+  __atomic_store_n(&slot->check, slotCheck(*slot), __ATOMIC_RELEASE);
+  ++used_;
+  return agreed;
+}
+
+// Rewrite the table with the given capacity, leaving out the stale slots.
+void HashCache::compact(uint64_t capacity)
+{
+  uint32_t const generation = map_ == MAP_FAILED ? 0 : header_->generation;
+
+  // Leave room for at least as many entries again as are kept.
+  uint64_t live = 0;
+  if (map_ != MAP_FAILED) {
+    for (uint64_t i = 0; i < header_->capacity; ++i) {
+      Slot const& slot = slots_[i];
+      if (slot.check != 0 && valid(slot) && slot.generation + keepRuns >= generation)
+        ++live;
+    }
+  }
+  while (capacity < minCapacity || capacity < 4 * live)
+    capacity *= 2;
+
+  std::string const tmpName = path_ + ".tmp";
+  int fd = ::open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw IO_error("open", tmpName);
+  size_t const size = fileSize(capacity);
+  void* map = MAP_FAILED;
+  if (ftruncate(fd, size) != 0 ||
+      (map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    IO_error error("ftruncate", tmpName);
+    close(fd);
+    unlink(tmpName.c_str());
+    throw error;
+  }
+
+  Header* header = static_cast<Header*>(map);
+  std::memcpy(header->magic, magic, sizeof(magic));
+  header->generation = generation;
+  header->capacity = capacity;
+  Slot* slots = reinterpret_cast<Slot*>(header + 1);
+
+  if (map_ != MAP_FAILED) {
+    for (uint64_t i = 0; i < header_->capacity; ++i) {
+      Slot const& slot = slots_[i];
+      if (slot.check == 0 || !valid(slot) || slot.generation + keepRuns < generation)
+        continue;
+      FileKey key = { slot.dev, slot.ino, slot.size, slot.mtime, slot.ctime };
+      uint64_t pos = keyHash(key, Digest::Algorithm(slot.algorithm)) & (capacity - 1);
+      while (slots[pos].check != 0)
+        pos = (pos + 1) & (capacity - 1);
+      slots[pos] = slot;
+    }
+  }
+
+  if (msync(map, size, MS_SYNC) != 0 || fsync(fd) != 0 ||
+      rename(tmpName.c_str(), path_.c_str()) != 0)
+  {
+    IO_error error("rename", tmpName);
+    munmap(map, size);
+    close(fd);
+    unlink(tmpName.c_str());
+    throw error;
+  }
+
+  unmap();
+  fd_ = fd;
+  map_ = map;
+  mapSize_ = size;
+  header_ = header;
+  slots_ = slots;
+  count();
+}
+
+}
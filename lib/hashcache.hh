@@ -0,0 +1,94 @@
+// A persistent cache of file hashes.
+
+#ifndef __HASHCACHE_H__
+#define __HASHCACHE_H__
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+}
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include "hash.hh"
+#include "thread.hh"
+
+namespace asure {
+
+// Identifies one version of a file, as far as stat can tell.
+struct FileKey {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;     // Nanoseconds.
+  int64_t ctime;
+
+  static FileKey of(struct stat const& stat);
+};
+
+// A memory mapped open addressing table from file keys to digests, kept
+// next to the surefile so that unchanged files needn't be read again.  Safe
+// to use from several threads.  Only one process uses a cache at a time.
+class HashCache : boost::noncopyable {
+ public:
+  enum Trust {
+    // Believe the cached digests of files whose key is unchanged.
+    TRUST,
+    // Hash every file anyway, only refreshing the cache.
+    PARANOID
+  };
+
+  // Open or create the cache in 'path'.  Returns 0 after printing a warning
+  // if it can't be used, such as when another asure has it open.
+  static HashCache* open(std::string const& path, Trust trust);
+
+  // Compacts the file if enough of it is stale.
+  ~HashCache();
+
+  Trust trust() const { return trust_; }
+
+  // Find the digest of the file, if the cache has it, and trust allows.
+  bool lookup(FileKey const& key, Digest::Algorithm algorithm, Hash& hash);
+
+  // Record the digest of the file.  Returns false if the cache had a
+  // different digest for the same key: the contents changed without the
+  // metadata showing it.
+  bool insert(FileKey const& key, Digest::Algorithm algorithm, Hash const& hash);
+
+  struct Header;
+  struct Slot;
+
+ private:
+  HashCache(std::string const& path, int lockFd, Trust trust);
+
+  std::string const path_;
+  int lockFd_;
+  Trust const trust_;
+  Mutex mutex_;
+
+  // The current mapping.
+  int fd_;
+  void* map_;
+  size_t mapSize_;
+  Header* header_;
+  Slot* slots_;
+
+  // Valid slots, and those that would be dropped by compaction.
+  uint64_t used_;
+  uint64_t stale_;
+
+  // Files changed this recently could change again without their key
+  // changing, so aren't cached.
+  int64_t recent_;
+
+  void load();
+  void unmap();
+  void count();
+  Slot* find(FileKey const& key, Digest::Algorithm algorithm);
+  void compact(uint64_t capacity);
+};
+
+}
+
+#endif
@@ -0,0 +1,321 @@
+// Hashing ahead of a tree traversal.
+
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lookahead.hh"
+#include "thread.hh"
+#include "exn.hh"
+
+namespace asure {
+namespace tree {
+
+HashFilter::~HashFilter()
+{
+}
+
+LookAheadOptions::LookAheadOptions() :
+    workers(processorCount()), window(1024)
+{
+}
+
+namespace {
+
+class LookAhead;
+
+// One node in the window.  The slot presents the cloned node, with the
+// expensive atts supplied by whoever computed them.
+class Slot : public Node {
+ public:
+  enum State {
+    IDLE, QUEUED, RUNNING, DONE, FAILED
+  };
+
+  Slot(LookAhead& owner, Node* node);
+  ~Slot() { }
+
+  Kind getKind() const { return node_->getKind(); }
+  std::string const& getName() const { return node_->getName(); }
+  Attrs const& getAttrs() const { return node_->getAttrs(); }
+  Atts getExpensiveAtts() const;
+
+  // Compute the expensive atts, or record why that failed.  Called without
+  // the lock, by whoever has the slot in the RUNNING or IDLE state.
+  bool compute();
+
+  // Likewise, from the file's hash computed as part of a batch.
+  bool computeFrom(HashBatch const& batch, int index);
+
+  // Whether this is a file worth hashing in a batch.
+  bool isBatchable() const { return batchable_; }
+  std::string const& getPath() const { return path_; }
+  Digest::Algorithm getDigest() const { return digest_; }
+
+ private:
+  LookAhead& owner_;
+  std::auto_ptr<Node> node_;
+  bool batchable_;
+  std::string path_;
+  Digest::Algorithm digest_;
+
+ public:
+  // The state is protected by the owner's mutex.  The other fields belong to
+  // whoever has the slot in the RUNNING or IDLE state.
+  State state;
+  Atts expensive;
+  std::string error;
+};
+
+class Worker : public Thread {
+ public:
+  Worker(LookAhead& owner) : owner_(owner) { }
+ protected:
+  void run();
+ private:
+  LookAhead& owner_;
+};
+
+class LookAhead : public NodeIterator {
+ public:
+  LookAhead(NodeIterator* inner, LookAheadOptions const& options,
+            HashFilter* filter);
+  ~LookAhead();
+
+  bool empty() const { return slots_.empty(); }
+  void operator++();
+  Node const& operator*() const { return *slots_.front(); }
+
+  // Called by the slots and the workers.
+  Node::Atts finish(Slot& slot);
+  void work();
+
+ private:
+  std::auto_ptr<NodeIterator> inner_;
+  std::auto_ptr<HashFilter> filter_;
+  std::deque<Slot*>::size_type window_;
+
+  // The nodes read ahead, the first being the current node.
+  std::deque<Slot*> slots_;
+
+  // The slots waiting for a worker.  The mutex protects this queue, the
+  // slot states, and stopping_.
+  Mutex mutex_;
+  Condition queued_;
+  Condition finished_;
+  std::deque<Slot*> queue_;
+  bool stopping_;
+
+  std::vector<Worker*> workers_;
+
+  void fill();
+  void dequeue(Slot& slot);
+  void shutdown();
+};
+
+Slot::Slot(LookAhead& owner, Node* node) :
+    owner_(owner), node_(node), batchable_(false), path_(), digest_(Digest::SHA1),
+    state(IDLE), expensive(), error()
+{
+  off_t size;
+  batchable_ = node_->hashSource(path_, size, digest_) && HashBatch::wants(size);
+}
+
+Node::Atts Slot::getExpensiveAtts() const
+{
+  return owner_.finish(const_cast<Slot&>(*this));
+}
+
+bool Slot::compute()
+{
+  try {
+    expensive = node_->getExpensiveAtts();
+    return true;
+  }
+  catch (std::exception& e) {
+    error = e.what();
+    return false;
+  }
+}
+
+bool Slot::computeFrom(HashBatch const& batch, int index)
+{
+  if (batch.failed(index)) {
+    error = batch.error(index);
+    return false;
+  }
+  expensive = node_->hashAtts(batch.hash(index));
+  return true;
+}
+
+void Worker::run()
+{
+  owner_.work();
+}
+
+LookAhead::LookAhead(NodeIterator* inner, LookAheadOptions const& options,
+                     HashFilter* filter) :
+    inner_(inner), filter_(filter), window_(std::max(options.window, 1)),
+    slots_(), mutex_(), queued_(), finished_(), queue_(), stopping_(false),
+    workers_()
+{
+  try {
+    for (int i = 0; i < options.workers; ++i) {
+      workers_.push_back(new Worker(*this));
+      workers_.back()->start();
+    }
+    fill();
+  }
+  catch (...) {
+    shutdown();
+    throw;
+  }
+}
+
+LookAhead::~LookAhead()
+{
+  shutdown();
+}
+
+// Stop the workers, and discard the window.
+void LookAhead::shutdown()
+{
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+    queue_.clear();
+    queued_.broadcast();
+  }
+
+  typedef std::vector<Worker*>::const_iterator WI;
+  for (WI i = workers_.begin(); i != workers_.end(); ++i) {
+    (*i)->join();
+    delete *i;
+  }
+  workers_.clear();
+
+  while (!slots_.empty()) {
+    delete slots_.front();
+    slots_.pop_front();
+  }
+}
+
+// Read nodes from the inner iterator until the window is full, handing the
+// wanted ones to the workers.
+void LookAhead::fill()
+{
+  while (slots_.size() < window_ && !inner_->empty()) {
+    Node const& node = **inner_;
+    bool wanted = filter_.get() == 0 || filter_->wanted(node);
+    wanted = wanted && node.getKind() == Node::NODE;
+
+    Slot* slot = new Slot(*this, node.clone());
+    slots_.push_back(slot);
+    if (wanted) {
+      Lock lock(mutex_);
+      slot->state = Slot::QUEUED;
+      queue_.push_back(slot);
+      queued_.signal();
+    }
+    ++*inner_;
+  }
+}
+
+// Take the slot back from the workers.  Waits if a worker is busy with it.
+// The mutex must be held.
+void LookAhead::dequeue(Slot& slot)
+{
+  if (slot.state == Slot::QUEUED) {
+    queue_.erase(std::find(queue_.begin(), queue_.end(), &slot));
+    slot.state = Slot::IDLE;
+  }
+  while (slot.state == Slot::RUNNING)
+    finished_.wait(mutex_);
+}
+
+void LookAhead::operator++()
+{
+  Slot* head = slots_.front();
+  {
+    Lock lock(mutex_);
+    dequeue(*head);
+  }
+  slots_.pop_front();
+  delete head;
+
+  fill();
+}
+
+Node::Atts LookAhead::finish(Slot& slot)
+{
+  {
+    Lock lock(mutex_);
+    dequeue(slot);
+  }
+
+  // Anything the workers didn't get to is computed here.
+  if (slot.state == Slot::IDLE)
+    slot.state = slot.compute() ? Slot::DONE : Slot::FAILED;
+
+  if (slot.state == Slot::FAILED)
+    throw Exception_base(slot.error);
+  return slot.expensive;
+}
+
+void LookAhead::work()
+{
+  Lock lock(mutex_);
+  while (true) {
+    while (queue_.empty() && !stopping_)
+      queued_.wait(mutex_);
+    if (stopping_)
+      return;
+
+    // Take either a single node, or a run of files to hash together.
+    std::vector<Slot*> batch;
+    do {
+      batch.push_back(queue_.front());
+      queue_.pop_front();
+      batch.back()->state = Slot::RUNNING;
+    } while (batch.front()->isBatchable() &&
+             batch.size() < size_t(HashBatch::width(batch.front()->getDigest())) &&
+             !queue_.empty() && queue_.front()->isBatchable() &&
+             queue_.front()->getDigest() == batch.front()->getDigest());
+
+    std::vector<bool> ok(batch.size());
+    mutex_.unlock();
+    if (batch.size() == 1) {
+      ok[0] = batch[0]->compute();
+    } else {
+      HashBatch hashes(batch.front()->getDigest());
+      for (size_t i = 0; i < batch.size(); ++i)
+        hashes.add(batch[i]->getPath());
+      hashes.run();
+      for (size_t i = 0; i < batch.size(); ++i)
+        ok[i] = batch[i]->computeFrom(hashes, i);
+    }
+    mutex_.lock();
+
+    for (size_t i = 0; i < batch.size(); ++i)
+      batch[i]->state = ok[i] ? Slot::DONE : Slot::FAILED;
+    finished_.broadcast();
+  }
+}
+
+}
+
+NodeIterator* lookAhead(NodeIterator* inner, LookAheadOptions const& options,
+                        HashFilter* filter)
+{
+  if (options.workers <= 0) {
+    delete filter;
+    return inner;
+  }
+  return new LookAhead(inner, options, filter);
+}
+
+}
+}
@@ -0,0 +1,44 @@
+// Hashing ahead of a tree traversal.
+
+#ifndef __LOOKAHEAD_H__
+#define __LOOKAHEAD_H__
+
+#include <boost/noncopyable.hpp>
+#include "tree.hh"
+
+namespace asure {
+namespace tree {
+
+// Decides which upcoming nodes are worth computing the expensive attributes
+// of in the background.
+class HashFilter : boost::noncopyable {
+ public:
+  virtual ~HashFilter() = 0;
+
+  // Called once for each node of the underlying traversal, in order.  Return
+  // true if the consumer is going to ask for this node's expensive atts.
+  virtual bool wanted(Node const& node) = 0;
+};
+
+struct LookAheadOptions {
+  LookAheadOptions();
+
+  // Number of hashing threads.  Zero disables the look-ahead entirely.
+  int workers;
+
+  // The most nodes that will be read ahead of the consumer.
+  int window;
+};
+
+// Wrap 'inner' in an iterator that reads up to 'window' nodes ahead of the
+// consumer, and computes the expensive atts of the upcoming nodes in a pool of
+// worker threads.  The sequence of nodes is identical to that of 'inner'.
+// Takes ownership of both 'inner' and 'filter'.  A null filter asks for every
+// node to be hashed.
+NodeIterator* lookAhead(NodeIterator* inner, LookAheadOptions const& options,
+                        HashFilter* filter = 0);
+
+}
+}
+
+#endif
@@ -0,0 +1,518 @@
+// Finding files that moved between two trees.
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <set>
+#include <tr1/memory>
+#include "moves.hh"
+#include "exn.hh"
+
+namespace asure {
+
+using tree::Attrs;
+using tree::Node;
+
+// Sorts strings bytewise.  Up to 'memory' of them are held, then sorted
+// into a run in a temporary file; the runs are merged as they are read
+// back.
+class SpillSort : boost::noncopyable {
+ public:
+  explicit SpillSort(size_t memory) :
+      memory_(memory), held_(0), records_(), runs_(), heads_(), queue_(HeadOrder(heads_)),
+      reading_(false), pos_(0) { }
+  ~SpillSort();
+
+  void add(std::string const& record);
+
+  // Once everything has been added, give the records in order.  Returns
+  // false after the last.
+  bool next(std::string& record);
+
+ private:
+  // Orders the runs by their next record, smallest first.
+  struct HeadOrder {
+    explicit HeadOrder(std::vector<std::string> const& heads_) : heads(&heads_) { }
+    bool operator()(size_t a, size_t b) const { return (*heads)[b] < (*heads)[a]; }
+    std::vector<std::string> const* heads;
+  };
+
+  size_t const memory_;
+  size_t held_;
+  std::vector<std::string> records_;
+  std::vector<FILE*> runs_;
+  std::vector<std::string> heads_;
+  std::priority_queue<size_t, std::vector<size_t>, HeadOrder> queue_;
+  bool reading_;
+  size_t pos_;
+
+  void spill();
+  void start();
+  bool readRun(size_t run);
+};
+
+namespace {
+
+// What each record held in memory costs, beyond its bytes.
+size_t const recordOverhead = sizeof(std::string) + 32;
+
+// Records put in a run in the moment before more would have to be held.
+size_t const minimumMemory = 1 << 20;
+
+// How many removed things with the same contents are held to match the
+// added ones against.  Any more are reported as removed.
+size_t const groupLimit = 1024;
+
+size_t const keySize = 16;
+
+void putNumber(std::string& out, uint64_t value, int bytes)
+{
+  for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8)
+    out += char(value >> shift);
+}
+
+uint64_t getNumber(std::string const& in, size_t& pos, int bytes)
+{
+  if (in.size() - pos < size_t(bytes))
+    throw Exception_base("corrupt move index record");
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; ++i)
+    value = value << 8 | (unsigned char)in[pos++];
+  return value;
+}
+
+void putVarint(FILE* file, uint64_t value)
+{
+  while (value >= 0x80) {
+    std::putc(int((value & 0x7f) | 0x80), file);
+    value >>= 7;
+  }
+  std::putc(int(value), file);
+}
+
+// What the index knows of something removed or added, as it is sorted to
+// match up those with the same contents.  Directories come first, those
+// with the most in them first, so that a directory is matched before
+// anything within it, which can then be passed over.
+//
+//   directory: 'd', ~size (8), key, side, number (8), ancestors
+//   file:      'f', key, side, number (8), ancestors
+//
+// The ancestors are a count (4), and the numbers of the directories it is
+// within (8 each).  Then comes the path.  The records match when they are
+// the same up to the side.
+struct Record {
+  bool isDir;
+  MoveIndex::Side side;
+  uint64_t sequence;
+  std::vector<uint64_t> ancestors;
+  std::string path;
+
+  static void make(std::string& out, bool isDir, uint64_t size, std::string const& key,
+                   MoveIndex::Side side, uint64_t sequence,
+                   std::vector<uint64_t> const& ancestors, std::string const& path);
+  static size_t prefix(std::string const& record);
+  void parse(std::string const& record);
+};
+
+void Record::make(std::string& out, bool isDir, uint64_t size, std::string const& key,
+                  MoveIndex::Side side, uint64_t sequence,
+                  std::vector<uint64_t> const& ancestors, std::string const& path)
+{
+  out.clear();
+  out += isDir ? 'd' : 'f';
+  if (isDir)
+    putNumber(out, ~size, 8);
+  out += key;
+  out += char(side);
+  putNumber(out, sequence, 8);
+  putNumber(out, ancestors.size(), 4);
+  for (size_t i = 0; i < ancestors.size(); ++i)
+    putNumber(out, ancestors[i], 8);
+  out += path;
+}
+
+size_t Record::prefix(std::string const& record)
+{
+  return 1 + (record[0] == 'd' ? 8 : 0) + keySize;
+}
+
+void Record::parse(std::string const& record)
+{
+  isDir = record[0] == 'd';
+  size_t pos = prefix(record);
+  side = MoveIndex::Side(getNumber(record, pos, 1));
+  sequence = getNumber(record, pos, 8);
+  ancestors.resize(getNumber(record, pos, 4));
+  for (size_t i = 0; i < ancestors.size(); ++i)
+    ancestors[i] = getNumber(record, pos, 8);
+  path.assign(record, pos, std::string::npos);
+}
+
+// The key a file's contents are matched by, or false if it has none to go
+// by.  Empty files would all match each other, so they aren't matched.
+bool contentKey(Attrs const& attrs, std::string& key)
+{
+  if ((attrs.has(Attrs::KIND) && attrs.kind() != Attrs::FILE) ||
+      !attrs.has(Attrs::DIGEST) || !attrs.has(Attrs::SIZE) || attrs.number(Attrs::SIZE) == 0)
+    return false;
+  std::string data;
+  data += char(attrs.algorithm());
+  data.append(reinterpret_cast<char const*>(attrs.digest().data), attrs.digest().length);
+  putNumber(data, attrs.number(Attrs::SIZE), 8);
+  std::auto_ptr<Digest> digest(Digest::create(Digest::BLAKE3));
+  digest->update(data.data(), data.size());
+  Hash hash;
+  digest->final(hash);
+  key.assign(reinterpret_cast<char const*>(hash.data), keySize);
+  return true;
+}
+
+std::string lastName(std::string const& path)
+{
+  return path.substr(path.rfind('/') + 1);
+}
+
+// The start of a line of the report, in a column as wide as the attribute
+// names.
+std::string label(std::string const& text)
+{
+  std::string result = text;
+  result.resize(std::max(result.size() + 1, size_t(25)), ' ');
+  return result;
+}
+
+}
+
+SpillSort::~SpillSort()
+{
+  for (size_t i = 0; i < runs_.size(); ++i)
+    std::fclose(runs_[i]);
+}
+
+void SpillSort::add(std::string const& record)
+{
+  records_.push_back(record);
+  held_ += record.size() + recordOverhead;
+  if (held_ > std::max(memory_, minimumMemory))
+    spill();
+}
+
+void SpillSort::spill()
+{
+  std::sort(records_.begin(), records_.end());
+  FILE* run = std::tmpfile();
+  if (run == 0)
+    throw IO_error("tmpfile", "move index");
+  runs_.push_back(run);
+  for (size_t i = 0; i < records_.size(); ++i) {
+    putVarint(run, records_[i].size());
+    std::fwrite(records_[i].data(), 1, records_[i].size(), run);
+  }
+  if (std::fflush(run) != 0 || std::ferror(run))
+    throw IO_error("write", "move index");
+  std::vector<std::string>().swap(records_);
+  held_ = 0;
+}
+
+void SpillSort::start()
+{
+  reading_ = true;
+  if (runs_.empty()) {
+    std::sort(records_.begin(), records_.end());
+    return;
+  }
+  if (!records_.empty())
+    spill();
+  heads_.resize(runs_.size());
+  for (size_t i = 0; i < runs_.size(); ++i) {
+    std::rewind(runs_[i]);
+    if (readRun(i))
+      queue_.push(i);
+  }
+}
+
+// Read the next record of a run into its head.
+bool SpillSort::readRun(size_t run)
+{
+  FILE* const file = runs_[run];
+  uint64_t length = 0;
+  for (int shift = 0; ; shift += 7) {
+    int const ch = std::getc(file);
+    if (ch == EOF) {
+      if (shift == 0 && !std::ferror(file))
+        return false;
+      throw IO_error("read", "move index");
+    }
+    length |= uint64_t(ch & 0x7f) << shift;
+    if ((ch & 0x80) == 0)
+      break;
+  }
+  std::string& head = heads_[run];
+  head.resize(length);
+  if (length > 0 && std::fread(&head[0], 1, length, file) != length)
+    throw IO_error("read", "move index");
+  return true;
+}
+
+bool SpillSort::next(std::string& record)
+{
+  if (!reading_)
+    start();
+  if (runs_.empty()) {
+    if (pos_ == records_.size())
+      return false;
+    record.swap(records_[pos_++]);
+    return true;
+  }
+  if (queue_.empty())
+    return false;
+  size_t const run = queue_.top();
+  queue_.pop();
+  record.swap(heads_[run]);
+  if (readRun(run))
+    queue_.push(run);
+  return true;
+}
+
+// A directory given to enter() that hasn't been left, with the digest of
+// what is in it so far.
+struct MoveIndex::Open {
+  Open(Side side_, uint64_t sequence_, std::string const& path_) :
+      side(side_), sequence(sequence_), path(path_), size(0),
+      digest(Digest::create(Digest::BLAKE3)) { }
+  Side side;
+  uint64_t sequence;
+  std::string path;
+  // How many directories and files are within it.
+  uint64_t size;
+  std::tr1::shared_ptr<Digest> digest;
+};
+
+MoveIndex::MoveIndex(size_t memory) :
+    matches_(new SpillSort(memory / 2)), lines_(new SpillSort(memory / 2)),
+    open_(), sequence_(0)
+{
+}
+
+MoveIndex::~MoveIndex()
+{
+}
+
+void MoveIndex::enter(Side side, std::string const& path)
+{
+  open_.push_back(Open(side, sequence_++, path));
+}
+
+void MoveIndex::leave()
+{
+  Open const dir = open_.back();
+  open_.pop_back();
+  Hash hash;
+  dir.digest->final(hash);
+  std::string const key(reinterpret_cast<char const*>(hash.data), keySize);
+
+  std::vector<uint64_t> ancestors;
+  for (size_t i = 0; i < open_.size(); ++i)
+    ancestors.push_back(open_[i].sequence);
+  std::string record;
+  Record::make(record, true, dir.size, key, dir.side, dir.sequence, ancestors, dir.path);
+  matches_->add(record);
+
+  if (!open_.empty()) {
+    open_.back().size += dir.size + 1;
+    std::string const entry = 'd' + lastName(dir.path) + '\0' + key;
+    open_.back().digest->update(entry.data(), entry.size());
+  }
+}
+
+void MoveIndex::file(Side side, std::string const& path, Attrs const& attrs)
+{
+  uint64_t const sequence = sequence_++;
+  std::string key;
+  bool const keyed = contentKey(attrs, key);
+  if (!open_.empty()) {
+    std::string entry = 'f' + lastName(path) + '\0';
+    if (keyed)
+      entry += key;
+    else {
+      entry += char(attrs.has(Attrs::KIND) ? attrs.kind() : Attrs::FILE);
+      entry += attrs.target();
+    }
+    open_.back().digest->update(entry.data(), entry.size());
+    ++open_.back().size;
+  }
+
+  if (keyed) {
+    std::vector<uint64_t> ancestors;
+    for (size_t i = 0; i < open_.size(); ++i)
+      ancestors.push_back(open_[i].sequence);
+    std::string record;
+    Record::make(record, false, 0, key, side, sequence, ancestors, path);
+    matches_->add(record);
+  } else if (open_.empty())
+    defaultLine(sequence, side, false, path);
+}
+
+void MoveIndex::note(std::string const& text)
+{
+  line(sequence_++, text);
+}
+
+void MoveIndex::line(uint64_t sequence, std::string const& text)
+{
+  std::string record;
+  putNumber(record, sequence, 8);
+  record += text;
+  lines_->add(record);
+}
+
+// The line reported for something removed or added that matched nothing.
+void MoveIndex::defaultLine(uint64_t sequence, Side side, bool isDir, std::string const& path)
+{
+  line(sequence, label(std::string(side == REMOVED ? "- " : "+ ") + (isDir ? "dir" : "file")) +
+       path + '\n');
+}
+
+void MoveIndex::report(std::ostream& out)
+{
+  // The directories that matched, whose contents are passed over.
+  std::set<uint64_t> matched;
+
+  // Those with the same contents are together, the removed first.  Each
+  // added one is paired with a removed one, and once those run out, is a
+  // copy of the first.
+  std::string record, group;
+  std::vector<Record> removed;
+  size_t paired = 0;
+  Record item;
+  while (true) {
+    bool const more = matches_->next(record);
+    if (!more || record.compare(0, Record::prefix(record), group) != 0) {
+      for (size_t i = paired; i < removed.size(); ++i) {
+        if (removed[i].ancestors.empty())
+          defaultLine(removed[i].sequence, REMOVED, removed[i].isDir, removed[i].path);
+      }
+      removed.clear();
+      paired = 0;
+      if (!more)
+        break;
+      group.assign(record, 0, Record::prefix(record));
+    }
+
+    item.parse(record);
+    bool inMatched = false;
+    for (size_t i = 0; i < item.ancestors.size() && !inMatched; ++i)
+      inMatched = matched.count(item.ancestors[i]) != 0;
+    if (inMatched)
+      continue;
+
+    bool const shown = item.ancestors.empty();
+    char const* const kind = item.isDir ? "dir" : "file";
+    if (item.side == REMOVED) {
+      if (removed.size() < groupLimit)
+        removed.push_back(item);
+      else if (shown)
+        defaultLine(item.sequence, REMOVED, item.isDir, item.path);
+    } else if (paired < removed.size()) {
+      Record const& from = removed[paired++];
+      line(item.sequence, label(std::string("> ") + kind) + from.path + " -> " + item.path + '\n');
+      if (item.isDir) {
+        matched.insert(from.sequence);
+        matched.insert(item.sequence);
+      }
+    } else if (!removed.empty()) {
+      line(item.sequence, label(std::string("+ ") + kind + " copy") + removed[0].path + " -> " +
+           item.path + '\n');
+      if (item.isDir)
+        matched.insert(item.sequence);
+    } else if (shown)
+      defaultLine(item.sequence, ADDED, item.isDir, item.path);
+  }
+
+  while (lines_->next(record))
+    out.write(record.data() + 8, record.size() - 8);
+}
+
+RenameCache::RenameCache(size_t memory) :
+    limit_(std::max(memory / (sizeof(Key) + sizeof(Entry) + 3 * sizeof(void*) + sizeof(Key)),
+                    size_t(1))),
+    entries_(), order_()
+{
+}
+
+bool RenameCache::Key::operator<(Key const& other) const
+{
+  if (ino != other.ino)
+    return ino < other.ino;
+  if (size != other.size)
+    return size < other.size;
+  if (mtime != other.mtime)
+    return mtime < other.mtime;
+  return mtimens < other.mtimens;
+}
+
+bool RenameCache::keyOf(Attrs const& attrs, Key& key)
+{
+  if ((attrs.has(Attrs::KIND) && attrs.kind() != Attrs::FILE) || !attrs.has(Attrs::INO) ||
+      !attrs.has(Attrs::SIZE) || !attrs.has(Attrs::MTIME))
+    return false;
+  key.ino = attrs.number(Attrs::INO);
+  key.size = attrs.number(Attrs::SIZE);
+  key.mtime = attrs.number(Attrs::MTIME);
+  key.mtimens = attrs.has(Attrs::MTIMENS) ? attrs.number(Attrs::MTIMENS) : 0;
+  return true;
+}
+
+void RenameCache::removed(Attrs const& attrs)
+{
+  Key key;
+  if (!attrs.has(Attrs::DIGEST) || !keyOf(attrs, key))
+    return;
+  Entry entry;
+  entry.algorithm = attrs.algorithm();
+  entry.digest = attrs.digest();
+  std::pair<std::map<Key, Entry>::iterator, bool> const added =
+    entries_.insert(std::make_pair(key, entry));
+  if (!added.second) {
+    added.first->second = entry;
+    return;
+  }
+  order_.push_back(key);
+  if (order_.size() > limit_) {
+    entries_.erase(order_.front());
+    order_.pop_front();
+  }
+}
+
+void RenameCache::removed(tree::NodeIterator& tree)
+{
+  int depth = 0;
+  do {
+    Node const& node = *tree;
+    if (node.getKind() == Node::ENTER)
+      ++depth;
+    else if (node.getKind() == Node::LEAVE)
+      --depth;
+    else if (node.getKind() == Node::NODE) {
+      Attrs storage;
+      removed(node.getFullAttrs(storage));
+    }
+    ++tree;
+  } while (depth > 0);
+}
+
+bool RenameCache::find(Attrs const& attrs, Attrs& reused) const
+{
+  Key key;
+  if (!keyOf(attrs, key))
+    return false;
+  std::map<Key, Entry>::const_iterator const found = entries_.find(key);
+  if (found == entries_.end())
+    return false;
+  reused = attrs;
+  reused.setDigest(found->second.algorithm, found->second.digest);
+  return true;
+}
+
+}
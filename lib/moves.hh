@@ -0,0 +1,103 @@
+// Finding files that moved between two trees.
+
+#ifndef __MOVES_H__
+#define __MOVES_H__
+
+extern "C" {
+#include <stdint.h>
+}
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "tree.hh"
+
+namespace asure {
+
+class SpillSort;
+
+// Collects what a comparison found removed from the old tree and added to
+// the new one, to report those with the same contents as moved or copied,
+// rather than as removed and added.  Files match by their size and digest,
+// and directories by the names and contents of everything within them.
+//
+// Everything is numbered in the order it is given, and the report comes out
+// in that order, with the other lines the comparison gives it with note().
+// What is held is kept in memory up to a limit, then sorted and spilled to
+// temporary files, which are merged back for the report.
+class MoveIndex : boost::noncopyable {
+ public:
+  enum Side {
+    REMOVED, ADDED
+  };
+
+  explicit MoveIndex(size_t memory);
+  ~MoveIndex();
+
+  // A removed or added directory, or one within it, and the end of it.
+  void enter(Side side, std::string const& path);
+  void leave();
+
+  // A removed or added file, or one within a directory given to enter().
+  void file(Side side, std::string const& path, tree::Attrs const& attrs);
+
+  // Lines of the report that aren't about removed or added things.
+  void note(std::string const& text);
+
+  // Match everything up, and write out the report.
+  void report(std::ostream& out);
+
+ private:
+  struct Open;
+
+  std::auto_ptr<SpillSort> matches_;
+  std::auto_ptr<SpillSort> lines_;
+  std::vector<Open> open_;
+  uint64_t sequence_;
+
+  void line(uint64_t sequence, std::string const& text);
+  void defaultLine(uint64_t sequence, Side side, bool isDir, std::string const& path);
+};
+
+// The digests of files removed from the old tree, by their inode, size and
+// mtime, which a rename leaves alone, so that a renamed file needn't be
+// hashed again under its new name.  Only files removed before the new name
+// is reached in the walk are found.  Holds what fits in 'memory',
+// forgetting the oldest beyond that.
+class RenameCache : boost::noncopyable {
+ public:
+  explicit RenameCache(size_t memory);
+
+  // A file, or everything in a directory, removed from the old tree.
+  void removed(tree::Attrs const& attrs);
+  void removed(tree::NodeIterator& tree);
+
+  // Whether the new file is one that was removed, giving its attributes with
+  // the old digest if so.
+  bool find(tree::Attrs const& attrs, tree::Attrs& reused) const;
+
+ private:
+  struct Key {
+    uint64_t ino, size;
+    int64_t mtime, mtimens;
+    bool operator<(Key const& other) const;
+  };
+  struct Entry {
+    Digest::Algorithm algorithm;
+    Hash digest;
+  };
+
+  size_t const limit_;
+  std::map<Key, Entry> entries_;
+  std::deque<Key> order_;
+
+  static bool keyOf(tree::Attrs const& attrs, Key& key);
+};
+
+}
+
+#endif
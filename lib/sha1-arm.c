@@ -0,0 +1,86 @@
+/*
+ * SHA1 block kernel using the ARMv8 cryptography extensions.
+ *
+ * Each group of four rounds is one sha1c/sha1p/sha1m instruction, with
+ * sha1h producing the E term for the next group, and sha1su0/sha1su1
+ * expanding the message schedule.  The kernel is only called after
+ * blk_SHA1_Have_armv8() finds the SHA1 capability in the auxiliary vector.
+ */
+
+#include "sha1-kernels.h"
+
+#ifdef SHA1_HAVE_ARMV8
+
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("crypto"))), apply_to = function)
+#else
+#pragma GCC target ("+crypto")
+#endif
+
+#include <arm_neon.h>
+
+int blk_SHA1_Have_armv8(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+void blk_SHA1_Blocks_armv8(blk_SHA_CTX *ctx, const void *data, unsigned long blocks)
+{
+	static const uint32_t K[4] = {
+		0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+	};
+	const uint8_t *p = data;
+	uint32x4_t abcd, abcd_save, tmp;
+	uint32x4_t msg[4];
+	uint32_t e, e_save, e_next;
+	int i, k;
+
+	abcd = vld1q_u32(ctx->H);
+	e = ctx->H[4];
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e_save = e;
+
+		for (i = 0; i < 4; i++)
+			msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * i)));
+
+		for (k = 0; k < 20; k++) {
+			/* Replace W[4k-16..4k-13] with W[4k..4k+3]. */
+			if (k >= 4)
+				msg[k&3] = vsha1su1q_u32(
+					vsha1su0q_u32(msg[k&3], msg[(k+1)&3], msg[(k+2)&3]),
+					msg[(k+3)&3]);
+			tmp = vaddq_u32(msg[k&3], vdupq_n_u32(K[k / 5]));
+			e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			switch (k / 5) {
+			case 0:
+				abcd = vsha1cq_u32(abcd, e, tmp);
+				break;
+			case 2:
+				abcd = vsha1mq_u32(abcd, e, tmp);
+				break;
+			default:
+				abcd = vsha1pq_u32(abcd, e, tmp);
+				break;
+			}
+			e = e_next;
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		e += e_save;
+		p += 64;
+	}
+
+	vst1q_u32(ctx->H, abcd);
+	ctx->H[4] = e;
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#endif
+
+#endif
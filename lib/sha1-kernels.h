@@ -0,0 +1,34 @@
+/*
+ * SHA1 block kernels.  Each processes 'blocks' consecutive 64-byte blocks
+ * of 'data' into ctx->H.  The data need not be aligned.
+ */
+
+#ifndef __SHA1_KERNELS_H__
+#define __SHA1_KERNELS_H__
+
+#include "sha1.h"
+
+typedef void (*blk_SHA1_blocks_fn)(blk_SHA_CTX *ctx, const void *data, unsigned long blocks);
+
+struct blk_SHA1_kernel {
+	const char *name;
+	blk_SHA1_blocks_fn blocks;
+	/* Returns non-zero if the CPU can run this kernel, null if always. */
+	int (*available)(void);
+};
+
+void blk_SHA1_Blocks_portable(blk_SHA_CTX *ctx, const void *data, unsigned long blocks);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SHA1_HAVE_SHANI
+void blk_SHA1_Blocks_shani(blk_SHA_CTX *ctx, const void *data, unsigned long blocks);
+int blk_SHA1_Have_shani(void);
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define SHA1_HAVE_ARMV8
+void blk_SHA1_Blocks_armv8(blk_SHA_CTX *ctx, const void *data, unsigned long blocks);
+int blk_SHA1_Have_armv8(void);
+#endif
+
+#endif
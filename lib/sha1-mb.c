@@ -0,0 +1,364 @@
+/*
+ * Multi-buffer SHA1: hash several independent messages at once, one per
+ * 32-bit SIMD lane.  This pays off for many short messages, where a
+ * single message doesn't have enough blocks to keep a fast kernel busy.
+ *
+ * Each message is padded separately.  Its whole blocks are read in place,
+ * and the final one or two padded blocks come from a small tail buffer.
+ * Lanes whose message has run out of blocks keep computing on zeros, but
+ * their state isn't updated.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sha1.h"
+
+struct mb_lane {
+	const unsigned char *data;
+	unsigned long full;		/* Blocks read from data. */
+	unsigned long blocks;		/* Total blocks, including the tail. */
+	unsigned char tail[128];
+};
+
+static const unsigned char zero_block[64];
+
+static void mb_prepare(struct mb_lane *lane, const void *data, unsigned long len)
+{
+	unsigned long rem = len & 63;
+	unsigned long bits_hi = len >> 29;
+	unsigned long bits_lo = len << 3;
+	unsigned tail_len = rem < 56 ? 64 : 128;
+	unsigned int be;
+
+	lane->data = data;
+	lane->full = len / 64;
+	lane->blocks = lane->full + tail_len / 64;
+	memset(lane->tail, 0, tail_len);
+	memcpy(lane->tail, (const unsigned char *)data + len - rem, rem);
+	lane->tail[rem] = 0x80;
+	be = htonl(bits_hi);
+	memcpy(lane->tail + tail_len - 8, &be, 4);
+	be = htonl(bits_lo);
+	memcpy(lane->tail + tail_len - 4, &be, 4);
+}
+
+static const unsigned char *mb_block(const struct mb_lane *lane, unsigned long b)
+{
+	if (b < lane->full)
+		return lane->data + 64 * b;
+	if (b < lane->blocks)
+		return lane->tail + 64 * (b - lane->full);
+	return zero_block;
+}
+
+static unsigned int mb_get_be32(const unsigned char *p)
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static void mb_put_be32(unsigned char *p, unsigned int v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static const unsigned int sha1_init[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SHA1_HAVE_MB
+
+#include <immintrin.h>
+#include "cpu.h"
+
+/* The lane count to use: 16 with AVX-512, 8 with AVX2, otherwise 1. */
+static int mb_detect(void)
+{
+	if (cpu_x86_avx512f())
+		return 16;
+	if (cpu_x86_avx2())
+		return 8;
+	return 1;
+}
+
+#define MB_F1(b, c, d) OR(AND(b, c), ANDNOT(b, d))
+#define MB_F2(b, c, d) XOR(XOR(b, c), d)
+#define MB_F3(b, c, d) OR(OR(AND(b, c), AND(b, d)), AND(c, d))
+
+#define MB_ROUNDS(first, last, F, k) \
+	for (t = first; t < last; t++) { \
+		if (t >= 16) \
+			w[t & 15] = ROL(XOR(XOR(w[(t - 3) & 15], w[(t - 8) & 15]), \
+					XOR(w[(t - 14) & 15], w[t & 15])), 1); \
+		tmp = ADD(ADD(ROL(a, 5), F(b, c, d)), \
+			  ADD(ADD(e, SET1(k)), w[t & 15])); \
+		e = d; \
+		d = c; \
+		c = ROL(b, 30); \
+		b = a; \
+		a = tmp; \
+	}
+
+#define MB_ALL_ROUNDS() \
+	MB_ROUNDS(0, 20, MB_F1, 0x5a827999) \
+	MB_ROUNDS(20, 40, MB_F2, 0x6ed9eba1) \
+	MB_ROUNDS(40, 60, MB_F3, 0x8f1bbcdc) \
+	MB_ROUNDS(60, 80, MB_F2, 0xca62c1d6)
+
+#define ADD(x, y)	_mm256_add_epi32(x, y)
+#define AND(x, y)	_mm256_and_si256(x, y)
+#define ANDNOT(x, y)	_mm256_andnot_si256(x, y)
+#define OR(x, y)	_mm256_or_si256(x, y)
+#define XOR(x, y)	_mm256_xor_si256(x, y)
+#define SET1(x)		_mm256_set1_epi32(x)
+#define ROL(x, n)	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void mb_avx2(const struct mb_lane *lanes, unsigned int state[][8])
+{
+	unsigned int stage[16][8] __attribute__((aligned(32)));
+	unsigned int active[8] __attribute__((aligned(32)));
+	__m256i h[5], w[16], a, b, c, d, e, tmp, mask;
+	unsigned long blocks = 0, blk;
+	int i, t;
+
+	for (i = 0; i < 8; i++)
+		if (lanes[i].blocks > blocks)
+			blocks = lanes[i].blocks;
+	for (i = 0; i < 5; i++)
+		h[i] = SET1(sha1_init[i]);
+
+	for (blk = 0; blk < blocks; blk++) {
+		for (i = 0; i < 8; i++) {
+			const unsigned char *p = mb_block(&lanes[i], blk);
+			for (t = 0; t < 16; t++)
+				stage[t][i] = mb_get_be32(p + 4 * t);
+			active[i] = blk < lanes[i].blocks ? ~0U : 0;
+		}
+		for (t = 0; t < 16; t++)
+			w[t] = _mm256_load_si256((const __m256i *)stage[t]);
+		mask = _mm256_load_si256((const __m256i *)active);
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+		MB_ALL_ROUNDS()
+
+		h[0] = _mm256_blendv_epi8(h[0], ADD(h[0], a), mask);
+		h[1] = _mm256_blendv_epi8(h[1], ADD(h[1], b), mask);
+		h[2] = _mm256_blendv_epi8(h[2], ADD(h[2], c), mask);
+		h[3] = _mm256_blendv_epi8(h[3], ADD(h[3], d), mask);
+		h[4] = _mm256_blendv_epi8(h[4], ADD(h[4], e), mask);
+	}
+
+	for (i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i *)state[i], h[i]);
+}
+
+#undef ADD
+#undef AND
+#undef ANDNOT
+#undef OR
+#undef XOR
+#undef SET1
+#undef ROL
+
+#define ADD(x, y)	_mm512_add_epi32(x, y)
+#define AND(x, y)	_mm512_and_si512(x, y)
+#define ANDNOT(x, y)	_mm512_andnot_si512(x, y)
+#define OR(x, y)	_mm512_or_si512(x, y)
+#define XOR(x, y)	_mm512_xor_si512(x, y)
+#define SET1(x)		_mm512_set1_epi32(x)
+#define ROL(x, n)	_mm512_rol_epi32(x, n)
+
+__attribute__((target("avx512f")))
+static void mb_avx512(const struct mb_lane *lanes, unsigned int state[][16])
+{
+	unsigned int stage[16][16] __attribute__((aligned(64)));
+	__m512i h[5], w[16], a, b, c, d, e, tmp;
+	__mmask16 mask;
+	unsigned long blocks = 0, blk;
+	int i, t;
+
+	for (i = 0; i < 16; i++)
+		if (lanes[i].blocks > blocks)
+			blocks = lanes[i].blocks;
+	for (i = 0; i < 5; i++)
+		h[i] = SET1(sha1_init[i]);
+
+	for (blk = 0; blk < blocks; blk++) {
+		mask = 0;
+		for (i = 0; i < 16; i++) {
+			const unsigned char *p = mb_block(&lanes[i], blk);
+			for (t = 0; t < 16; t++)
+				stage[t][i] = mb_get_be32(p + 4 * t);
+			if (blk < lanes[i].blocks)
+				mask |= 1 << i;
+		}
+		for (t = 0; t < 16; t++)
+			w[t] = _mm512_load_si512(stage[t]);
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+		MB_ALL_ROUNDS()
+
+		h[0] = _mm512_mask_add_epi32(h[0], mask, h[0], a);
+		h[1] = _mm512_mask_add_epi32(h[1], mask, h[1], b);
+		h[2] = _mm512_mask_add_epi32(h[2], mask, h[2], c);
+		h[3] = _mm512_mask_add_epi32(h[3], mask, h[3], d);
+		h[4] = _mm512_mask_add_epi32(h[4], mask, h[4], e);
+	}
+
+	for (i = 0; i < 5; i++)
+		_mm512_storeu_si512(state[i], h[i]);
+}
+
+#undef ADD
+#undef AND
+#undef ANDNOT
+#undef OR
+#undef XOR
+#undef SET1
+#undef ROL
+
+#endif
+
+static int lanes;
+static pthread_once_t lanes_once = PTHREAD_ONCE_INIT;
+
+static void select_lanes(void)
+{
+#ifdef SHA1_HAVE_MB
+	lanes = mb_detect();
+#else
+	lanes = 1;
+#endif
+}
+
+int blk_SHA1_MultiLanes(void)
+{
+	pthread_once(&lanes_once, select_lanes);
+
+	/*
+	 * Eight AVX2 lanes are slower than one lane of the SHA extensions,
+	 * so only use them over the portable kernel.  Sixteen AVX-512 lanes
+	 * win either way.
+	 */
+	if (lanes == 8 && strcmp(blk_SHA1_Kernel(), "portable") != 0)
+		return 1;
+	return lanes;
+}
+
+/* Hash one group of up to 'width' messages in the SIMD kernel. */
+static void mb_group(int width, int count, const void *const data[],
+		     const unsigned long len[], unsigned char hashout[][20])
+{
+#ifdef SHA1_HAVE_MB
+	struct mb_lane group[16];
+	unsigned int state[5][16];
+	int i, j;
+
+	for (i = 0; i < width; i++) {
+		if (i < count)
+			mb_prepare(&group[i], data[i], len[i]);
+		else
+			memset(&group[i], 0, sizeof(group[i]));
+	}
+
+	if (width == 16) {
+		mb_avx512(group, state);
+	} else {
+		unsigned int narrow[5][8];
+		mb_avx2(group, narrow);
+		for (j = 0; j < 5; j++)
+			for (i = 0; i < 8; i++)
+				state[j][i] = narrow[j][i];
+	}
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < 5; j++)
+			mb_put_be32(hashout[i] + 4 * j, state[j][i]);
+#else
+	(void)width; (void)count; (void)data; (void)len; (void)hashout;
+#endif
+}
+
+static void single(const void *data, unsigned long len, unsigned char hashout[20])
+{
+	blk_SHA_CTX ctx;
+
+	blk_SHA1_Init(&ctx);
+	blk_SHA1_Update(&ctx, data, len);
+	blk_SHA1_Final(hashout, &ctx);
+}
+
+static void multi(int width, int count, const void *const data[],
+		  const unsigned long len[], unsigned char hashout[][20])
+{
+	int done = 0;
+
+	/*
+	 * Full groups go through the SIMD kernel.  A group more than half
+	 * empty is cheaper done one message at a time.
+	 */
+	while (width > 1 && count - done > width / 2) {
+		int n = count - done < width ? count - done : width;
+		mb_group(width, n, data + done, len + done, hashout + done);
+		done += n;
+	}
+	for (; done < count; done++)
+		single(data[done], len[done], hashout[done]);
+}
+
+void blk_SHA1_Multi(int count, const void *const data[], const unsigned long len[],
+		    unsigned char hashout[][20])
+{
+	multi(blk_SHA1_MultiLanes(), count, data, len, hashout);
+}
+
+/*
+ * Check each multi-buffer kernel against hashing the same messages one at
+ * a time.  The messages in a group are of different lengths, so lanes
+ * finish at different blocks.
+ */
+int blk_SHA1_MultiSelfTest(void (*report)(const char *kernel, int passed))
+{
+	static unsigned char buf[16 * 300 + 64];
+	const void *data[16];
+	unsigned long len[16];
+	unsigned char expect[16][20], got[16][20];
+	unsigned int seed = 7;
+	int width, count, i, round;
+	int failures = 0;
+
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (width = 8; width <= 16; width *= 2) {
+		int passed = 1;
+
+		pthread_once(&lanes_once, select_lanes);
+		if (lanes < width)
+			continue;
+		for (round = 0; round < 40; round++) {
+			count = 1 + round % width;
+			for (i = 0; i < count; i++) {
+				data[i] = buf + 300 * i + round % 7;
+				len[i] = (round * 37 + i * 61) % 300;
+				single(data[i], len[i], expect[i]);
+			}
+			multi(width, count, data, len, got);
+			if (memcmp(expect, got, 20 * count) != 0)
+				passed = 0;
+		}
+		if (!passed)
+			failures++;
+		if (report)
+			report(width == 8 ? "avx2 x8" : "avx512 x16", passed);
+	}
+	return failures;
+}
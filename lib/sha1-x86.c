@@ -0,0 +1,80 @@
+/*
+ * SHA1 block kernel using the x86 SHA extensions (SHA-NI).
+ *
+ * The rounds are done four at a time by sha1rnds4, with sha1nexte
+ * computing the E term of the next group of four, and sha1msg1/sha1msg2
+ * expanding the message schedule.  The function is compiled for the SHA
+ * extensions regardless of the build flags, and is only called after
+ * blk_SHA1_Have_shani() confirms the CPU supports them.
+ */
+
+#include "sha1-kernels.h"
+
+#ifdef SHA1_HAVE_SHANI
+
+#include <immintrin.h>
+#include "cpu.h"
+
+int blk_SHA1_Have_shani(void)
+{
+	return cpu_x86_sha();
+}
+
+/*
+ * One group of four rounds, 'k' being the group number, 1 to 19.  msg[k&3]
+ * holds W[4k-16..4k-13] on entry for k >= 4 and is replaced with
+ * W[4k..4k+3].  'prev' is ABCD from before the previous group.
+ */
+#define SHANI_GROUP(k) do { \
+	if ((k) >= 4) \
+		msg[(k)&3] = _mm_sha1msg2_epu32( \
+			_mm_xor_si128(_mm_sha1msg1_epu32(msg[(k)&3], msg[((k)+1)&3]), \
+				msg[((k)+2)&3]), \
+			msg[((k)+3)&3]); \
+	e = _mm_sha1nexte_epu32(prev, msg[(k)&3]); \
+	prev = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, (k) / 5); \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void blk_SHA1_Blocks_shani(blk_SHA_CTX *ctx, const void *data, unsigned long blocks)
+{
+	const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	const unsigned char *p = data;
+	__m128i abcd, e0, abcd_save, e0_save, e, prev;
+	__m128i msg[4];
+	int i;
+
+	abcd = _mm_loadu_si128((const __m128i *)ctx->H);
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	e0 = _mm_set_epi32(ctx->H[4], 0, 0, 0);
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		for (i = 0; i < 4; i++)
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), swap);
+
+		/* Rounds 0-3 take E directly. */
+		e = _mm_add_epi32(e0, msg[0]);
+		prev = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+
+		SHANI_GROUP(1);  SHANI_GROUP(2);  SHANI_GROUP(3);  SHANI_GROUP(4);
+		SHANI_GROUP(5);  SHANI_GROUP(6);  SHANI_GROUP(7);  SHANI_GROUP(8);
+		SHANI_GROUP(9);  SHANI_GROUP(10); SHANI_GROUP(11); SHANI_GROUP(12);
+		SHANI_GROUP(13); SHANI_GROUP(14); SHANI_GROUP(15); SHANI_GROUP(16);
+		SHANI_GROUP(17); SHANI_GROUP(18); SHANI_GROUP(19);
+
+		e0 = _mm_sha1nexte_epu32(prev, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		p += 64;
+	}
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	_mm_storeu_si128((__m128i *)ctx->H, abcd);
+	ctx->H[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif
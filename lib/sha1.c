@@ -13,9 +13,11 @@
 /* this is only to get definitions for memcpy(), ntohl() and htonl() */
 /* #include "../git-compat-util.h" */
 #include <string.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "sha1.h"
+#include "sha1-kernels.h"
 
 #if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
 
@@ -228,8 +230,74 @@ static void blk_SHA1_Block(blk_SHA_CTX *ctx, const unsigned int *data)
 	ctx->H[4] += E;
 }
 
+void blk_SHA1_Blocks_portable(blk_SHA_CTX *ctx, const void *data, unsigned long blocks)
+{
+	while (blocks--) {
+		blk_SHA1_Block(ctx, data);
+		data = ((const char *)data + 64);
+	}
+}
+
+/*
+ * The kernels, fastest first.  The portable one is always last, and is
+ * always available.
+ */
+static const struct blk_SHA1_kernel kernels[] = {
+#ifdef SHA1_HAVE_SHANI
+	{ "shani", blk_SHA1_Blocks_shani, blk_SHA1_Have_shani },
+#endif
+#ifdef SHA1_HAVE_ARMV8
+	{ "armv8", blk_SHA1_Blocks_armv8, blk_SHA1_Have_armv8 },
+#endif
+	{ "portable", blk_SHA1_Blocks_portable, 0 },
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct blk_SHA1_kernel *kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static int kernel_usable(const struct blk_SHA1_kernel *k)
+{
+	return k->available == 0 || k->available();
+}
+
+static void select_kernel(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NKERNELS; i++) {
+		if (kernel_usable(&kernels[i])) {
+			kernel = &kernels[i];
+			return;
+		}
+	}
+}
+
+const char *blk_SHA1_Kernel(void)
+{
+	pthread_once(&kernel_once, select_kernel);
+	return kernel->name;
+}
+
+int blk_SHA1_Force(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < NKERNELS; i++) {
+		if (strcmp(kernels[i].name, name) == 0) {
+			if (!kernel_usable(&kernels[i]))
+				return -1;
+			pthread_once(&kernel_once, select_kernel);
+			kernel = &kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
 void blk_SHA1_Init(blk_SHA_CTX *ctx)
 {
+	pthread_once(&kernel_once, select_kernel);
 	ctx->size = 0;
 
 	/* Initialize H with the magic constants (see FIPS180 for constants) */
@@ -257,12 +325,12 @@ void blk_SHA1_Update(blk_SHA_CTX *ctx, const void *data, unsigned long len)
 		data = ((const char *)data + left);
 		if (lenW)
 			return;
-		blk_SHA1_Block(ctx, ctx->W);
+		kernel->blocks(ctx, ctx->W, 1);
 	}
-	while (len >= 64) {
-		blk_SHA1_Block(ctx, data);
-		data = ((const char *)data + 64);
-		len -= 64;
+	if (len >= 64) {
+		kernel->blocks(ctx, data, len / 64);
+		data = ((const char *)data + (len & ~63UL));
+		len &= 63;
 	}
 	if (len)
 		memcpy(ctx->W, data, len);
@@ -286,3 +354,65 @@ void blk_SHA1_Final(unsigned char hashout[20], blk_SHA_CTX *ctx)
 	for (i = 0; i < 5; i++)
 		put_be32(hashout + i*4, ctx->H[i]);
 }
+
+/*
+ * Check every kernel usable on this CPU against the portable one, over
+ * messages of many lengths and alignments.  This switches kernels as it
+ * goes, so must not run while other threads are hashing.
+ */
+int blk_SHA1_SelfTest(void (*report)(const char *kernel, int passed))
+{
+	static const unsigned lengths[] = {
+		0, 1, 3, 55, 56, 63, 64, 65, 119, 120, 127, 128, 129, 1000, 4096, 65537
+	};
+	static unsigned char buf[65537 + 16];
+	const struct blk_SHA1_kernel *saved;
+	unsigned i, j, k;
+	unsigned int seed = 1;
+	int failures = 0;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	pthread_once(&kernel_once, select_kernel);
+	saved = kernel;
+
+	for (k = 0; k + 1 < NKERNELS; k++) {
+		int passed = 1;
+
+		if (!kernel_usable(&kernels[k]))
+			continue;
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			for (j = 0; j < 4; j++) {
+				blk_SHA_CTX ctx;
+				unsigned char expect[20], got[20];
+				const unsigned char *data = buf + j * 5;
+				unsigned len = lengths[i];
+
+				kernel = &kernels[NKERNELS - 1];
+				blk_SHA1_Init(&ctx);
+				blk_SHA1_Update(&ctx, data, len);
+				blk_SHA1_Final(expect, &ctx);
+
+				/* Feed the data in uneven pieces. */
+				kernel = &kernels[k];
+				blk_SHA1_Init(&ctx);
+				blk_SHA1_Update(&ctx, data, len / 3);
+				blk_SHA1_Update(&ctx, data + len / 3, len - len / 3);
+				blk_SHA1_Final(got, &ctx);
+
+				if (memcmp(expect, got, 20) != 0)
+					passed = 0;
+			}
+		}
+		if (!passed)
+			failures++;
+		if (report)
+			report(kernels[k].name, passed);
+	}
+
+	kernel = saved;
+	return failures;
+}
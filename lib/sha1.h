@@ -19,6 +19,34 @@ void blk_SHA1_Init(blk_SHA_CTX *ctx);
 void blk_SHA1_Update(blk_SHA_CTX *ctx, const void *dataIn, unsigned long len);
 void blk_SHA1_Final(unsigned char hashout[20], blk_SHA_CTX *ctx);
 
+/*
+ * The block function is chosen at runtime from the kernels this CPU
+ * supports.  All kernels produce identical results.
+ */
+const char *blk_SHA1_Kernel(void);
+
+/* Use the named kernel instead.  Returns -1 if it isn't usable here. */
+int blk_SHA1_Force(const char *name);
+
+/*
+ * Check each usable kernel against the portable code, calling 'report'
+ * (if non-null) with the result for each.  Returns the number that failed.
+ */
+int blk_SHA1_SelfTest(void (*report)(const char *kernel, int passed));
+
+/*
+ * Hash 'count' independent messages, several at a time in SIMD lanes where
+ * the CPU allows.  Worth it for batches of short messages.
+ */
+void blk_SHA1_Multi(int count, const void *const data[], const unsigned long len[],
+		    unsigned char hashout[][20]);
+
+/* How many messages blk_SHA1_Multi hashes at once, 1 without SIMD. */
+int blk_SHA1_MultiLanes(void);
+
+/* Like blk_SHA1_SelfTest, for the multi-buffer kernels. */
+int blk_SHA1_MultiSelfTest(void (*report)(const char *kernel, int passed));
+
 #define git_SHA_CTX	blk_SHA_CTX
 #define git_SHA1_Init	blk_SHA1_Init
 #define git_SHA1_Update	blk_SHA1_Update
@@ -0,0 +1,129 @@
+/*
+ * SHA-256, as specified in FIPS 180-4.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const unsigned int K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static unsigned int get_be32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+		((unsigned int)p[2] << 8) | p[3];
+}
+
+static void put_be32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sha256_block(sha256_ctx *ctx, const unsigned char *data)
+{
+	unsigned int W[64];
+	unsigned int a, b, c, d, e, f, g, h, t1, t2;
+	int t;
+
+	for (t = 0; t < 16; t++)
+		W[t] = get_be32(data + 4 * t);
+	for (; t < 64; t++)
+		W[t] = s1(W[t - 2]) + W[t - 7] + s0(W[t - 15]) + W[t - 16];
+
+	a = ctx->H[0]; b = ctx->H[1]; c = ctx->H[2]; d = ctx->H[3];
+	e = ctx->H[4]; f = ctx->H[5]; g = ctx->H[6]; h = ctx->H[7];
+
+	for (t = 0; t < 64; t++) {
+		t1 = h + S1(e) + CH(e, f, g) + K[t] + W[t];
+		t2 = S0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->H[0] += a; ctx->H[1] += b; ctx->H[2] += c; ctx->H[3] += d;
+	ctx->H[4] += e; ctx->H[5] += f; ctx->H[6] += g; ctx->H[7] += h;
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+	ctx->size = 0;
+	ctx->H[0] = 0x6a09e667;
+	ctx->H[1] = 0xbb67ae85;
+	ctx->H[2] = 0x3c6ef372;
+	ctx->H[3] = 0xa54ff53a;
+	ctx->H[4] = 0x510e527f;
+	ctx->H[5] = 0x9b05688c;
+	ctx->H[6] = 0x1f83d9ab;
+	ctx->H[7] = 0x5be0cd19;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, unsigned long len)
+{
+	const unsigned char *p = data;
+	unsigned used = ctx->size & 63;
+
+	ctx->size += len;
+
+	if (used) {
+		unsigned left = 64 - used;
+		if (len < left) {
+			memcpy(ctx->buf + used, p, len);
+			return;
+		}
+		memcpy(ctx->buf + used, p, left);
+		sha256_block(ctx, ctx->buf);
+		p += left;
+		len -= left;
+	}
+	while (len >= 64) {
+		sha256_block(ctx, p);
+		p += 64;
+		len -= 64;
+	}
+	if (len)
+		memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(unsigned char hashout[32], sha256_ctx *ctx)
+{
+	static const unsigned char pad[64] = { 0x80 };
+	unsigned char length[8];
+	unsigned long long bits = ctx->size << 3;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		length[i] = bits >> (56 - 8 * i);
+
+	i = ctx->size & 63;
+	sha256_update(ctx, pad, 1 + (63 & (55 - i)));
+	sha256_update(ctx, length, 8);
+
+	for (i = 0; i < 8; i++)
+		put_be32(hashout + 4 * i, ctx->H[i]);
+}
@@ -0,0 +1,18 @@
+/*
+ * SHA-256, as specified in FIPS 180-4.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+typedef struct {
+	unsigned long long size;
+	unsigned int H[8];
+	unsigned char buf[64];
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, unsigned long len);
+void sha256_final(unsigned char hashout[32], sha256_ctx *ctx);
+
+#endif
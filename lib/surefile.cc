@@ -1,11 +1,21 @@
 // Writing surefiles
 
+extern "C" {
+#include <unistd.h>
+}
+
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
 
 #include "surefile.hh"
+#include "delta.hh"
 #include "exn.hh"
 #include "gzstream.hh"
 
@@ -13,20 +23,258 @@ namespace asure {
 
 using std::string;
 
-const string surefileMagic = "asure-2.0\n-----\n";
+// The header is the magic line, then any "key value" lines, then the
+// separator.  A "hash" line names the digest, which is SHA-1 if it is
+// missing, so SHA-1 surefiles are the same as they have always been.
+const string surefileMagic = "asure-2.0\n";
+const string surefileSeparator = "-----";
+const string digestKey = "hash";
+
+// The binary format has the same header, with its own magic line.  Each
+// node is then its code, as in the text format, and for 'd' and 'f' the
+// name, the mask of the fields present, each of those fields in order, and
+// the other attributes.  Names are the length shared with the previous
+// name in the same directory, then the rest as a string.  Strings are a
+// varint length and the bytes.  Numbers are varints, the signed ones
+// zigzag encoded.  A kind is a byte, and a digest is bytes giving its
+// algorithm and length, then the digest itself.  The other attributes are a
+// count, then for each the number of its name, and its value as a string.
+// A name is numbered when it is first used, which is when it follows its
+// number as a string.
+const string binaryMagic = "asure-3.0\n";
+
+namespace {
+
+// The generation an Emitter is given when it writes the backup.
+int const backupGeneration = -1;
+
+char const* const formatNames[] = { "text", "binary" };
+int const formatCount = sizeof(formatNames) / sizeof(formatNames[0]);
+
+uint64_t zigzag(int64_t value)
+{
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value)
+{
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// The longest string the binary reader will accept.
+uint64_t const maxString = 1 << 24;
+
+// The characters written as they are in the text format: those that are
+// graphic and aren't the escape character.
+class PlainChars {
+ public:
+  PlainChars() {
+    for (int ch = 0; ch < 256; ++ch)
+      plain_[ch] = ch != '=' && std::isgraph(ch);
+  }
+  bool operator()(char ch) const { return plain_[(unsigned char)ch]; }
+ private:
+  bool plain_[256];
+};
+PlainChars const isPlain;
+
+// The index stored at the end of a surefile, to find each directory in it
+// without reading what comes before.  It is a version byte, the format and
+// the digest, the attribute names the binary format numbers, and the count
+// of directories.  Then, as one string, for the root and each directory
+// after it, in the order written: its tree digest; where it ends, just past
+// its LEAVE; how many attribute names are numbered by then; and how many
+// directories are within it.  Then for each directory but the root, in that
+// order: its path, as the length shared with the previous one's and the
+// rest; how far it starts after the previous one; and how many attribute
+// names are numbered before it.  Numbers are varints, and strings a varint
+// length and the bytes, as in the binary format.  The first version had no
+// tree digests, nor ends.
+char const indexVersion = 2;
+
+// A directory's tree digest is the BLAKE3 of its attributes, then the name
+// and tree digest of each subdirectory, and the name and attributes of each
+// file, in order, cut to this length.
+Digest::Algorithm const treeAlgorithm = Digest::BLAKE3;
+size_t const treeDigestSize = 16;
+
+// How much is hashed into a tree digest at once.
+size_t const pendingSize = 16 * 1024;
+
+void appendVarint(std::string& out, uint64_t value)
+{
+  while (value >= 0x80) {
+    out += char(value | 0x80);
+    value >>= 7;
+  }
+  out += char(value);
+}
+
+void appendBytes(std::string& out, char const* data, size_t length)
+{
+  appendVarint(out, length);
+  out.append(data, length);
+}
+
+// Append the attributes for a tree digest, in a form that doesn't depend on
+// the order of the extras.
+void appendAttrs(std::string& out, tree::Attrs const& attrs)
+{
+  appendVarint(out, attrs.present());
+  for (int f = 0; f < tree::Attrs::FIELD_COUNT; ++f) {
+    tree::Attrs::Field const field = tree::Attrs::Field(f);
+    if (!attrs.has(field))
+      continue;
+    switch (field) {
+      case tree::Attrs::KIND:
+        out += char(attrs.kind());
+        break;
+      case tree::Attrs::TARG:
+        appendBytes(out, attrs.target().data(), attrs.target().size());
+        break;
+      case tree::Attrs::DIGEST:
+        out += char(attrs.algorithm());
+        appendBytes(out, reinterpret_cast<char const*>(attrs.digest().data),
+                    attrs.digest().length);
+        break;
+      default:
+        appendVarint(out, attrs.number(field));
+        break;
+    }
+  }
+
+  // They are almost always in order already.
+  tree::Attrs::Extras const* extras = &attrs.extras();
+  tree::Attrs::Extras sorted;
+  typedef tree::Attrs::Extras::const_iterator Iter;
+  for (Iter i = extras->begin(); i != extras->end() && i + 1 != extras->end(); ++i) {
+    if (i[1] < i[0]) {
+      sorted = *extras;
+      std::sort(sorted.begin(), sorted.end());
+      extras = &sorted;
+      break;
+    }
+  }
+  appendVarint(out, extras->size());
+  for (Iter i = extras->begin(); i != extras->end(); ++i) {
+    appendBytes(out, i->first.data(), i->first.size());
+    appendBytes(out, i->second.data(), i->second.size());
+  }
+}
+
+class IndexReader {
+ public:
+  IndexReader(std::string const& data) : pos_(data.data()), end_(data.data() + data.size()) { }
+
+  unsigned char byte() {
+    if (pos_ == end_)
+      invalid();
+    return *pos_++;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char const ch = byte();
+      value |= uint64_t(ch & 0x7f) << shift;
+      if ((ch & 0x80) == 0)
+        return value;
+    }
+    invalid();
+    return 0;
+  }
+
+  bool empty() const { return pos_ == end_; }
+
+  // Read 'length' bytes as they are.
+  void fixed(unsigned char* out, size_t length) {
+    if (length > size_t(end_ - pos_))
+      invalid();
+    std::memcpy(out, pos_, length);
+    pos_ += length;
+  }
+
+  // Read a string, appending it to 'out'.
+  void bytes(std::string& out) {
+    uint64_t const length = varint();
+    if (length > uint64_t(end_ - pos_))
+      invalid();
+    out.append(pos_, length);
+    pos_ += length;
+  }
+
+ private:
+  char const* pos_;
+  char const* const end_;
+
+  void invalid() {
+    throw Parse_error("Invalid surefile index");
+  }
+};
+
+// The start of an index, before the entries for the directories.
+struct IndexHeader {
+  IndexHeader() : format(SurefileFormat::TEXT), digest(Digest::SHA1), keys(), trees(), count(0) { }
+
+  SurefileFormat::Version format;
+  Digest::Algorithm digest;
+  std::vector<std::string> keys;
+  // The tree digests and ends, or empty when the index has none.
+  std::string trees;
+  uint64_t count;
+
+  void read(IndexReader& reader);
+};
+
+void IndexHeader::read(IndexReader& reader)
+{
+  unsigned const version = reader.byte();
+  if (version < 1 || version > unsigned(indexVersion))
+    throw Parse_error("Unknown surefile index version");
+  unsigned const indexFormat = reader.byte();
+  unsigned const indexDigest = reader.byte();
+  if (indexFormat > SurefileFormat::BINARY || indexDigest > Digest::XXH3)
+    throw Parse_error("Invalid surefile index");
+  format = SurefileFormat::Version(indexFormat);
+  digest = Digest::Algorithm(indexDigest);
+
+  for (uint64_t left = reader.varint(); left > 0; --left) {
+    keys.push_back(std::string());
+    reader.bytes(keys.back());
+  }
+  count = reader.varint();
+  if (version >= 2)
+    reader.bytes(trees);
+}
+
+}
+
+char const* SurefileFormat::name(Version version)
+{
+  return formatNames[version];
+}
+
+bool SurefileFormat::byName(std::string const& name, Version& version)
+{
+  for (int i = 0; i < formatCount; ++i) {
+    if (name == formatNames[i]) {
+      version = Version(i);
+      return true;
+    }
+  }
+  return false;
+}
 
 class Emitter {
   public:
-    Emitter(const string& base);
+    Emitter(const string& base, SurefileFormat::Version version, Digest::Algorithm digest,
+            int generation);
     ~Emitter();
 
     void putRegular(char code, tree::Node const& node);
 
     void putChar(char ch) { out_.put(ch); }
-    void putSimple(char code) {
-      putChar(code);
-      putChar('\n');
-    }
+    void putSimple(char code);
     void putString(const string& str);
     void putHex(unsigned ch) {
       if (ch < 10)
@@ -38,27 +286,86 @@ class Emitter {
     // Cleanly close the emitter, rotating log files.
     void close();
 
+    void backupGenerations(int generations) { backupGenerations_ = generations; }
+    void keepBackup() { keepBackup_ = true; }
+
     // Write arbitrary data.
     void write(char const* data, int length) {
       out_.write(data, length);
     }
   private:
     const string base_;
+    int const generation_;
+    int backupGenerations_;
+    bool keepBackup_;
     gzstream out_;
-    void emitAtts(tree::Node const& node);
+    SurefileFormat::Version const version_;
+
+    // For the binary format, the name last written in each directory that
+    // is open, and the number given to each attribute name.
+    std::vector<string> names_;
+    std::map<string, uint64_t> keys_;
+
+    // The path of each directory that is open, and the index of those
+    // written so far.
+    Digest::Algorithm const digest_;
+    std::vector<string> paths_;
+    string index_;
+    uint64_t indexCount_;
+    string lastPath_;
+    uint64_t lastPosition_;
+
+    // The tree digest being computed of each directory that is open, with
+    // its name and number, and those finished, by number.  The root is 0,
+    // and the rest are numbered as they are in the index.  What is hashed
+    // is collected in 'pending' first, since the digest is slow to update
+    // a node at a time.
+    struct OpenTree {
+      OpenTree(string const& name_, uint64_t number_) :
+          name(name_), number(number_), digest(Digest::create(treeAlgorithm)), pending() { }
+      string name;
+      uint64_t number;
+      std::tr1::shared_ptr<Digest> digest;
+      string pending;
+    };
+    struct TreeEnd {
+      unsigned char digest[treeDigestSize];
+      uint64_t end;
+      uint32_t keys, dirs;
+    };
+    std::vector<OpenTree> trees_;
+    std::vector<TreeEnd> treeEnds_;
+
+    string tmpName() const {
+      return base_ + (generation_ == backupGeneration ? ".bak" : "") + extensions::tmp;
+    }
+    void addToIndex(string const& name);
+    void addToTree(char code, string const& name, tree::Attrs const& attrs);
+    void finishTree();
+    string finishIndex() const;
+    void emitAtts(tree::Attrs const& attrs);
+    void putBinary(char code, string const& name, tree::Attrs const& attrs);
+    void putVarint(uint64_t value);
+    void putBytes(char const* data, size_t length);
 };
 
-Emitter::Emitter(const string& base) : base_(base), out_()
+Emitter::Emitter(const string& base, SurefileFormat::Version version, Digest::Algorithm digest,
+                 int generation) :
+    base_(base), generation_(generation), backupGenerations_(-1), keepBackup_(false), out_(), version_(version), names_(1), keys_(), digest_(digest), paths_(),
+    index_(), indexCount_(0), lastPath_(), lastPosition_(0), trees_(), treeEnds_()
 {
-  std::string tmpName = base + extensions::tmp;
-
-  out_.open(tmpName.c_str(), "wb");
+  out_.open(tmpName().c_str(), "wb");
 }
 
-SurefileSaver::SurefileSaver(std::string const& baseName)
+SurefileSaver::SurefileSaver(std::string const& baseName, Digest::Algorithm digest,
+                             SurefileFormat::Version format, int generation)
 {
-  emit = new Emitter(baseName);
-  emit->write(surefileMagic.data(), surefileMagic.length());
+  emit = new Emitter(baseName, format, digest, generation);
+  string header = format == SurefileFormat::BINARY ? binaryMagic : surefileMagic;
+  if (digest != Digest::SHA1)
+    header += digestKey + ' ' + Digest::name(digest) + '\n';
+  header += surefileSeparator + '\n';
+  emit->write(header.data(), header.length());
 }
 
 SurefileSaver::~SurefileSaver()
@@ -71,6 +378,16 @@ void SurefileSaver::close()
   emit->close();
 }
 
+void SurefileSaver::backupGenerations(int generations)
+{
+  emit->backupGenerations(generations);
+}
+
+void SurefileSaver::keepBackup()
+{
+  emit->keepBackup();
+}
+
 void SurefileSaver::writeNode(tree::Node const& node)
 {
   switch (node.getKind()) {
@@ -89,9 +406,10 @@ void SurefileSaver::writeNode(tree::Node const& node)
   }
 }
 
-void SurefileSaver::save(std::string const& baseName, tree::NodeIterator& root)
+void SurefileSaver::save(std::string const& baseName, tree::NodeIterator& root,
+                         Digest::Algorithm digest, SurefileFormat::Version format)
 {
-  SurefileSaver saver(baseName);
+  SurefileSaver saver(baseName, digest, format);
 
   for (; !root.empty(); ++root) {
     saver.writeNode(*root);
@@ -104,74 +422,327 @@ void SurefileSaver::save(std::string const& baseName, tree::NodeIterator& root)
 void
 Emitter::close()
 {
-  out_.close();
-  std::rename((base_ + extensions::base).c_str(), (base_ + extensions::bak).c_str());
-  std::rename((base_ + extensions::tmp).c_str(), (base_ + extensions::base).c_str());
+  out_.close(finishIndex());
+  if (generation_ == backupGeneration) {
+    std::rename(tmpName().c_str(), (base_ + extensions::bak).c_str());
+    return;
+  }
+  if (generation_ != 0) {
+    std::rename(tmpName().c_str(), deltaName(base_, generation_).c_str());
+    return;
+  }
+
+  int const generations = countDeltas(base_);
+  if (generations == 0) {
+    if (!keepBackup_)
+      std::rename((base_ + extensions::base).c_str(), (base_ + extensions::bak).c_str());
+    std::rename(tmpName().c_str(), (base_ + extensions::base).c_str());
+    return;
+  }
+
+  // Signoff compares the surefile with the backup, which has to be the
+  // generation before it, not the surefile the deltas were made against.
+  // So the deltas are applied to it first.
+  {
+    Digest::Algorithm digest;
+    SurefileFormat::Version format;
+    std::auto_ptr<tree::NodeIterator> previous(
+        loadGenerations(base_, std::string(), &digest, &format, backupGenerations_));
+    SurefileSaver backup(base_, digest, format, backupGeneration);
+    for (; !previous->empty(); ++*previous)
+      backup.writeNode(**previous);
+    backup.close();
+  }
+
+  // The deltas of the surefile being replaced no longer apply.  They go
+  // before it does, and the last first, so that whatever is left if this is
+  // interrupted is still consistent, if out of date.
+  for (int generation = generations; generation > 0; --generation)
+    unlink(deltaName(base_, generation).c_str());
+  std::rename(tmpName().c_str(), (base_ + extensions::base).c_str());
 }
 
 Emitter::~Emitter()
 {
   // If we didn't close properly unlink the temp file.
   if (out_.isOpen()) {
-    out_.close();
-    unlink((base_ + extensions::tmp).c_str());
+    out_.discard();
+    unlink(tmpName().c_str());
+  }
+}
+
+void
+Emitter::putSimple(char code)
+{
+  putChar(code);
+  if (version_ == SurefileFormat::BINARY) {
+    if (code == 'u')
+      names_.pop_back();
+  } else
+    putChar('\n');
+  if (code == 'u') {
+    paths_.pop_back();
+    finishTree();
   }
 }
 
 void
 Emitter::putRegular(char code, tree::Node const& node)
 {
+  if (code == 'd')
+    addToIndex(node.getName());
+  tree::Attrs storage;
+  tree::Attrs const& attrs = node.getFullAttrs(storage);
+  addToTree(code, node.getName(), attrs);
+  if (version_ == SurefileFormat::BINARY) {
+    putBinary(code, node.getName(), attrs);
+    return;
+  }
   putChar(code);
   putString(node.getName());
-  emitAtts(node);
+  emitAtts(attrs);
   putChar('\n');
 }
 
-// Strings have some minimal quoting, and are terminated with a space.
+// Add a node to the tree digest of the directory it is in, or for a
+// directory, start its own.
+void
+Emitter::addToTree(char code, string const& name, tree::Attrs const& attrs)
+{
+  if (code == 'd')
+    trees_.push_back(OpenTree(name, trees_.empty() ? 0 : indexCount_));
+  OpenTree& tree = trees_.back();
+  if (code != 'd') {
+    tree.pending += code;
+    appendBytes(tree.pending, name.data(), name.size());
+  }
+  appendAttrs(tree.pending, attrs);
+  if (tree.pending.size() >= pendingSize) {
+    tree.digest->update(tree.pending.data(), tree.pending.size());
+    tree.pending.clear();
+  }
+}
+
+void
+Emitter::finishTree()
+{
+  Hash hash;
+  OpenTree& tree = trees_.back();
+  tree.digest->update(tree.pending.data(), tree.pending.size());
+  tree.digest->final(hash);
+  uint64_t const number = trees_.back().number;
+  if (treeEnds_.size() <= number)
+    treeEnds_.resize(indexCount_ + 1);
+  TreeEnd& end = treeEnds_[number];
+  std::memcpy(end.digest, hash.data, treeDigestSize);
+  end.end = out_.tell();
+  end.keys = keys_.size();
+  end.dirs = indexCount_ - number;
+
+  string const name = tree.name;
+  trees_.pop_back();
+  if (!trees_.empty()) {
+    string& pending = trees_.back().pending;
+    pending += 'd';
+    appendBytes(pending, name.data(), name.size());
+    pending.append(reinterpret_cast<char const*>(hash.data), treeDigestSize);
+  }
+}
+
+// Add the directory about to be written to the index.  The root isn't
+// indexed, being at the start.
+void
+Emitter::addToIndex(string const& name)
+{
+  if (paths_.empty()) {
+    paths_.push_back(string());
+    return;
+  }
+  string const path = paths_.size() == 1 ? name : paths_.back() + '/' + name;
+  paths_.push_back(path);
+
+  size_t const limit = std::min(path.size(), lastPath_.size());
+  size_t shared = 0;
+  while (shared < limit && path[shared] == lastPath_[shared])
+    ++shared;
+  uint64_t const position = out_.tell();
+  appendVarint(index_, shared);
+  appendBytes(index_, path.data() + shared, path.size() - shared);
+  appendVarint(index_, position - lastPosition_);
+  appendVarint(index_, keys_.size());
+  ++indexCount_;
+  lastPath_ = path;
+  lastPosition_ = position;
+}
+
+string
+Emitter::finishIndex() const
+{
+  string result;
+  result += indexVersion;
+  result += char(version_);
+  result += char(digest_);
+
+  std::vector<string const*> byNumber(keys_.size());
+  typedef std::map<string, uint64_t>::const_iterator Iter;
+  for (Iter i = keys_.begin(); i != keys_.end(); ++i)
+    byNumber[i->second] = &i->first;
+  appendVarint(result, byNumber.size());
+  for (size_t i = 0; i < byNumber.size(); ++i)
+    appendBytes(result, byNumber[i]->data(), byNumber[i]->size());
+
+  appendVarint(result, indexCount_);
+  string ends;
+  for (size_t i = 0; i < treeEnds_.size(); ++i) {
+    ends.append(reinterpret_cast<char const*>(treeEnds_[i].digest), treeDigestSize);
+    appendVarint(ends, treeEnds_[i].end);
+    appendVarint(ends, treeEnds_[i].keys);
+    appendVarint(ends, treeEnds_[i].dirs);
+  }
+  appendBytes(result, ends.data(), ends.size());
+  result += index_;
+  return result;
+}
+
+// Strings have some minimal quoting, and are terminated with a space.  The
+// runs of characters that need no quoting are written whole.
 void
 Emitter::putString(const string& str)
 {
-  typedef string::const_iterator iter;
-  const iter end = str.end();
-  for (iter i = str.begin(); i != end; ++i) {
-    if (*i != '=' && std::isgraph(*i)) {
-      putChar(*i);
-    } else {
-      putChar('=');
-      putHex((*i >> 4) & 0xF);
-      putHex(*i & 0xF);
-    }
+  char const* pos = str.data();
+  char const* const end = pos + str.size();
+  while (pos != end) {
+    char const* run = pos;
+    while (run != end && isPlain(*run))
+      ++run;
+    write(pos, run - pos);
+    if (run == end)
+      break;
+    putChar('=');
+    putHex((*run >> 4) & 0xF);
+    putHex(*run & 0xF);
+    pos = run + 1;
   }
   putChar(' ');
 }
 
+// The expensive atts and the main atts are both in order, so they are
+// merged as they are written, the expensive ones winning.
 void
-Emitter::emitAtts(tree::Node const& node)
+Emitter::emitAtts(tree::Attrs const& attrs)
 {
-  tree::Node::Atts atts = node.getExpensiveAtts();
-  tree::Node::Atts const& mainAtts = node.getAtts();
-  atts.insert(mainAtts.begin(), mainAtts.end());
+  tree::Node::Atts atts;
+  attrs.toMap(atts);
 
   typedef tree::Node::Atts::const_iterator Iter;
-  Iter const end = atts.end();
   putChar('[');
-  for (Iter i = atts.begin(); i != end; ++i) {
+  for (Iter i = atts.begin(); i != atts.end(); ++i) {
     putString(i->first);
     putString(i->second);
   }
   putChar(']');
 }
 
+void
+Emitter::putBinary(char code, string const& name, tree::Attrs const& attrs)
+{
+  putChar(code);
+
+  string& previous = names_.back();
+  size_t const limit = std::min(name.size(), previous.size());
+  size_t shared = 0;
+  while (shared < limit && name[shared] == previous[shared])
+    ++shared;
+  putVarint(shared);
+  putBytes(name.data() + shared, name.size() - shared);
+  previous = name;
+  if (code == 'd')
+    names_.push_back(string());
+
+  putVarint(attrs.present());
+  for (int f = 0; f < tree::Attrs::FIELD_COUNT; ++f) {
+    tree::Attrs::Field const field = tree::Attrs::Field(f);
+    if (!attrs.has(field))
+      continue;
+    switch (field) {
+      case tree::Attrs::KIND:
+        putChar(attrs.kind());
+        break;
+      case tree::Attrs::TARG:
+        putBytes(attrs.target().data(), attrs.target().size());
+        break;
+      case tree::Attrs::DIGEST:
+        putChar(attrs.algorithm());
+        putChar(attrs.digest().length);
+        write(reinterpret_cast<char const*>(attrs.digest().data), attrs.digest().length);
+        break;
+      default:
+        if (tree::Attrs::isSigned(field))
+          putVarint(zigzag(attrs.number(field)));
+        else
+          putVarint(attrs.number(field));
+        break;
+    }
+  }
+
+  typedef tree::Attrs::Extras::const_iterator Iter;
+  tree::Attrs::Extras const& extras = attrs.extras();
+  putVarint(extras.size());
+  for (Iter i = extras.begin(); i != extras.end(); ++i) {
+    std::map<string, uint64_t>::iterator const key = keys_.find(i->first);
+    if (key != keys_.end())
+      putVarint(key->second);
+    else {
+      uint64_t const number = keys_.size();
+      keys_.insert(std::make_pair(i->first, number));
+      putVarint(number);
+      putBytes(i->first.data(), i->first.size());
+    }
+    putBytes(i->second.data(), i->second.size());
+  }
+}
+
+void
+Emitter::putVarint(uint64_t value)
+{
+  while (value >= 0x80) {
+    putChar(char(value | 0x80));
+    value >>= 7;
+  }
+  putChar(char(value));
+}
+
+void
+Emitter::putBytes(char const* data, size_t length)
+{
+  putVarint(length);
+  write(data, length);
+}
+
 //////////////////////////////////////////////////////////////////////
 // Reader of trees.
 
 class SurefileIterator : public tree::NodeIterator {
  public:
-  SurefileIterator() : in(), depth(0), almostDone(false), done(false) { }
+  SurefileIterator() : in(), node(), key(), val(), fields(), names(1), keys(), path(),
+      index(), indexKeys(), trees(), treeReader(), treeEnd(0), treeKeys(0), treeDirs(0),
+      digest(Digest::SHA1), format(SurefileFormat::TEXT), depth(0), baseDepth(0), almostDone(false), done(false) { }
   void open(std::string const& path);
+
+  // Open the surefile to read only the directory at 'dirPath', using its
+  // 'index'.  Returns false if there is no such directory.
+  bool openAt(std::string const& path, Decoder::Index const& index, std::string const& dirPath);
+
+  // Once open, read forward to the directory at the path 'parts', and make
+  // it the root.  Returns false if there is no such directory.
+  bool seek(std::vector<std::string> const& parts);
+
+  Digest::Algorithm getDigest() const { return digest; }
+  SurefileFormat::Version getFormat() const { return format; }
   bool empty() const { return done; }
   void operator++();
   tree::Node const& operator*() const { return node; }
+  void skipTree();
  private:
   gzstream in;
 
@@ -180,19 +751,53 @@ class SurefileIterator : public tree::NodeIterator {
     ~SubNode() { }
     Kind getKind() const { return kind; }
     std::string const& getName() const { return name; }
-    Atts const& getAtts() const { return atts; }
+    tree::Attrs const& getAttrs() const { return attrs; }
+    Hash const* getTreeDigest() const { return hasTree ? &tree : 0; }
 
     void clear() {
       name.clear();
-      atts.clear();
+      attrs.clear();
+      attrsChanged();
+      hasTree = false;
     }
 
     Kind kind;
     std::string name;
-    Atts atts;
+    tree::Attrs attrs;
+    Hash tree;
+    bool hasTree;
   };
   SubNode node;
-  int depth;
+
+  // Reused for each attribute read.
+  std::string key, val;
+
+  // The attribute names of the last node read, by position, with the
+  // fields they are kept in.  Most nodes have the same names as the one
+  // before, so these save looking them up again.
+  std::vector<std::pair<std::string, tree::Attrs::Field> > fields;
+
+  // For the binary format, the last name read in each open directory, and
+  // the attribute names by their numbers.
+  std::vector<std::string> names;
+  std::vector<std::string> keys;
+
+  // The file and its index, to read on past directories that are skipped.
+  std::string path;
+  Decoder::Index index;
+  std::vector<std::string> indexKeys;
+
+  // The tree digests and ends from the index, if it has them, read as each
+  // directory is reached, and the end of the last one, with how many
+  // attribute names are numbered by then and how many directories it has.
+  std::string trees;
+  std::auto_ptr<IndexReader> treeReader;
+  uint64_t treeEnd, treeKeys, treeDirs;
+
+  Digest::Algorithm digest;
+  SurefileFormat::Version format;
+  // The tree ends when the depth comes back to 'baseDepth'.
+  int depth, baseDepth;
   bool almostDone, done;
 
   void parseError(char const* msg) {
@@ -206,14 +811,29 @@ class SurefileIterator : public tree::NodeIterator {
       parseError((std::string("Unexpected character: '") + ch + "', expecting '" + expCh + "'").c_str());
   }
 
+  void useIndex(std::string const& path_, Decoder::Index& index_, IndexHeader& header);
+  bool readTreeEnd(Hash& tree);
   void readFull();
+  void readBinary(bool isDir);
+  uint64_t readVarint();
+  void readBytes(std::string& str);
+  void readLine(std::string& line);
   void readString(std::string& name);
   char dehex(char ch);
 };
 
 void SurefileIterator::open(std::string const& path)
 {
-  in.open(path.c_str(), "rb");
+  // The index, if there is one, has the tree digests.
+  Decoder::Index fileIndex;
+  if (Decoder::readIndex(path, fileIndex)) {
+    IndexReader reader(fileIndex.data);
+    IndexHeader header;
+    header.read(reader);
+    useIndex(path, fileIndex, header);
+    in.open(path.c_str(), index);
+  } else
+    in.open(path.c_str(), "rb");
 
   // Read in the header.
   int const len = surefileMagic.length();
@@ -221,13 +841,160 @@ void SurefileIterator::open(std::string const& path)
   in.read(rawHeader, len);
   string const magic(rawHeader, len);
 
-  if (magic != surefileMagic)
+  if (magic == binaryMagic)
+    format = SurefileFormat::BINARY;
+  else if (magic != surefileMagic)
     parseError("Invalid file header");
 
+  while (true) {
+    std::string line;
+    readLine(line);
+    if (line == surefileSeparator)
+      break;
+    std::string::size_type const space = line.find(' ');
+    if (space == std::string::npos)
+      parseError("Invalid header line");
+    if (line.substr(0, space) == digestKey &&
+        !Digest::byName(line.substr(space + 1), digest))
+      parseError(("Unknown hash: " + line.substr(space + 1)).c_str());
+    // Other keys are left for future versions.
+  }
+
   // Advance to the first entity.
   operator++();
 }
 
+bool SurefileIterator::openAt(std::string const& path, Decoder::Index const& fileIndex,
+                              std::string const& dirPath)
+{
+  IndexReader reader(fileIndex.data);
+  IndexHeader header;
+  header.read(reader);
+
+  std::string entry;
+  uint64_t position = 0;
+  for (uint64_t number = 1; number <= header.count; ++number) {
+    uint64_t const shared = reader.varint();
+    if (shared > entry.size())
+      parseError("Invalid surefile index");
+    entry.resize(shared);
+    reader.bytes(entry);
+    position += reader.varint();
+    uint64_t const known = reader.varint();
+    if (entry != dirPath)
+      continue;
+
+    if (known > header.keys.size())
+      parseError("Invalid surefile index");
+    format = header.format;
+    digest = header.digest;
+    keys.assign(header.keys.begin(), header.keys.begin() + known);
+    Decoder::Index copy(fileIndex);
+    useIndex(path, copy, header);
+    // Pass over the records of the directories before it.
+    Hash tree;
+    for (uint64_t before = 0; before < number; ++before)
+      readTreeEnd(tree);
+    // The binary format gives the directory's name by what it shares with
+    // the one before, which is only known to share all of it.
+    names.back() = entry.substr(entry.rfind('/') + 1);
+
+    in.open(path.c_str(), index, position);
+    operator++();
+    if (node.kind != tree::Node::ENTER)
+      parseError("Surefile index doesn't lead to a directory");
+    node.name = "__root__";
+    return true;
+  }
+  return false;
+}
+
+// Keep what the index gives, taking its contents.
+void SurefileIterator::useIndex(std::string const& path_, Decoder::Index& index_,
+                                IndexHeader& header)
+{
+  path = path_;
+  std::swap(index, index_);
+  indexKeys.swap(header.keys);
+  trees.swap(header.trees);
+  treeReader.reset(new IndexReader(trees));
+}
+
+// Read the index's record of the next directory, if it has them.
+bool SurefileIterator::readTreeEnd(Hash& tree)
+{
+  if (treeReader.get() == 0 || treeReader->empty())
+    return false;
+  treeReader->fixed(tree.data, treeDigestSize);
+  tree.length = treeDigestSize;
+  treeEnd = treeReader->varint();
+  treeKeys = treeReader->varint();
+  treeDirs = treeReader->varint();
+  return true;
+}
+
+// Directories with a record in the index are passed over by going straight
+// to their end, discarding what comes before it if that is in the block
+// already being read.
+void SurefileIterator::skipTree()
+{
+  if (node.kind != tree::Node::ENTER || !node.hasTree) {
+    tree::NodeIterator::skipTree();
+    return;
+  }
+
+  uint64_t const end = treeEnd;
+  uint64_t const known = treeKeys;
+  Hash tree;
+  for (uint64_t dirs = treeDirs; dirs > 0; --dirs) {
+    if (!readTreeEnd(tree))
+      parseError("Invalid surefile index");
+  }
+  uint64_t const here = in.tell();
+  if (end < here || known < keys.size() || known > indexKeys.size())
+    parseError("Invalid surefile index");
+  keys.insert(keys.end(), indexKeys.begin() + keys.size(), indexKeys.begin() + known);
+  if (format == SurefileFormat::BINARY)
+    names.pop_back();
+  --depth;
+  if (depth == baseDepth) {
+    done = true;
+    return;
+  }
+
+  if (index.blockSize != 0 && end / index.blockSize != here / index.blockSize)
+    in.open(path.c_str(), index, end);
+  else {
+    for (uint64_t left = end - here; left > 0; ) {
+      char const* data;
+      uint64_t const count = std::min(uint64_t(in.peek(data)), left);
+      in.skip(count);
+      left -= count;
+    }
+  }
+  operator++();
+}
+
+bool SurefileIterator::seek(std::vector<std::string> const& parts)
+{
+  for (size_t matched = 0; matched < parts.size(); ++matched) {
+    operator++();
+    // Skip over the other subdirectories, which come first.
+    while (node.kind == tree::Node::ENTER && node.name != parts[matched]) {
+      int const parent = depth - 1;
+      do
+        operator++();
+      while (node.kind != tree::Node::LEAVE || depth != parent);
+      operator++();
+    }
+    if (node.kind != tree::Node::ENTER)
+      return false;
+  }
+  baseDepth = depth - 1;
+  node.name = "__root__";
+  return true;
+}
+
 void SurefileIterator::operator++()
 {
   if (almostDone) {
@@ -238,30 +1005,139 @@ void SurefileIterator::operator++()
   char code;
   in.get(code);
 
+  bool const binary = format == SurefileFormat::BINARY;
   node.clear();
   switch (code) {
     case 'd':
       node.kind = tree::Node::ENTER;
-      readFull();
+      if (binary)
+        readBinary(true);
+      else
+        readFull();
+      node.hasTree = readTreeEnd(node.tree);
       ++depth;
       break;
     case 'f':
       node.kind = tree::Node::NODE;
-      readFull();
+      if (binary)
+        readBinary(false);
+      else
+        readFull();
       break;
     case '-':
       node.kind = tree::Node::MARK;
       break;
     case 'u':
       node.kind = tree::Node::LEAVE;
+      if (binary) {
+        if (names.size() <= 1)
+          parseError("Unbalanced directory");
+        names.pop_back();
+      }
       --depth;
-      if (depth == 0)
+      if (depth == baseDepth)
         almostDone = true;
       break;
     default:
       parseError((std::string("Unknown code: '") + code + '\'').c_str());
   }
-  expect('\n');
+  if (!binary)
+    expect('\n');
+}
+
+void SurefileIterator::readBinary(bool isDir)
+{
+  std::string& previous = names.back();
+  uint64_t const shared = readVarint();
+  if (shared > previous.size())
+    parseError("Invalid name prefix");
+  node.name.assign(previous, 0, shared);
+  readBytes(node.name);
+  previous = node.name;
+  if (isDir)
+    names.push_back(std::string());
+
+  uint64_t const present = readVarint();
+  if (present >> tree::Attrs::FIELD_COUNT != 0)
+    parseError("Invalid attribute mask");
+  for (int f = 0; f < tree::Attrs::FIELD_COUNT; ++f) {
+    tree::Attrs::Field const field = tree::Attrs::Field(f);
+    if ((present & tree::Attrs::bit(field)) == 0)
+      continue;
+    switch (field) {
+      case tree::Attrs::KIND: {
+        char kind;
+        in.get(kind);
+        if (kind < tree::Attrs::DIR || kind > tree::Attrs::CHR)
+          parseError("Invalid kind");
+        node.attrs.setKind(tree::Attrs::Kind(kind));
+        break;
+      }
+      case tree::Attrs::TARG:
+        val.clear();
+        readBytes(val);
+        node.attrs.setTarget(val);
+        break;
+      case tree::Attrs::DIGEST: {
+        char algorithm, length;
+        in.get(algorithm);
+        in.get(length);
+        Hash hash;
+        if (algorithm < Digest::SHA1 || algorithm > Digest::XXH3 ||
+            length <= 0 || size_t(length) > sizeof(hash.data))
+          parseError("Invalid digest");
+        hash.length = length;
+        in.read(reinterpret_cast<char*>(hash.data), length);
+        node.attrs.setDigest(Digest::Algorithm(algorithm), hash);
+        break;
+      }
+      default: {
+        uint64_t const value = readVarint();
+        node.attrs.setNumber(field, tree::Attrs::isSigned(field) ? unzigzag(value) : value);
+        break;
+      }
+    }
+  }
+
+  uint64_t count = readVarint();
+  for (; count > 0; --count) {
+    uint64_t const number = readVarint();
+    if (number == keys.size()) {
+      keys.push_back(std::string());
+      readBytes(keys.back());
+    } else if (number > keys.size())
+      parseError("Invalid attribute number");
+    val.clear();
+    readBytes(val);
+    node.attrs.set(keys[number], val);
+  }
+}
+
+uint64_t SurefileIterator::readVarint()
+{
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    char ch;
+    in.get(ch);
+    value |= uint64_t(ch & 0x7f) << shift;
+    if ((ch & 0x80) == 0)
+      return value;
+  }
+  parseError("Invalid number");
+  std::abort();
+}
+
+// Read a binary string, appending to 'str'.
+void SurefileIterator::readBytes(std::string& str)
+{
+  uint64_t const length = readVarint();
+  if (length > maxString)
+    parseError("String too long");
+  if (length == 0)
+    return;
+  size_t const start = str.size();
+  str.resize(start + length);
+  in.read(&str[start], length);
 }
 
 void SurefileIterator::readFull()
@@ -269,34 +1145,78 @@ void SurefileIterator::readFull()
   readString(node.name);
   expect('[');
 
-  while (true) {
-    char ch;
-    in.get(ch);
-    if (ch == ']')
+  for (size_t index = 0; ; ++index) {
+    if (index == fields.size())
+      fields.push_back(std::make_pair(std::string(), tree::Attrs::FIELD_COUNT));
+    std::pair<std::string, tree::Attrs::Field>& field = fields[index];
+
+    // The names of fields need no escapes, so when one is expected it can
+    // be matched in the buffer.
+    char const* data;
+    size_t const length = in.peek(data);
+    size_t const size = field.first.size();
+    if (*data == ']') {
+      in.skip(1);
       break;
-    std::string key(1, ch);
-    readString(key);
-    std::string val;
+    } else if (field.second != tree::Attrs::FIELD_COUNT && length > size &&
+               data[size] == ' ' && std::memcmp(data, field.first.data(), size) == 0) {
+      in.skip(size + 1);
+    } else {
+      key.clear();
+      readString(key);
+      field.first = key;
+      if (!tree::Attrs::byName(key, field.second))
+        field.second = tree::Attrs::FIELD_COUNT;
+    }
+
+    val.clear();
     readString(val);
-    node.atts[key] = val;
+    node.attrs.set(field.second, field.first, val);
+  }
+}
+
+void SurefileIterator::readLine(std::string& line)
+{
+  while (true) {
+    char const* data;
+    size_t const length = in.peek(data);
+    char const* const newline = static_cast<char const*>(std::memchr(data, '\n', length));
+    if (newline != 0) {
+      line.append(data, newline);
+      in.skip(newline - data + 1);
+      return;
+    }
+    line.append(data, length);
+    in.skip(length);
   }
 }
 
-// Read a space-terminated name, appending to the 'name'.
+// Read a space-terminated name, appending to the 'name'.  The text up to
+// the next space or escape is found in the buffer and appended at once.
 void SurefileIterator::readString(std::string& name)
 {
   while (true) {
-    char ch;
-    in.get(ch);
-    if (ch == ' ')
-      break;
-    else if (ch == '=') {
+    char const* data;
+    size_t const length = in.peek(data);
+    char const* const space = static_cast<char const*>(std::memchr(data, ' ', length));
+    char const* stop = space != 0 ? space : data + length;
+    char const* const escape = static_cast<char const*>(std::memchr(data, '=', stop - data));
+    if (escape != 0)
+      stop = escape;
+    name.append(data, stop);
+    in.skip(stop - data);
+
+    if (stop == space) {
+      in.skip(1);
+      return;
+    }
+    if (stop == escape) {
+      in.skip(1);
       char a, b;
       in.get(a);
       in.get(b);
       name += (dehex(a) << 4) | (dehex(b));
-    } else
-      name += ch;
+    }
   }
 }
 
@@ -311,11 +1231,76 @@ char SurefileIterator::dehex(char ch)
   std::abort();
 }
 
-tree::NodeIterator* loadSurefile(std::string const& fullName)
+std::string deltaName(std::string const& baseName, int generation)
+{
+  std::ostringstream name;
+  name << baseName << '.' << generation << extensions::delta;
+  return name.str();
+}
+
+int countDeltas(std::string const& baseName)
+{
+  int count = 0;
+  while (access(deltaName(baseName, count + 1).c_str(), F_OK) == 0)
+    ++count;
+  return count;
+}
+
+tree::NodeIterator* loadSubtree(std::string const& fullName, std::string const& path,
+                                Digest::Algorithm* digest)
+{
+  tree::NodeIterator* const tree = findSubtree(fullName, path, digest);
+  if (tree == 0)
+    throw Exception_base("no directory " + path + " in " + fullName);
+  return tree;
+}
+
+tree::NodeIterator* findSubtree(std::string const& fullName, std::string const& path,
+                                Digest::Algorithm* digest)
+{
+  std::vector<std::string> parts;
+  std::string joined;
+  for (size_t pos = 0; pos <= path.size(); ) {
+    size_t end = path.find('/', pos);
+    if (end == std::string::npos)
+      end = path.size();
+    std::string const part = path.substr(pos, end - pos);
+    if (!part.empty() && part != ".") {
+      parts.push_back(part);
+      joined += (joined.empty() ? "" : "/") + part;
+    }
+    pos = end + 1;
+  }
+  if (parts.empty())
+    return loadSurefile(fullName, digest);
+
+  std::auto_ptr<SurefileIterator> tree(new SurefileIterator());
+  Decoder::Index index;
+  bool found;
+  if (Decoder::readIndex(fullName, index))
+    found = tree->openAt(fullName, index, joined);
+  else {
+    tree->open(fullName);
+    found = tree->seek(parts);
+  }
+  if (!found)
+    return 0;
+  if (digest != 0)
+    *digest = tree->getDigest();
+
+  return tree.release();
+}
+
+tree::NodeIterator* loadSurefile(std::string const& fullName, Digest::Algorithm* digest,
+                                 SurefileFormat::Version* format)
 {
   std::auto_ptr<SurefileIterator> tree(new SurefileIterator());
 
   tree->open(fullName);
+  if (digest != 0)
+    *digest = tree->getDigest();
+  if (format != 0)
+    *format = tree->getFormat();
 
   return tree.release();
 }
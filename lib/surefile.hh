@@ -4,6 +4,7 @@
 #define __SUREFILE_H__
 
 #include <string>
+#include "hash.hh"
 #include "tree.hh"
 
 namespace asure {
@@ -12,15 +13,49 @@ namespace extensions {
 const std::string base = ".dat.gz";
 const std::string tmp = ".0.gz";
 const std::string bak = ".bak.gz";
+const std::string cache = ".cache";
+// Preceded by the generation.
+const std::string delta = ".delta.gz";
 }
 
+// The name of the delta for generation 'generation' of the surefile
+// 'baseName', counting from 1.
+std::string deltaName(std::string const& baseName, int generation);
+
+// How many deltas the surefile 'baseName' has, counting up from 1 until
+// one is missing.
+int countDeltas(std::string const& baseName);
+
 class Emitter;
 
+// The formats a surefile can be written in.  Either is read back.
+struct SurefileFormat {
+  enum Version {
+    // "asure-2.0": a line of text for each node, with every attribute
+    // written out by name.
+    TEXT,
+    // "asure-3.0": binary records, with numbers as varints and digests as
+    // raw bytes.  Attribute names outside the fixed set are given once and
+    // then referred to by number, and each name is stored as what differs
+    // from the one before it in the same directory.
+    BINARY
+  };
+
+  static char const* name(Version version);
+  static bool byName(std::string const& name, Version& version);
+};
+
 // The surefile can be written either 'push' style, or the 'save' method used to
 // pull from a NodeIterator.
+//
+// Writing the surefile itself moves the one it replaces to the backup, and
+// removes that one's deltas, once they are applied to the backup.
 class SurefileSaver {
  public:
-  SurefileSaver(std::string const& baseName);
+  // Files are hashed with the given digest, which is recorded in the header.
+  // With a 'generation', that delta is written instead of the surefile.
+  SurefileSaver(std::string const& baseName, Digest::Algorithm digest = Digest::SHA1,
+                SurefileFormat::Version format = SurefileFormat::TEXT, int generation = 0);
   ~SurefileSaver();
 
   void writeNode(tree::Node const& node);
@@ -29,14 +64,42 @@ class SurefileSaver {
   // surefile will be partially written.
   void close();
 
+  // When the surefile being replaced has deltas, the backup left for
+  // signoff is that surefile with all of them applied, the generation
+  // before this one.  Compaction, which writes what they all add up to,
+  // asks for it to have only the first 'generations' of them instead.
+  void backupGenerations(int generations);
+
+  // Leave the backup as it is, for a surefile rewritten with the same
+  // contents, which is not a new generation.
+  void keepBackup();
+
   // Save the surefile.
-  static void save(std::string const& baseName, tree::NodeIterator& root);
+  static void save(std::string const& baseName, tree::NodeIterator& root,
+                   Digest::Algorithm digest = Digest::SHA1,
+                   SurefileFormat::Version format = SurefileFormat::TEXT);
 
  private:
   Emitter* emit;
 };
 
-tree::NodeIterator* loadSurefile(std::string const& fullName);
+// Load a surefile of either format, also returning the digest its files
+// were hashed with if 'digest' is given, and its format if 'format' is.
+tree::NodeIterator* loadSurefile(std::string const& fullName,
+                                 Digest::Algorithm* digest = 0,
+                                 SurefileFormat::Version* format = 0);
+
+// Load the part of a surefile below the directory 'path', relative to its
+// root, as a tree of its own, rooted at that directory.  The index at the
+// end of the surefile is used to read only that part; surefiles without
+// one are read up to it.  Throws Exception_base if there is no such
+// directory.
+tree::NodeIterator* loadSubtree(std::string const& fullName, std::string const& path,
+                                Digest::Algorithm* digest = 0);
+
+// The same, but returning 0 if there is no such directory.
+tree::NodeIterator* findSubtree(std::string const& fullName, std::string const& path,
+                                Digest::Algorithm* digest = 0);
 
 }
 
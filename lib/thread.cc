@@ -0,0 +1,49 @@
+// Minimal threading support.
+
+extern "C" {
+#include <errno.h>
+#include <unistd.h>
+}
+
+#include <cassert>
+#include "thread.hh"
+#include "exn.hh"
+
+namespace asure {
+
+Thread::~Thread()
+{
+  assert(!started_);
+}
+
+void Thread::start()
+{
+  int result = pthread_create(&thread_, 0, trampoline, this);
+  if (result != 0) {
+    errno = result;
+    throw IO_error("pthread_create", "thread");
+  }
+  started_ = true;
+}
+
+void Thread::join()
+{
+  if (started_) {
+    pthread_join(thread_, 0);
+    started_ = false;
+  }
+}
+
+void* Thread::trampoline(void* arg)
+{
+  static_cast<Thread*>(arg)->run();
+  return 0;
+}
+
+int processorCount()
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count < 1 ? 1 : count;
+}
+
+}
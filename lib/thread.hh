@@ -0,0 +1,75 @@
+// Minimal threading support.
+
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+extern "C" {
+#include <pthread.h>
+}
+
+#include <boost/noncopyable.hpp>
+
+namespace asure {
+
+class Mutex : boost::noncopyable {
+ public:
+  Mutex() { pthread_mutex_init(&mutex_, 0); }
+  ~Mutex() { pthread_mutex_destroy(&mutex_); }
+
+  void lock() { pthread_mutex_lock(&mutex_); }
+  void unlock() { pthread_mutex_unlock(&mutex_); }
+  pthread_mutex_t* get() { return &mutex_; }
+
+ private:
+  pthread_mutex_t mutex_;
+};
+
+// Hold a mutex for the duration of a scope.
+class Lock : boost::noncopyable {
+ public:
+  Lock(Mutex& mutex) : mutex_(mutex) { mutex_.lock(); }
+  ~Lock() { mutex_.unlock(); }
+
+ private:
+  Mutex& mutex_;
+};
+
+class Condition : boost::noncopyable {
+ public:
+  Condition() { pthread_cond_init(&cond_, 0); }
+  ~Condition() { pthread_cond_destroy(&cond_); }
+
+  void wait(Mutex& mutex) { pthread_cond_wait(&cond_, mutex.get()); }
+  void signal() { pthread_cond_signal(&cond_); }
+  void broadcast() { pthread_cond_broadcast(&cond_); }
+
+ private:
+  pthread_cond_t cond_;
+};
+
+// A thread runs the run() method of a subclass.  The owner must call join()
+// before destroying a started thread.
+class Thread : boost::noncopyable {
+ public:
+  Thread() : thread_(), started_(false) { }
+  virtual ~Thread();
+
+  void start();
+  void join();
+
+ protected:
+  virtual void run() = 0;
+
+ private:
+  pthread_t thread_;
+  bool started_;
+
+  static void* trampoline(void* arg);
+};
+
+// The number of processors currently online, at least 1.
+int processorCount();
+
+}
+
+#endif
@@ -1,19 +1,24 @@
 // Local directory trees.
-//
-// TODO: Avoid crossing device boundaries.
 
 extern "C" {
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 }
 
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
-#include <sstream>
+#include <map>
+#include <memory>
 #include <deque>
 #include <string>
 #include <vector>
@@ -21,6 +26,9 @@ extern "C" {
 
 #include "hash.hh"
 #include "tree-local.hh"
+#include "thread.hh"
+#include "uring.hh"
+#include "walkrules.hh"
 #include "exn.hh"
 
 namespace asure {
@@ -28,288 +36,859 @@ namespace tree {
 
 namespace {
 
-class NodeWrapper;
-typedef std::deque<NodeWrapper*> NodeDeque;
+// A directory entry, with what the walk needs to know about it.
+struct Entry {
+  std::string name;
+  struct stat stat;
+  // The target of a symlink.
+  std::string target;
+};
 
-class NodeWrapper : boost::noncopyable {
+bool entryLess(Entry const& a, Entry const& b)
+{
+  return a.name < b.name;
+}
+
+// An open directory.  Its subdirectories are opened relative to it, so the
+// kernel doesn't resolve whole paths over and over, and so a rename above
+// the walk doesn't send it somewhere else.  Everything that still has to
+// open a subdirectory holds a reference, and the last one closes it.
+class DirHandle : boost::noncopyable {
  public:
-  virtual ~NodeWrapper() = 0;
-  virtual Node const& getNode() const = 0;
+  // Open the directory 'name' in 'parent' (or the cwd, when 0), checking that
+  // it is still the directory 'expected' describes.  'path' is only for
+  // messages.
+  static DirHandle* open(DirHandle* parent, std::string const& name,
+                         std::string const& path, struct stat const& expected);
+
+  int fd() const { return fd_; }
+  DirHandle* retain() {
+    __sync_add_and_fetch(&refs_, 1);
+    return this;
+  }
+  void release() {
+    if (__sync_sub_and_fetch(&refs_, 1) == 0)
+      delete this;
+  }
 
-  // Advance is called _after_ removing 'this' from the deque.  When this method
-  // returns, 'this' will be deleted.
-  virtual void advance(NodeDeque& /*dirs*/) { }
+ private:
+  DirHandle(int fd) : fd_(fd), refs_(1) { }
+  ~DirHandle() { close(fd_); }
+
+  int fd_;
+  int refs_;
 };
 
-class Tree : public NodeIterator {
- public:
-  ~Tree();
+class Walk;
 
-  bool empty() const { return nodes.empty(); }
-  void operator++();
-  Node const& operator*() const {
-    return nodes.front()->getNode();
+// The contents of a directory, read and stat'ed, each kind sorted by name.
+struct Listing : boost::noncopyable {
+  Listing() : subdirs(), files(), warning(), dir(0) { }
+  ~Listing() {
+    if (dir != 0)
+      dir->release();
   }
 
-  NodeDeque nodes;
-};
+  std::vector<Entry> subdirs;
+  std::vector<Entry> files;
 
-Tree::~Tree()
-{
-  // Clean up.  Note that this doesn't call advance.
-  while (!nodes.empty()) {
-    delete nodes.front();
-    nodes.pop_front();
-  }
-}
+  // Why the directory couldn't be read, if it couldn't.
+  std::string warning;
 
-void Tree::operator++()
-{
-  NodeWrapper* head = nodes.front();
-  nodes.pop_front();
-  head->advance(nodes);
-  delete head;
-}
+  // The directory, held open while there are subdirectories to open in it.
+  DirHandle* dir;
 
-NodeWrapper::~NodeWrapper()
-{
-}
+  // Read the directory 'name' in 'parent', as the walk's options say.
+  void read(DirHandle* parent, std::string const& name, std::string const& path,
+            struct stat const& stat, Walk const& walk);
+  void swap(Listing& other) {
+    subdirs.swap(other.subdirs);
+    files.swap(other.files);
+    warning.swap(other.warning);
+    std::swap(dir, other.dir);
+  }
+};
 
-struct NameIno {
+class Prefetcher;
+
+// State shared by the whole walk.
+class Walk : boost::noncopyable {
  public:
-  NameIno(std::string& n, ino_t i) : name(n), ino(i) { }
-  bool operator<(const NameIno& other) const {
-    return ino < other.ino;
+  Walk(std::string const& rootPath, struct stat const& rootStat, WalkOptions const& opts);
+  ~Walk();
+
+  WalkOptions const options;
+  std::string const root;
+  dev_t const rootDev;
+
+  // The path of a directory below the root, relative to the directory the
+  // rules are for.
+  std::string relative(std::string const& path) const {
+    std::string const below =
+      path.size() > root.size() ? path.substr(root.size() + 1) : std::string();
+    if (options.within.empty() || below.empty())
+      return options.within + below;
+    return options.within + '/' + below;
   }
 
-  // Read all of the name/inode pairs from a directory, sorted by inode number.
-  static void getNames(const std::string& path, std::vector<NameIno>& result);
+  // Get the listing of the directory the walk is entering, 'name' in
+  // 'parent'.
+  void list(DirHandle* parent, std::string const& name, std::string const& path,
+            struct stat const& stat, Listing& listing);
 
-  std::string name;
-  ino_t ino;
+ private:
+  Prefetcher* prefetcher_;
+};
+
+// A directory the walk is inside of.  Its listing is the storage for the
+// nodes visited in it.
+struct Frame : boost::noncopyable {
+  Frame() : listing(), path(), next(0) { }
+
+  Listing listing;
+  std::string path;
 
+  // Which of the subdirectories, or after the MARK, files the walk is at.
+  size_t next;
 };
 
-class SimpleNodeWrapper : public NodeWrapper {
+// The node the walk is at.  It points into the listing of the directory it
+// is in, and only fills in its attributes when they are asked for.
+class LocalNode : public Node {
  public:
-  SimpleNodeWrapper(Node::Kind kind) : node_(kind) { }
-  Node const& getNode() const { return node_; }
+  LocalNode(Digest::Algorithm digest, HashCache* cache) :
+      kind_(ENTER), entry_(0), dir_(0), digest_(digest), cache_(cache),
+      attrs_(), haveAttrs_(false) { }
+
+  // Move to another node.  'dir' is the path of the directory holding the
+  // entry, used when the file has to be read.
+  void set(Kind kind, Entry const* entry, std::string const* dir) {
+    kind_ = kind;
+    entry_ = entry;
+    dir_ = dir;
+    haveAttrs_ = false;
+    attrsChanged();
+  }
+
+  Kind getKind() const { return kind_; }
+  std::string const& getName() const { return entry_ != 0 ? entry_->name : Node::emptyName; }
+  Attrs const& getAttrs() const;
+  Atts getExpensiveAtts() const;
+  Node* clone() const;
+  bool hashSource(std::string& path, off_t& size, Digest::Algorithm& digest) const;
+  Atts hashAtts(Hash const& hash) const;
+
  private:
-  class SubNode : public Node {
-   public:
-    SubNode(Kind kind) : kind_(kind) { }
-    Kind getKind() const { return kind_; }
-    std::string const& getName() const { return Node::emptyName; }
-    Atts const& getAtts() const { return Node::emptyAtts; }
-   private:
-    Kind kind_;
-  };
-  SubNode node_;
+  Kind kind_;
+  Entry const* entry_;
+  std::string const* dir_;
+  Digest::Algorithm digest_;
+  HashCache* cache_;
+
+  mutable Attrs attrs_;
+  mutable bool haveAttrs_;
+
+  bool isFile() const { return kind_ == NODE && S_ISREG(entry_->stat.st_mode); }
+  std::string path() const { return *dir_ + '/' + entry_->name; }
+  Atts makeAtts(Hash const& hash) const;
 };
 
-class RegularNodeWrapper : public NodeWrapper {
+// A copy of a node, which owns what it points to, so stays valid as the walk
+// moves on.
+class OwnedNode : public LocalNode {
  public:
-  RegularNodeWrapper(std::string const& name, std::string const& path, struct stat& stat);
-
-  Node const& getNode() const { return node_; }
+  OwnedNode(Digest::Algorithm digest, HashCache* cache, Kind kind, Entry const* entry,
+            std::string const* dir) :
+      LocalNode(digest, cache), entry_(entry != 0 ? *entry : Entry()),
+      dir_(dir != 0 ? *dir : std::string()) {
+    set(kind, entry != 0 ? &entry_ : 0, &dir_);
+  }
 
  private:
-  class SubNode : public Node {
-   public:
-    SubNode(std::string const& name, std::string const& path) : name_(name), path_(path), atts_() { }
-    Kind getKind() const { return Node::NODE; }
-    std::string const& getName() const { return name_; }
-    Atts const& getAtts() const { return atts_; }
-    Atts getExpensiveAtts() const;
-
-    std::string name_;
-    std::string path_;
-    Node::Atts atts_;
-  };
-  SubNode node_;
+  Entry entry_;
+  std::string dir_;
 };
 
-// Directory iteration.
-class DirNodeWrapper : public NodeWrapper {
+class Tree : public NodeIterator {
  public:
-  DirNodeWrapper(std::string const& name, std::string const& path, struct stat& stat);
+  Tree(std::string const& root, struct stat const& rootStat, WalkOptions const& opts);
+  ~Tree();
 
-  Node const& getNode() const { return node_; }
-  void advance(NodeDeque& dirs);
+  bool empty() const { return done_; }
+  void operator++();
+  Node const& operator*() const { return node_; }
+  void skipTree();
 
  private:
-  class SubNode : public Node {
-   public:
-    SubNode(std::string const& name) : name_(name), atts_() { }
-    Kind getKind() const { return Node::ENTER; }
-    std::string const& getName() const { return name_; }
-    Atts const& getAtts() const { return atts_; }
-
-    std::string name_;
-    Node::Atts atts_;
-  };
-  SubNode node_;
-  std::string path_;
+  Walk walk_;
+  Entry rootEntry_;
+  std::vector<Frame*> frames_;
+  LocalNode node_;
+  bool done_;
+
+  void enter(Entry const& entry);
+  void nextSubdir();
+  void nextFile();
 };
 
-template <class N>
-std::string stringify(N value)
+Tree::Tree(std::string const& root, struct stat const& rootStat, WalkOptions const& opts) :
+    walk_(root, rootStat, opts), rootEntry_(), frames_(), node_(opts.digest, opts.cache),
+    done_(false)
 {
-  std::stringstream ss;
-  ss << value;
-  return ss.str();
+  rootEntry_.name = "__root__";
+  rootEntry_.stat = rootStat;
+  node_.set(Node::ENTER, &rootEntry_, 0);
 }
 
-template <class E>
-bool nameLess(E const& a, E const& b)
+Tree::~Tree()
 {
-  return a->getName() < b->getName();
+  for (size_t i = 0; i < frames_.size(); ++i)
+    delete frames_[i];
 }
 
+void Tree::operator++()
+{
+  switch (node_.getKind()) {
+    case Node::ENTER:
+      if (frames_.empty())
+        enter(rootEntry_);
+      else
+        enter(frames_.back()->listing.subdirs[frames_.back()->next]);
+      nextSubdir();
+      break;
+
+    case Node::MARK:
+      nextFile();
+      break;
+
+    case Node::NODE:
+      ++frames_.back()->next;
+      nextFile();
+      break;
+
+    case Node::LEAVE:
+      delete frames_.back();
+      frames_.pop_back();
+      if (frames_.empty()) {
+        done_ = true;
+        break;
+      }
+      ++frames_.back()->next;
+      nextSubdir();
+      break;
+  }
+}
+
+// Without walkers reading ahead, whose listings would be left waiting, a
+// directory can be passed over without being read at all.
+void Tree::skipTree()
+{
+  if (walk_.options.walkers > 0 || node_.getKind() != Node::ENTER) {
+    NodeIterator::skipTree();
+    return;
+  }
+  if (frames_.empty()) {
+    done_ = true;
+    return;
+  }
+  ++frames_.back()->next;
+  nextSubdir();
+}
+
+// Read the directory being entered, and make it the current one.
+void Tree::enter(Entry const& entry)
+{
+  std::auto_ptr<Frame> frame(new Frame);
+  if (frames_.empty()) {
+    // The root is opened by its path.
+    frame->path = walk_.root;
+    walk_.list(0, walk_.root, frame->path, entry.stat, frame->listing);
+  } else {
+    Frame const& parent = *frames_.back();
+    frame->path = parent.path + '/' + entry.name;
+    walk_.list(parent.listing.dir, entry.name, frame->path, entry.stat, frame->listing);
+  }
+  if (!frame->listing.warning.empty())
+    std::cout << "warning: " << frame->listing.warning << '\n';
+  frames_.push_back(frame.release());
+}
+
+// Visit the next subdirectory of the current directory, or the MARK after
+// them.
+void Tree::nextSubdir()
+{
+  Frame& frame = *frames_.back();
+  if (frame.next < frame.listing.subdirs.size()) {
+    node_.set(Node::ENTER, &frame.listing.subdirs[frame.next], &frame.path);
+    return;
+  }
+
+  // Every subdirectory has been opened.
+  if (frame.listing.dir != 0) {
+    frame.listing.dir->release();
+    frame.listing.dir = 0;
+  }
+  frame.next = 0;
+  node_.set(Node::MARK, 0, 0);
+}
+
+// Visit the next file of the current directory, or the LEAVE after them.
+void Tree::nextFile()
+{
+  Frame& frame = *frames_.back();
+  if (frame.next < frame.listing.files.size())
+    node_.set(Node::NODE, &frame.listing.files[frame.next], &frame.path);
+  else
+    node_.set(Node::LEAVE, 0, 0);
+}
+
+struct NameIno {
+ public:
+  NameIno(std::string const& n, ino_t i, unsigned char t) : name(n), ino(i), type(t) { }
+  bool operator<(const NameIno& other) const {
+    return ino < other.ino;
+  }
+
+  // Read all of the name/inode pairs from an open directory, sorted by inode
+  // number.
+  static void getNames(int fd, const std::string& path, std::vector<NameIno>& result);
+
+  std::string name;
+  ino_t ino;
+
+  // The d_type, DT_UNKNOWN if the filesystem doesn't say.
+  unsigned char type;
+};
+
 // The C api is very weird.
-std::string getLink(std::string const& path, int length)
+std::string getLink(int dirfd, std::string const& name, int length)
 {
   char buf[length];
-  ssize_t len = readlink(path.c_str(), buf, length);
+  ssize_t len = readlinkat(dirfd, name.c_str(), buf, length);
   if (len < 0)
     throw std::exception();
   else if (len < length)
     return std::string(buf, len);
   else
-    return getLink(path, 2*length);
+    return getLink(dirfd, name, 2*length);
 }
 
-bool wrapperLess(NodeWrapper const* a, NodeWrapper const* b)
+Attrs const& LocalNode::getAttrs() const
 {
-  return a->getNode().getName() < b->getNode().getName();
+  if (entry_ == 0)
+    return Node::emptyAttrs;
+  if (haveAttrs_)
+    return attrs_;
+
+  Attrs& attrs = attrs_;
+  attrs.clear();
+  struct stat const& stat = entry_->stat;
+
+  if (kind_ == ENTER) {
+    attrs.setKind(Attrs::DIR);
+  } else if (S_ISREG(stat.st_mode)) {
+    attrs.setKind(Attrs::FILE);
+    attrs.setNumber(Attrs::MTIME, stat.st_mtime);
+    attrs.setNumber(Attrs::CTIME, stat.st_ctime);
+    attrs.setNumber(Attrs::INO, stat.st_ino);
+    // The times above stay in whole seconds, as older surefiles have them.
+    attrs.setNumber(Attrs::MTIMENS, stat.st_mtim.tv_nsec);
+    attrs.setNumber(Attrs::CTIMENS, stat.st_ctim.tv_nsec);
+    attrs.setNumber(Attrs::SIZE, stat.st_size);
+    attrs.setNumber(Attrs::NLINK, stat.st_nlink);
+  } else if (S_ISLNK(stat.st_mode)) {
+    attrs.setKind(Attrs::LNK);
+    attrs.setTarget(entry_->target);
+  } else if (S_ISSOCK(stat.st_mode)) {
+    attrs.setKind(Attrs::SOCK);
+  } else if (S_ISFIFO(stat.st_mode)) {
+    attrs.setKind(Attrs::FIFO);
+  } else if (S_ISBLK(stat.st_mode)) {
+    attrs.setKind(Attrs::BLK);
+  } else if (S_ISCHR(stat.st_mode)) {
+    attrs.setKind(Attrs::CHR);
+  }
+
+  // Everything but symlinks has an owner and permissions, and devices their
+  // numbers.
+  if (!S_ISLNK(stat.st_mode)) {
+    attrs.setNumber(Attrs::UID, stat.st_uid);
+    attrs.setNumber(Attrs::GID, stat.st_gid);
+    attrs.setNumber(Attrs::PERM, stat.st_mode & ~S_IFMT);
+  }
+  if (S_ISBLK(stat.st_mode) || S_ISCHR(stat.st_mode)) {
+    attrs.setNumber(Attrs::DEVMAJ, major(stat.st_rdev));
+    attrs.setNumber(Attrs::DEVMIN, minor(stat.st_rdev));
+  }
+  haveAttrs_ = true;
+  return attrs;
 }
 
-DirNodeWrapper::DirNodeWrapper(std::string const& name, std::string const& path, struct stat& stat) :
-    node_(name), path_(path)
+Node::Atts LocalNode::getExpensiveAtts() const
 {
-  node_.atts_["kind"] = "dir";
-  node_.atts_["uid"] = stringify(stat.st_uid);
-  node_.atts_["gid"] = stringify(stat.st_gid);
-  node_.atts_["perm"] = stringify(stat.st_mode & ~S_IFMT);
+  if (!isFile())
+    return Atts();
+
+  Hash h;
+  if (cache_ != 0 && cache_->lookup(FileKey::of(entry_->stat), digest_, h))
+    return makeAtts(h);
+  h.ofFile(path(), digest_);
+  return hashAtts(h);
 }
 
-RegularNodeWrapper::RegularNodeWrapper(std::string const& name, std::string const& path, struct stat& stat) :
-    node_(name, path)
+Node::Atts LocalNode::hashAtts(Hash const& hash) const
 {
-  Node::Atts& atts = node_.atts_;
+  if (cache_ != 0 && !cache_->insert(FileKey::of(entry_->stat), digest_, hash))
+    std::cout << "warning: contents changed without the metadata changing: " << path() << '\n';
+  return makeAtts(hash);
+}
 
-  if (S_ISREG(stat.st_mode)) {
-    atts["kind"] = "file";
-    atts["uid"] = stringify(stat.st_uid);
-    atts["gid"] = stringify(stat.st_gid);
-    atts["mtime"] = stringify(stat.st_mtime);
-    atts["ctime"] = stringify(stat.st_ctime);
-    atts["ino"] = stringify(stat.st_ino);
-    atts["perm"] = stringify(stat.st_mode & ~S_IFMT);
-  } else if (S_ISLNK(stat.st_mode)) {
-    atts["kind"] = "lnk";
-    std::string const target = getLink(path, 128);
-    atts["targ"] = target;
-  } else if (S_ISSOCK(stat.st_mode)) {
-    atts["kind"] = "sock";
-    atts["uid"] = stringify(stat.st_uid);
-    atts["gid"] = stringify(stat.st_gid);
-    atts["perm"] = stringify(stat.st_mode & ~S_IFMT);
-  } else if (S_ISFIFO(stat.st_mode)) {
-    atts["kind"] = "fifo";
-    atts["uid"] = stringify(stat.st_uid);
-    atts["gid"] = stringify(stat.st_gid);
-    atts["perm"] = stringify(stat.st_mode & ~S_IFMT);
-  } else if (S_ISBLK(stat.st_mode)) {
-    atts["kind"] = "blk";
-    atts["uid"] = stringify(stat.st_uid);
-    atts["gid"] = stringify(stat.st_gid);
-    atts["perm"] = stringify(stat.st_mode & ~S_IFMT);
-    atts["devmaj"] = stringify(major(stat.st_rdev));
-    atts["devmin"] = stringify(minor(stat.st_rdev));
-  } else if (S_ISCHR(stat.st_mode)) {
-    atts["kind"] = "chr";
-    atts["uid"] = stringify(stat.st_uid);
-    atts["gid"] = stringify(stat.st_gid);
-    atts["perm"] = stringify(stat.st_mode & ~S_IFMT);
-    atts["devmaj"] = stringify(major(stat.st_rdev));
-    atts["devmin"] = stringify(minor(stat.st_rdev));
-  } else {
-    throw std::exception();
+Node::Atts LocalNode::makeAtts(Hash const& hash) const
+{
+  Atts atts;
+  atts[Digest::name(digest_)] = hash;
+  return atts;
+}
+
+bool LocalNode::hashSource(std::string& path, off_t& size, Digest::Algorithm& digest) const
+{
+  if (!isFile())
+    return false;
+
+  // Files in the cache needn't be read at all.
+  Hash h;
+  if (cache_ != 0 && cache_->lookup(FileKey::of(entry_->stat), digest_, h))
+    return false;
+
+  path = this->path();
+  size = entry_->stat.st_size;
+  digest = digest_;
+  return true;
+}
+
+Node* LocalNode::clone() const
+{
+  return new OwnedNode(digest_, cache_, kind_, entry_, dir_);
+}
+
+DirHandle* DirHandle::open(DirHandle* parent, std::string const& name,
+                           std::string const& path, struct stat const& expected)
+{
+  int fd = openat(parent != 0 ? parent->fd() : AT_FDCWD, name.c_str(),
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    throw IO_error("openat", path);
+
+  struct stat stat;
+  if (fstat(fd, &stat) != 0) {
+    int const err = errno;
+    close(fd);
+    errno = err;
+    throw IO_error("fstat", path);
+  }
+  if (stat.st_dev != expected.st_dev || stat.st_ino != expected.st_ino) {
+    close(fd);
+    throw Exception_base("directory replaced during walk (" + path + ")");
   }
+
+  return new DirHandle(fd);
 }
 
-Node::Atts
-RegularNodeWrapper::SubNode::getExpensiveAtts() const
+// What statx has to fill in for each kind of entry: directories and special
+// files only record their ownership and permissions, symlinks just their
+// target.
+unsigned const nodeMask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID;
+unsigned const dirMask = nodeMask | STATX_INO;
+unsigned const fileMask = dirMask | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_NLINK;
+unsigned const linkMask = STATX_TYPE;
+
+unsigned maskForMode(mode_t mode)
 {
-  Atts atts;
+  switch (mode & S_IFMT) {
+    case S_IFDIR: return dirMask;
+    case S_IFLNK: return linkMask;
+    case S_IFREG: return fileMask;
+    default: return nodeMask;
+  }
+}
 
-  Atts::const_iterator kind = atts_.find("kind");
-  assert(kind != atts_.end());
-  if (kind->second == "file") {
-    Hash h;
-    h.ofFile(path_);
-    atts["sha1"] = h;
+// Guess from the d_type, asking for everything when it is unknown.
+unsigned maskForType(unsigned char type)
+{
+  switch (type) {
+    case DT_DIR: return dirMask;
+    case DT_LNK: return linkMask;
+    case DT_UNKNOWN:
+    case DT_REG: return fileMask;
+    default: return nodeMask;
   }
+}
 
-  return atts;
+// Regular files are judged by their size and times, so those have to be
+// current.  For the rest, whatever a network filesystem has cached will do.
+int flagsForType(unsigned char type)
+{
+  int const flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+  if (type == DT_REG || type == DT_UNKNOWN)
+    return flags | AT_STATX_SYNC_AS_STAT;
+  return flags | AT_STATX_DONT_SYNC;
 }
 
-void DirNodeWrapper::advance(NodeDeque& dirs)
+void toStat(struct statx const& stx, struct stat& stat)
 {
-  dirs.push_front(new SimpleNodeWrapper(Node::LEAVE));
+  std::memset(&stat, 0, sizeof(stat));
+  stat.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  stat.st_ino = stx.stx_ino;
+  stat.st_mode = stx.stx_mode;
+  stat.st_nlink = stx.stx_nlink;
+  stat.st_uid = stx.stx_uid;
+  stat.st_gid = stx.stx_gid;
+  stat.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  stat.st_size = stx.stx_size;
+  stat.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  stat.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  stat.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  stat.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
 
-  std::vector<NodeWrapper*> subdirs;
-  std::vector<NodeWrapper*> files;
+void Listing::read(DirHandle* parent, std::string const& name, std::string const& path,
+                   struct stat const& stat, Walk const& walk)
+{
+  // A directory on another filesystem is recorded, but not entered.
+  if (walk.options.oneFileSystem && stat.st_dev != walk.rootDev)
+    return;
 
   try {
+    dir = DirHandle::open(parent, name, path, stat);
+    int const fd = dir->fd();
+
     std::vector<NameIno> names;
-    NameIno::getNames(path_, names);
+    NameIno::getNames(fd, path, names);
+
+    // Leave out what the rules exclude before stat'ing it, unless that
+    // depends on a kind the d_type doesn't give.
+    WalkRules const* const rules = walk.options.rules;
+    std::string base = walk.relative(path);
+    if (!base.empty())
+      base += '/';
+    std::vector<bool> unsure;
+
+    // Stat the entries, in inode order, asking only for what the kind
+    // d_type claims needs.
+    std::vector<UringStat> stats;
+    stats.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      NameIno const& ni = names[i];
+      if (rules != 0) {
+        bool const known = ni.type != DT_UNKNOWN || !rules->needsKind();
+        if (known && rules->excluded(base + ni.name, ni.name, ni.type == DT_DIR))
+          continue;
+        unsure.push_back(!known);
+      }
+      stats.push_back(UringStat(ni.name, maskForType(ni.type), flagsForType(ni.type)));
+    }
+    if (!walk.options.uringStat || stats.size() < 2 || !uringStatx(fd, stats)) {
+      for (size_t i = 0; i < stats.size(); ++i) {
+        UringStat& st = stats[i];
+        st.error = statx(fd, st.name.c_str(), st.flags, st.mask, &st.stx) != 0 ? errno : 0;
+      }
+    }
 
     // Iterate through the entries, adding them appropraitely as a file or dir.
-    typedef std::vector<NameIno>::const_iterator iter;
-    iter const end = names.end();
-    for (iter i = names.begin(); i != end; ++i) {
-      struct stat stat;
-      std::string const fullName = path_ + '/' + i->name;
-      int result = lstat(fullName.c_str(), &stat);
-      if (result != 0) {
+    for (size_t i = 0; i < stats.size(); ++i) {
+      UringStat& st = stats[i];
+      if (st.error != 0) {
         // TODO: Warn
         continue;
       }
-      if (S_ISDIR(stat.st_mode)) {
-        subdirs.push_back(new DirNodeWrapper(i->name, fullName, stat));
-      } else {
-        files.push_back(new RegularNodeWrapper(i->name, fullName, stat));
+      unsigned const needed = maskForMode(st.stx.stx_mode);
+      if ((st.stx.stx_mask & needed) != needed && (st.mask & needed) != needed) {
+        // The d_type was wrong, or the entry was replaced.
+        if (statx(fd, st.name.c_str(), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, needed,
+                  &st.stx) != 0)
+          continue;
+      }
+      if (rules != 0 && unsure[i] &&
+          rules->excluded(base + st.name, st.name, S_ISDIR(st.stx.stx_mode)))
+        continue;
+
+      Entry entry;
+      entry.name = st.name;
+      toStat(st.stx, entry.stat);
+      mode_t const kind = entry.stat.st_mode & S_IFMT;
+      if (kind == S_IFDIR) {
+        subdirs.push_back(entry);
+      } else if (kind == S_IFREG || kind == S_IFLNK || kind == S_IFSOCK || kind == S_IFIFO ||
+                 kind == S_IFBLK || kind == S_IFCHR) {
+        if (S_ISLNK(entry.stat.st_mode)) {
+          try {
+            entry.target = getLink(fd, st.name, 128);
+          }
+          catch (std::exception&) {
+            // Gone since the lstat.
+            continue;
+          }
+        }
+        files.push_back(entry);
       }
     }
   }
-  catch (IO_error& e) {
-    std::cout << "warning: " << e.what() << '\n';
+  catch (Exception_base& e) {
+    warning = e.what();
+  }
+
+  // Only needed to open the subdirectories.
+  if (dir != 0 && subdirs.empty()) {
+    dir->release();
+    dir = 0;
   }
 
-  typedef std::vector<NodeWrapper*>::const_reverse_iterator riter;
+  sort(subdirs.begin(), subdirs.end(), entryLess);
+  sort(files.begin(), files.end(), entryLess);
+}
+
+// Reads the listings of directories ahead of the walk, in a pool of threads.
+// Each directory listed makes its subdirectories known.  A worker takes the
+// directory it discovered most recently, which is likely the next one the
+// walk will need, or when it has none, steals the oldest one another worker
+// discovered.  At most 'limit' listings wait for the walk at once.
+class Prefetcher : boost::noncopyable {
+ public:
+  Prefetcher(Walk const& walk);
+  ~Prefetcher();
+
+  void take(DirHandle* parent, std::string const& name, std::string const& path,
+            struct stat const& stat, Listing& listing);
+  void work(int self);
 
-  sort(subdirs.begin(), subdirs.end(), wrapperLess);
-  sort(files.begin(), files.end(), wrapperLess);
+ private:
+  struct Scan {
+    enum State {
+      QUEUED, RUNNING, DONE,
+      // Listed by the walk itself instead; whoever dequeues it deletes it.
+      TAKEN
+    };
+    // Takes over the reference to 'parent'.
+    Scan(DirHandle* parent_, Entry const& entry, std::string const& path_) :
+        state(QUEUED), parent(parent_), name(entry.name), path(path_), stat(entry.stat),
+        listing() { }
+    ~Scan() { drop(); }
+
+    // Let go of the parent, once this doesn't need to open the directory.
+    void drop() {
+      if (parent != 0)
+        parent->release();
+      parent = 0;
+    }
+
+    State state;
+    DirHandle* parent;
+    std::string name;
+    std::string path;
+    struct stat stat;
+    Listing listing;
+  };
+
+  class Worker : public Thread {
+   public:
+    Worker(Prefetcher& owner, int self) : owner_(owner), self_(self) { }
+   protected:
+    void run() { owner_.work(self_); }
+   private:
+    Prefetcher& owner_;
+    int self_;
+  };
+
+  // The mutex protects everything but the listings of RUNNING scans.
+  Mutex mutex_;
+  Condition changed_;
+  std::map<std::string, Scan*> scans_;
+  std::vector<std::deque<Scan*> > deques_;
+  std::vector<Worker*> workers_;
+  size_t done_;
+  size_t const limit_;
+  Walk const& walk_;
+  bool stopping_;
+
+  void discover(int self, std::string const& path, Listing const& listing);
+  Scan* next(int self);
+  void shutdown();
+};
 
-  for (riter i = files.rbegin(); i != files.rend(); ++i) {
-    dirs.push_front(*i);
+Prefetcher::Prefetcher(Walk const& walk) :
+    mutex_(), changed_(), scans_(), deques_(walk.options.walkers), workers_(), done_(0),
+    limit_(std::max(walk.options.prefetch, 1)), walk_(walk), stopping_(false)
+{
+  try {
+    for (int i = 0; i < walk.options.walkers; ++i) {
+      workers_.push_back(new Worker(*this, i));
+      workers_.back()->start();
+    }
+  }
+  catch (...) {
+    shutdown();
+    throw;
   }
+}
+
+Prefetcher::~Prefetcher()
+{
+  shutdown();
+}
+
+void Prefetcher::shutdown()
+{
+  {
+    Lock lock(mutex_);
+    stopping_ = true;
+    changed_.broadcast();
+  }
+
+  // The last worker may not have been started.
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    try {
+      workers_[i]->join();
+    }
+    catch (...) {
+    }
+    delete workers_[i];
+  }
+  workers_.clear();
+
+  for (size_t i = 0; i < deques_.size(); ++i) {
+    for (size_t j = 0; j < deques_[i].size(); ++j) {
+      if (deques_[i][j]->state == Scan::TAKEN)
+        delete deques_[i][j];
+    }
+  }
+  deques_.clear();
+  typedef std::map<std::string, Scan*>::iterator Iter;
+  for (Iter i = scans_.begin(); i != scans_.end(); ++i)
+    delete i->second;
+  scans_.clear();
+}
 
-  dirs.push_front(new SimpleNodeWrapper(Node::MARK));
+// Called with the lock held.
+void Prefetcher::discover(int self, std::string const& path, Listing const& listing)
+{
+  if (listing.subdirs.empty())
+    return;
+  // The first subdirectory ends up at the back, to be taken first.
+  typedef std::vector<Entry>::const_reverse_iterator riter;
+  for (riter i = listing.subdirs.rbegin(); i != listing.subdirs.rend(); ++i) {
+    Scan* scan = new Scan(listing.dir->retain(), *i, path + '/' + i->name);
+    scans_[scan->path] = scan;
+    deques_[self].push_back(scan);
+  }
+  changed_.broadcast();
+}
 
-  for (riter i = subdirs.rbegin(); i != subdirs.rend(); ++i) {
-    dirs.push_front(*i);
+// Called with the lock held.
+Prefetcher::Scan* Prefetcher::next(int self)
+{
+  size_t const count = deques_.size();
+  for (size_t k = 0; k < count; ++k) {
+    std::deque<Scan*>& deque = deques_[(self + k) % count];
+    while (!deque.empty()) {
+      Scan* scan;
+      if (k == 0) {
+        scan = deque.back();
+        deque.pop_back();
+      } else {
+        scan = deque.front();
+        deque.pop_front();
+      }
+      if (scan->state != Scan::TAKEN)
+        return scan;
+      delete scan;
+    }
   }
+  return 0;
 }
 
+void Prefetcher::work(int self)
+{
+  Lock lock(mutex_);
+  while (true) {
+    Scan* scan = 0;
+    while (!stopping_ && (done_ >= limit_ || (scan = next(self)) == 0))
+      changed_.wait(mutex_);
+    // A scan taken anyway is still in scans_, for the shutdown to delete.
+    if (stopping_)
+      return;
+
+    scan->state = Scan::RUNNING;
+    mutex_.unlock();
+    scan->listing.read(scan->parent, scan->name, scan->path, scan->stat, walk_);
+    scan->drop();
+    mutex_.lock();
+
+    scan->state = Scan::DONE;
+    ++done_;
+    discover(self, scan->path, scan->listing);
+    changed_.broadcast();
+  }
 }
 
-NodeIterator* walkTree(std::string const& path)
+void Prefetcher::take(DirHandle* parent, std::string const& name, std::string const& path,
+                      struct stat const& stat, Listing& listing)
 {
-  Tree* tree = new Tree;
+  Lock lock(mutex_);
+  std::map<std::string, Scan*>::iterator pos = scans_.find(path);
+  if (pos == scans_.end() || pos->second->state == Scan::QUEUED) {
+    // Nobody has started on it, so read it here.
+    if (pos != scans_.end()) {
+      pos->second->state = Scan::TAKEN;
+      pos->second->drop();
+      scans_.erase(pos);
+    }
+    mutex_.unlock();
+    listing.read(parent, name, path, stat, walk_);
+    mutex_.lock();
+    discover(0, path, listing);
+    return;
+  }
 
+  Scan* scan = pos->second;
+  while (scan->state == Scan::RUNNING)
+    changed_.wait(mutex_);
+  listing.swap(scan->listing);
+  scans_.erase(path);
+  delete scan;
+  --done_;
+  changed_.broadcast();
+}
+
+Walk::Walk(std::string const& rootPath, struct stat const& rootStat, WalkOptions const& opts) :
+    options(opts), root(rootPath), rootDev(rootStat.st_dev), prefetcher_(0)
+{
+  if (options.walkers > 0)
+    prefetcher_ = new Prefetcher(*this);
+}
+
+Walk::~Walk()
+{
+  delete prefetcher_;
+}
+
+void Walk::list(DirHandle* parent, std::string const& name, std::string const& path,
+                struct stat const& stat, Listing& listing)
+{
+  if (prefetcher_ != 0)
+    prefetcher_->take(parent, name, path, stat, listing);
+  else
+    listing.read(parent, name, path, stat, *this);
+}
+
+}
+
+WalkOptions::WalkOptions() :
+    digest(Digest::SHA1), cache(0), walkers(processorCount()), prefetch(256),
+    uringStat(false), oneFileSystem(false), rules(0), within()
+{ }
+
+NodeIterator* walkTree(std::string const& path, WalkOptions const& options)
+{
   struct stat rootStat;
   int result = lstat(path.c_str(), &rootStat);
   if (result != 0)
@@ -317,54 +896,46 @@ NodeIterator* walkTree(std::string const& path)
   if (!S_ISDIR(rootStat.st_mode))
     throw IO_error("root is not directory", path);
 
-  NodeWrapper* root = new DirNodeWrapper("__root__", path, rootStat);
-  tree->nodes.push_front(root);
-
-  return tree;
+  return new Tree(path, rootStat, options);
 }
 
-class DirCloser {
- public:
-  DirCloser(DIR* dir) : dir_(dir) { }
-  ~DirCloser() {
-    closedir(dir_);
-    // TODO: Log error if there is a problem.
-  }
-
- private:
-  DIR* dir_;
-
-  DirCloser(DirCloser const& other);
-  void operator=(DirCloser const& other);
+// The records getdents64 fills its buffer with.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
 };
 
-void NameIno::getNames(const std::string& path, std::vector<NameIno>& result)
+void NameIno::getNames(int fd, const std::string& path, std::vector<NameIno>& result)
 {
-  DIR* dirp = opendir(path.c_str());
-  if (dirp == NULL) {
-    throw IO_error("getNames(opendir)", path);
-  }
-  DirCloser cleanup(dirp);
+  // Large enough for most directories in one call.
+  std::vector<char> buffer(64 * 1024);
 
   while (true) {
-    errno = 0;
-    struct dirent* ent = readdir(dirp);
-    if (ent == 0 && errno == 0)
+    long count = syscall(SYS_getdents64, fd, &buffer[0], buffer.size());
+    if (count < 0)
+      throw IO_error("getNames(getdents64)", path);
+    if (count == 0)
       break;
-    if (ent == 0)
-      throw std::exception();
-    std::string name(ent->d_name);
 
-    if (name == "." || name == "..")
-      continue;
+    for (long pos = 0; pos < count; ) {
+      LinuxDirent64 const* ent = reinterpret_cast<LinuxDirent64 const*>(&buffer[pos]);
+      pos += ent->d_reclen;
+      std::string name(ent->d_name);
+
+      if (name == "." || name == "..")
+        continue;
 
-    // Skip over integrity files.
-    if (name.find("0sure.") == 0)
-      continue;
-    if (name.find("2sure.") == 0)
-      continue;
+      // Skip over integrity files.
+      if (name.find("0sure.") == 0)
+        continue;
+      if (name.find("2sure.") == 0)
+        continue;
 
-    result.push_back(NameIno(name, ent->d_ino));
+      result.push_back(NameIno(name, ent->d_ino, ent->d_type));
+    }
   }
 
   std::sort(result.begin(), result.end());
@@ -5,14 +5,51 @@
 
 #include <list>
 #include <string>
+#include "hash.hh"
+#include "hashcache.hh"
 #include "tree.hh"
+#include "walkrules.hh"
 
 namespace asure {
 namespace tree {
 
+// How to walk a tree.
+struct WalkOptions {
+  WalkOptions();
+
+  // The digest to compute of each file.
+  Digest::Algorithm digest;
+
+  // Where to look up and remember file digests, if anywhere.  Not owned.
+  HashCache* cache;
+
+  // Number of threads reading directories ahead of the walk.  Zero reads
+  // each directory as the walk enters it.
+  int walkers;
+
+  // The most directory listings read ahead and not yet walked.
+  int prefetch;
+
+  // Stat each directory's entries in batches through io_uring, where the
+  // kernel supports that.
+  bool uringStat;
+
+  // Record the directories that are on other filesystems than the root,
+  // without entering them.
+  bool oneFileSystem;
+
+  // What to leave out of the walk, if anything.  Not owned.
+  WalkRules const* rules;
+
+  // Where the walk's root is below the directory the rules are written
+  // for, when walking only part of it.
+  std::string within;
+};
+
 // Return a newly allocated NodeIterator that traverses a directory in the
 // filesystem.  The iterator should be returned with delete when finished.
-NodeIterator* walkTree(std::string const& path);
+NodeIterator* walkTree(std::string const& path,
+                       WalkOptions const& options = WalkOptions());
 
 }
 }
@@ -9,10 +9,44 @@ NodeIterator::~NodeIterator()
 {
 }
 
+void NodeIterator::skipTree()
+{
+  int depth = 0;
+  do {
+    if ((**this).getKind() == Node::ENTER)
+      ++depth;
+    else if ((**this).getKind() == Node::LEAVE)
+      --depth;
+    ++*this;
+  } while (depth > 0);
+}
+
 Node::~Node()
 {
 }
 
+Node::Atts const& Node::getAtts() const
+{
+  if (!haveView_) {
+    view_.clear();
+    getAttrs().toMap(view_);
+    haveView_ = true;
+  }
+  return view_;
+}
+
+Attrs const& Node::getFullAttrs(Attrs& storage) const
+{
+  Atts const expensive = getExpensiveAtts();
+  if (expensive.empty())
+    return getAttrs();
+  storage = getAttrs();
+  typedef Atts::const_iterator Iter;
+  for (Iter i = expensive.begin(); i != expensive.end(); ++i)
+    storage.set(i->first, i->second);
+  return storage;
+}
+
 Node::Atts Node::getFullAtts() const
 {
   Atts result = this->getExpensiveAtts();
@@ -21,8 +55,36 @@ Node::Atts Node::getFullAtts() const
   return result;
 }
 
+namespace {
+
+// A node holding its own copy of another node's data.
+class CopyNode : public Node {
+ public:
+  CopyNode(Node const& other) : kind_(other.getKind()), name_(other.getName()),
+      attrs_(other.getAttrs()), expensive_(other.getExpensiveAtts()) { }
+
+  Kind getKind() const { return kind_; }
+  std::string const& getName() const { return name_; }
+  Attrs const& getAttrs() const { return attrs_; }
+  Atts getExpensiveAtts() const { return expensive_; }
+
+ private:
+  Kind kind_;
+  std::string name_;
+  Attrs attrs_;
+  Atts expensive_;
+};
+
+}
+
+Node* Node::clone() const
+{
+  return new CopyNode(*this);
+}
+
 std::string const Node::emptyName = "";
 Node::Atts const Node::emptyAtts = Atts();
+Attrs const Node::emptyAttrs = Attrs();
 
 }
 }
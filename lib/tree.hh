@@ -8,6 +8,8 @@
 #include <map>
 #include <string>
 #include <tr1/memory>
+#include "attrs.hh"
+#include "hash.hh"
 
 namespace asure {
 namespace tree {
@@ -28,11 +30,15 @@ class Node : boost::noncopyable {
   };
   typedef std::map<std::string, std::string> Atts;
 
+  Node() : view_(), haveView_(false) { }
   virtual ~Node() = 0;
 
   virtual Kind getKind() const = 0;
   virtual std::string const& getName() const = 0;
-  virtual Atts const& getAtts() const = 0;
+  virtual Attrs const& getAttrs() const = 0;
+
+  // The same attributes as strings, for showing and writing them.
+  Atts const& getAtts() const;
 
   // Note that the expensive atts are computed fresh, and a new set of atts is
   // returned.
@@ -42,10 +48,42 @@ class Node : boost::noncopyable {
   // getExpensiveAtts().
   Atts getFullAtts() const;
 
+  // Likewise, typed.  Returns getAttrs() itself when there are no expensive
+  // atts, otherwise the combination, built in 'storage'.
+  Attrs const& getFullAttrs(Attrs& storage) const;
+
+  // Return a newly allocated copy of this node that stays valid after the
+  // iterator that produced it has advanced.  The copy's getExpensiveAtts() may
+  // be called from another thread.  The default copies the expensive atts
+  // immediately; nodes that compute them lazily should override this.
+  virtual Node* clone() const;
+
+  // Nodes whose expensive atts are just the hash of a local file, which has
+  // yet to be read, can give that file's path, size and digest here, so that
+  // callers can hash many small files together.
+  virtual bool hashSource(std::string& /*path*/, off_t& /*size*/,
+                          Digest::Algorithm& /*digest*/) const { return false; }
+
+  // Build the expensive atts from the hash of the hashSource() file.
+  virtual Atts hashAtts(Hash const& /*hash*/) const { return Atts(); }
+
+  // For an ENTER, a digest of the whole directory, its own attributes and
+  // everything below it, where it is known, so that two directories with
+  // the same one can be passed over without reading them.
+  virtual Hash const* getTreeDigest() const { return 0; }
+
  protected:
   // Utility names:
   static std::string const emptyName;
   static Atts const emptyAtts;
+  static Attrs const emptyAttrs;
+
+  // Called when getAttrs() will return something different.
+  void attrsChanged() { haveView_ = false; }
+
+ private:
+  mutable Atts view_;
+  mutable bool haveView_;
 };
 
 // A tree visitor visits each node in the above order.  These aren't quite
@@ -62,6 +100,11 @@ class NodeIterator : boost::noncopyable {
   virtual Node const& operator*() const = 0;
 
   Node const* operator->() { return &(**this); }
+
+  // Move past the directory whose ENTER is current, and everything within
+  // it, to what follows its LEAVE.  Iterators that can find its end without
+  // reading what is in between override this.
+  virtual void skipTree();
 };
 
 }
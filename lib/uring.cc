@@ -0,0 +1,527 @@
+// Hashing files, and stat'ing directory entries, with io_uring.
+//
+// There is no liburing here, so this talks to the kernel directly.  One
+// thread submits the opens and reads for a batch of files, and hashes each
+// file's buffers in order as they complete.
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <boost/noncopyable.hpp>
+#include "uring.hh"
+#include "exn.hh"
+
+namespace asure {
+
+namespace {
+
+unsigned const ringEntries = 64;
+
+// The most files open at once, and the buffers shared among their reads.
+// Opens plus reads never exceed the ring size.
+size_t const maxOpen = 32;
+size_t const bufferCount = 32;
+size_t const bufferSize = 128 << 10;
+
+int ioUringSetup(unsigned entries, io_uring_params* params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, 0, 0);
+}
+
+int ioUringRegister(int fd, unsigned opcode, void* arg, unsigned args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+// A memory mapping of part of the ring.
+class Mapping : boost::noncopyable {
+ public:
+  Mapping() : data_(MAP_FAILED), length_(0) { }
+  ~Mapping() {
+    if (data_ != MAP_FAILED)
+      munmap(data_, length_);
+  }
+  void map(int fd, size_t length, off_t offset) {
+    length_ = length;
+    data_ = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (data_ == MAP_FAILED)
+      throw IO_error("io_uring(mmap)", "ring");
+  }
+  template <class T>
+  T* at(size_t offset) const {
+    return reinterpret_cast<T*>(static_cast<char*>(data_) + offset);
+  }
+ private:
+  void* data_;
+  size_t length_;
+};
+
+// A submission and completion queue pair.
+class Ring : boost::noncopyable {
+ public:
+  Ring();
+  ~Ring();
+
+  // The next free submission entry, cleared.
+  io_uring_sqe* next();
+
+  // Submit the pending entries, and wait for at least one completion.
+  void submitAndWait();
+
+  // Take the next completion, if there is one.
+  bool reap(io_uring_cqe& cqe);
+
+  // Whether the kernel supports an operation.
+  bool supports(unsigned op) const {
+    return op < supported_.size() && supported_[op];
+  }
+
+ private:
+  int fd_;
+  std::vector<bool> supported_;
+  Mapping sqMap_;
+  Mapping cqMap_;
+  Mapping sqeMap_;
+
+  unsigned* sqHead_;
+  unsigned* sqTail_;
+  unsigned sqMask_;
+  unsigned* sqArray_;
+  io_uring_sqe* sqes_;
+  // Entries filled in but not yet published to the tail, and entries
+  // published that the kernel has not yet taken.
+  unsigned pending_;
+  unsigned unsubmitted_;
+
+  unsigned* cqHead_;
+  unsigned* cqTail_;
+  unsigned cqMask_;
+  io_uring_cqe* cqes_;
+};
+
+Ring::Ring() : fd_(-1), supported_(), pending_(0), unsubmitted_(0)
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  fd_ = ioUringSetup(ringEntries, &params);
+  if (fd_ < 0)
+    throw IO_error("io_uring_setup", "ring");
+
+  try {
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool const single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sqSize = cqSize = std::max(sqSize, cqSize);
+    sqMap_.map(fd_, sqSize, IORING_OFF_SQ_RING);
+    Mapping& cqMap = single ? sqMap_ : cqMap_;
+    if (!single)
+      cqMap_.map(fd_, cqSize, IORING_OFF_CQ_RING);
+    sqeMap_.map(fd_, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+
+    sqHead_ = sqMap_.at<unsigned>(params.sq_off.head);
+    sqTail_ = sqMap_.at<unsigned>(params.sq_off.tail);
+    sqMask_ = *sqMap_.at<unsigned>(params.sq_off.ring_mask);
+    sqArray_ = sqMap_.at<unsigned>(params.sq_off.array);
+    sqes_ = sqeMap_.at<io_uring_sqe>(0);
+    cqHead_ = cqMap.at<unsigned>(params.cq_off.head);
+    cqTail_ = cqMap.at<unsigned>(params.cq_off.tail);
+    cqMask_ = *cqMap.at<unsigned>(params.cq_off.ring_mask);
+    cqes_ = cqMap.at<io_uring_cqe>(params.cq_off.cqes);
+
+    // Most operations arrived after the ring itself.
+    size_t const probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> probeSpace(probeSize);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&probeSpace[0]);
+    if (ioUringRegister(fd_, IORING_REGISTER_PROBE, probe, 256) < 0)
+      throw IO_error("io_uring_register(probe)", "ring");
+    supported_.resize(probe->last_op + 1);
+    for (unsigned op = 0; op <= probe->last_op; ++op)
+      supported_[op] = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+  catch (...) {
+    close(fd_);
+    throw;
+  }
+}
+
+Ring::~Ring()
+{
+  close(fd_);
+}
+
+io_uring_sqe* Ring::next()
+{
+  unsigned const tail = *sqTail_ + pending_;
+  if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqMask_ + 1)
+    throw Exception_base("io_uring: submission queue overflow");
+  unsigned const index = tail & sqMask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqArray_[index] = index;
+  ++pending_;
+  return sqe;
+}
+
+void Ring::submitAndWait()
+{
+  __atomic_store_n(sqTail_, *sqTail_ + pending_, __ATOMIC_RELEASE);
+  unsubmitted_ += pending_;
+  pending_ = 0;
+  while (true) {
+    int const result = ioUringEnter(fd_, unsubmitted_, 1, IORING_ENTER_GETEVENTS);
+    if (result >= 0) {
+      unsubmitted_ -= result;
+      if (unsubmitted_ == 0)
+        return;
+    } else if (errno == EAGAIN || errno == EBUSY) {
+      // Out of resources for now; whatever is in flight will complete.  The
+      // entries not taken are already in the queue, and go with the next
+      // submission.
+      if (*cqHead_ != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+        return;
+    } else if (errno != EINTR) {
+      throw IO_error("io_uring_enter", "ring");
+    }
+  }
+}
+
+bool Ring::reap(io_uring_cqe& cqe)
+{
+  unsigned const head = *cqHead_;
+  if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+    return false;
+  cqe = cqes_[head & cqMask_];
+  __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+struct File;
+
+// An operation in flight.
+struct Op {
+  Op(File* f, bool r, off_t o, int b) :
+      file(f), read(r), offset(o), buffer(b), done(false), stale(false), result(0) { }
+  File* file;
+  bool read;
+  off_t offset;
+  int buffer;
+  bool done;
+  // The data is no longer wanted, after a short read before it.
+  bool stale;
+  int result;
+};
+
+// A file being hashed.
+struct File {
+  File(UringFile& j, Digest::Algorithm algorithm) :
+      job(j), digest(Digest::create(algorithm)), fd(-1), opening(true),
+      noAtime(true), finished(false), next(0), reads() { }
+  ~File() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  void fail(int error, char const* call) {
+    if (!finished) {
+      job.error = error;
+      job.call = call;
+    }
+    finished = true;
+  }
+
+  UringFile& job;
+  std::auto_ptr<Digest> digest;
+  int fd;
+  bool opening;
+  bool noAtime;
+  // At the end of the file, or failed.  No more reads are started.
+  bool finished;
+  // Where the next read starts.
+  off_t next;
+  // The reads in flight, in file order.
+  std::deque<Op*> reads;
+};
+
+// Each thread keeps its ring and buffers between batches.
+class Engine : boost::noncopyable {
+ public:
+  Engine() : ring_(), space_(bufferCount * bufferSize), free_() {
+    for (size_t i = 0; i < bufferCount; ++i)
+      free_.push_back(i);
+  }
+
+  void run(std::vector<UringFile>& files, Digest::Algorithm algorithm);
+
+ private:
+  Ring ring_;
+  std::vector<unsigned char> space_;
+  std::vector<int> free_;
+
+  unsigned char* buffer(int index) { return &space_[index * bufferSize]; }
+
+  void startOpen(File* file);
+  void startRead(File* file);
+  void complete(Op* op, int result);
+  void drain(File* file);
+};
+
+void Engine::startOpen(File* file)
+{
+  io_uring_sqe* sqe = ring_.next();
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<unsigned long>(file->job.path.c_str());
+  sqe->open_flags = O_RDONLY | O_CLOEXEC | (file->noAtime ? O_NOATIME : 0);
+  sqe->user_data = reinterpret_cast<unsigned long>(new Op(file, false, 0, -1));
+}
+
+void Engine::startRead(File* file)
+{
+  int const index = free_.back();
+  free_.pop_back();
+  Op* op = new Op(file, true, file->next, index);
+  file->reads.push_back(op);
+  file->next += bufferSize;
+
+  io_uring_sqe* sqe = ring_.next();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = file->fd;
+  sqe->addr = reinterpret_cast<unsigned long>(buffer(index));
+  sqe->len = bufferSize;
+  sqe->off = op->offset;
+  sqe->user_data = reinterpret_cast<unsigned long>(op);
+}
+
+void Engine::complete(Op* op, int result)
+{
+  File* file = op->file;
+  if (!op->read) {
+    delete op;
+    if (result == -EPERM && file->noAtime) {
+      // O_NOATIME is only allowed on our own files.
+      file->noAtime = false;
+      startOpen(file);
+      return;
+    }
+    file->opening = false;
+    if (result < 0)
+      file->fail(-result, "uringHash(open)");
+    else
+      file->fd = result;
+    return;
+  }
+
+  op->done = true;
+  op->result = result;
+  drain(file);
+}
+
+// Hash the completed reads at the front of the file, in order.
+void Engine::drain(File* file)
+{
+  while (!file->reads.empty() && file->reads.front()->done) {
+    Op* op = file->reads.front();
+    file->reads.pop_front();
+    if (!file->finished && !op->stale) {
+      if (op->result < 0) {
+        file->fail(-op->result, "uringHash(read)");
+      } else if (op->result == 0) {
+        file->finished = true;
+      } else {
+        file->digest->update(buffer(op->buffer), op->result);
+        if (size_t(op->result) < bufferSize) {
+          // Usually the end of the file, but read on from here to be sure,
+          // ignoring what the later reads got.
+          for (size_t i = 0; i < file->reads.size(); ++i)
+            file->reads[i]->stale = true;
+          file->next = op->offset + op->result;
+        }
+      }
+    }
+    free_.push_back(op->buffer);
+    delete op;
+  }
+}
+
+void Engine::run(std::vector<UringFile>& files, Digest::Algorithm algorithm)
+{
+  // A few files get more reads in flight each.
+  size_t const readsPerFile =
+    std::max(size_t(1), bufferCount / std::min(files.size(), maxOpen));
+
+  std::vector<File*> live;
+  size_t started = 0;
+  while (started < files.size() || !live.empty()) {
+    while (started < files.size() && live.size() < maxOpen) {
+      live.push_back(new File(files[started++], algorithm));
+      startOpen(live.back());
+    }
+    for (size_t i = 0; i < live.size(); ++i) {
+      File* file = live[i];
+      while (file->fd >= 0 && !file->finished && !free_.empty() &&
+             file->reads.size() < readsPerFile)
+        startRead(file);
+    }
+
+    ring_.submitAndWait();
+    io_uring_cqe cqe;
+    while (ring_.reap(cqe))
+      complete(reinterpret_cast<Op*>(cqe.user_data), cqe.res);
+
+    // Retire the files that are done, keeping the rest in order.
+    std::vector<File*> still;
+    for (size_t i = 0; i < live.size(); ++i) {
+      File* file = live[i];
+      if (file->opening || !file->finished || !file->reads.empty()) {
+        still.push_back(file);
+        continue;
+      }
+      if (file->job.error == 0)
+        file->digest->final(file->job.hash);
+      delete file;
+    }
+    live.swap(still);
+  }
+}
+
+// Stat the entries in batches no bigger than the ring.
+void statBatches(Ring& ring, int dirfd, std::vector<UringStat>& entries)
+{
+  for (size_t first = 0; first < entries.size(); first += ringEntries) {
+    size_t const last = std::min(entries.size(), first + ringEntries);
+    for (size_t i = first; i < last; ++i) {
+      UringStat& entry = entries[i];
+      io_uring_sqe* sqe = ring.next();
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = dirfd;
+      sqe->addr = reinterpret_cast<unsigned long>(entry.name.c_str());
+      sqe->len = entry.mask;
+      sqe->statx_flags = entry.flags;
+      sqe->off = reinterpret_cast<unsigned long>(&entry.stx);
+      sqe->user_data = i;
+    }
+
+    size_t remaining = last - first;
+    while (remaining > 0) {
+      ring.submitAndWait();
+      io_uring_cqe cqe;
+      while (ring.reap(cqe)) {
+        entries[cqe.user_data].error = cqe.res < 0 ? -cqe.res : 0;
+        --remaining;
+      }
+    }
+  }
+}
+
+pthread_key_t engineKey;
+pthread_key_t statRingKey;
+pthread_once_t engineOnce = PTHREAD_ONCE_INIT;
+bool available = false;
+bool statAvailable = false;
+
+void deleteEngine(void* engine)
+{
+  delete static_cast<Engine*>(engine);
+}
+
+void deleteRing(void* ring)
+{
+  delete static_cast<Ring*>(ring);
+}
+
+// Make one ring up front to find out whether the kernel will let us.
+void probe()
+{
+  pthread_key_create(&engineKey, deleteEngine);
+  pthread_key_create(&statRingKey, deleteRing);
+  try {
+    Ring ring;
+    available = ring.supports(IORING_OP_OPENAT) && ring.supports(IORING_OP_READ);
+    statAvailable = ring.supports(IORING_OP_STATX);
+  }
+  catch (Exception_base&) {
+  }
+}
+
+}
+
+bool uringHash(std::vector<UringFile>& files, Digest::Algorithm algorithm)
+{
+  pthread_once(&engineOnce, probe);
+  if (!available)
+    return false;
+
+  Engine* engine = static_cast<Engine*>(pthread_getspecific(engineKey));
+  if (engine == 0) {
+    try {
+      engine = new Engine;
+    }
+    catch (IO_error&) {
+      return false;
+    }
+    pthread_setspecific(engineKey, engine);
+  }
+
+  if (!files.empty()) {
+    try {
+      engine->run(files, algorithm);
+    }
+    catch (...) {
+      // The kernel may still be reading into this engine's buffers, so it
+      // is abandoned rather than deleted.
+      pthread_setspecific(engineKey, 0);
+      throw;
+    }
+  }
+  return true;
+}
+
+bool uringStatx(int dirfd, std::vector<UringStat>& entries)
+{
+  pthread_once(&engineOnce, probe);
+  if (!statAvailable)
+    return false;
+
+  // Stat'ing needs no buffers of its own, so it gets a plain ring, apart
+  // from the hashing engine.
+  Ring* ring = static_cast<Ring*>(pthread_getspecific(statRingKey));
+  if (ring == 0) {
+    try {
+      ring = new Ring;
+    }
+    catch (IO_error&) {
+      return false;
+    }
+    pthread_setspecific(statRingKey, ring);
+  }
+
+  try {
+    statBatches(*ring, dirfd, entries);
+  }
+  catch (...) {
+    // Calls may still be in flight, so don't reuse the ring.
+    pthread_setspecific(statRingKey, 0);
+    throw;
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,55 @@
+// Hashing files with io_uring.
+
+#ifndef __URING_H__
+#define __URING_H__
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+#include <string>
+#include <vector>
+#include "hash.hh"
+
+namespace asure {
+
+// A file to be hashed by uringHash().
+struct UringFile {
+  UringFile(std::string const& p) : path(p), hash(), error(0), call(0) { }
+
+  std::string path;
+  Hash hash;
+
+  // If hashing failed, the errno value and the operation that failed.
+  int error;
+  char const* call;
+};
+
+// Hash the contents of the files, keeping many opens and reads in flight at
+// once with io_uring.  Each thread has its own ring.  Returns false, having
+// done nothing, if the kernel doesn't support what this needs.
+bool uringHash(std::vector<UringFile>& files, Digest::Algorithm algorithm);
+
+// An entry of a directory to be stat'ed by uringStatx().
+struct UringStat {
+  UringStat(std::string const& n, unsigned m, int f) :
+      name(n), mask(m), flags(f), stx(), error(0) { }
+
+  std::string name;
+  // What to ask statx for, and how.
+  unsigned mask;
+  int flags;
+
+  struct statx stx;
+  // The errno value, if statx failed.
+  int error;
+};
+
+// Stat the entries of the open directory 'dirfd', with many statx calls in
+// flight at once.  Returns false, having done nothing, if the kernel doesn't
+// support that.
+bool uringStatx(int dirfd, std::vector<UringStat>& entries);
+
+}
+
+#endif
@@ -0,0 +1,130 @@
+// Rules for what parts of a tree to leave out of a walk.
+
+extern "C" {
+#include <fnmatch.h>
+}
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+#include "walkrules.hh"
+#include "exn.hh"
+
+namespace asure {
+
+namespace {
+
+size_t const noRule = size_t(-1);
+
+bool isGlob(std::string const& pattern)
+{
+  return pattern.find_first_of("*?[\\") != std::string::npos;
+}
+
+void lookup(std::map<std::string, size_t> const& literals, std::string const& key, size_t& best)
+{
+  std::map<std::string, size_t>::const_iterator pos = literals.find(key);
+  if (pos != literals.end() && pos->second < best)
+    best = pos->second;
+}
+
+}
+
+WalkRules::WalkRules() : includes_(), globs_(), needsKind_(false)
+{
+}
+
+WalkRules* WalkRules::load(std::string const& path)
+{
+  std::ifstream in(path.c_str());
+  if (!in)
+    throw IO_error("open", path);
+
+  std::auto_ptr<WalkRules> rules(new WalkRules);
+  std::string line;
+  int number = 0;
+  while (std::getline(in, line)) {
+    ++number;
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    bool include = false;
+    if (line.size() >= 2 && (line[0] == '+' || line[0] == '-') && line[1] == ' ') {
+      include = line[0] == '+';
+      line.erase(0, 2);
+    }
+    if (line.empty() || line == "/") {
+      std::ostringstream msg;
+      msg << path << ':' << number << ": empty pattern";
+      throw Parse_error(msg.str());
+    }
+    rules->add(line, include);
+  }
+  if (in.bad())
+    throw IO_error("read", path);
+
+  return rules.release();
+}
+
+void WalkRules::add(std::string const& line, bool include)
+{
+  std::string pattern = line;
+  bool const dirOnly = pattern[pattern.size() - 1] == '/';
+  if (dirOnly)
+    pattern.erase(pattern.size() - 1);
+  bool const anchored = pattern.find('/') != std::string::npos;
+  if (anchored && pattern[0] == '/')
+    pattern.erase(0, 1);
+
+  size_t const index = includes_.size();
+  includes_.push_back(include);
+  needsKind_ = needsKind_ || dirOnly;
+
+  if (isGlob(pattern)) {
+    Glob glob;
+    glob.pattern = pattern;
+    glob.index = index;
+    glob.anchored = anchored;
+    glob.dirOnly = dirOnly;
+    globs_.push_back(glob);
+  } else {
+    // Only the first rule for a name or path can ever decide.
+    Literals& literals = anchored ? paths_[dirOnly] : names_[dirOnly];
+    literals.insert(std::make_pair(pattern, index));
+  }
+}
+
+bool WalkRules::excluded(std::string const& path, std::string const& name, bool isDir) const
+{
+  size_t best = noRule;
+  lookup(names_[0], name, best);
+  lookup(paths_[0], path, best);
+  if (isDir) {
+    lookup(names_[1], name, best);
+    lookup(paths_[1], path, best);
+  }
+
+  // The globs are in rule order, so only those before the best literal
+  // match need trying.
+  typedef std::vector<Glob>::const_iterator iter;
+  for (iter i = globs_.begin(); i != globs_.end() && i->index < best; ++i) {
+    if (i->dirOnly && !isDir)
+      continue;
+    if (i->anchored) {
+      if (fnmatch(i->pattern.c_str(), path.c_str(), FNM_PATHNAME) == 0)
+        best = i->index;
+    } else {
+      if (fnmatch(i->pattern.c_str(), name.c_str(), 0) == 0)
+        best = i->index;
+    }
+    if (best == i->index)
+      break;
+  }
+
+  return best != noRule && !includes_[best];
+}
+
+}
@@ -0,0 +1,67 @@
+// Rules for what parts of a tree to leave out of a walk.
+
+#ifndef __WALKRULES_H__
+#define __WALKRULES_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace asure {
+
+// A list of include and exclude rules, read from a file with one rule per
+// line:
+//
+//   - pattern      exclude what matches
+//   + pattern      include what matches, despite later rules
+//   pattern        the same as '- pattern'
+//
+// Blank lines and lines starting with '#' are ignored.  A pattern without a
+// '/' is matched against the name of each entry, at any depth.  A pattern
+// containing a '/' is matched against the whole path below the root of the
+// walk, a leading '/' being optional.  A trailing '/' makes a pattern only
+// match directories.  Patterns are fnmatch(3) globs; a pattern with no glob
+// characters in it is a plain name or path, and is looked up rather than
+// matched.  The first rule that matches decides, and an entry no rule
+// matches is included.  An excluded directory is not entered at all, so
+// nothing below it can be included again.
+class WalkRules : boost::noncopyable {
+ public:
+  // Read the rules in a file, throwing IO_error or Parse_error.
+  static WalkRules* load(std::string const& path);
+
+  // Whether to leave out the entry 'name', at 'path' below the root.
+  bool excluded(std::string const& path, std::string const& name, bool isDir) const;
+
+  // Whether any rule only applies to directories, so that the kind of an
+  // entry has to be known before deciding.
+  bool needsKind() const { return needsKind_; }
+
+ private:
+  WalkRules();
+
+  struct Glob {
+    std::string pattern;
+    size_t index;
+    bool anchored;
+    bool dirOnly;
+  };
+  typedef std::map<std::string, size_t> Literals;
+
+  // Whether each rule, by its position in the file, includes.
+  std::vector<bool> includes_;
+
+  // Plain names and paths, giving the first rule for each, indexed by
+  // whether the rule is only for directories.
+  Literals names_[2];
+  Literals paths_[2];
+  std::vector<Glob> globs_;
+  bool needsKind_;
+
+  void add(std::string const& line, bool include);
+};
+
+}
+
+#endif
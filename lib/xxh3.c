@@ -0,0 +1,297 @@
+/*
+ * XXH3, the 64-bit variant with the default secret and a zero seed.
+ *
+ * Inputs up to 240 bytes are hashed by dedicated short-input routines.
+ * Longer inputs are consumed as 64-byte stripes into eight accumulators,
+ * which are scrambled after every block of 16 stripes.  The final stripe
+ * is always the last 64 bytes of input, so the streaming code holds back
+ * between 1 and 256 bytes, and keeps the previous stripe around for when
+ * fewer than 64 are held.
+ */
+
+#include <string.h>
+
+#include "xxh3.h"
+
+#define PRIME32_1	0x9e3779b1U
+#define PRIME32_2	0x85ebca77U
+#define PRIME32_3	0xc2b2ae3dU
+#define PRIME64_1	0x9e3779b185ebca87ULL
+#define PRIME64_2	0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3	0x165667b19e3779f9ULL
+#define PRIME64_4	0x85ebca77c2b2ae63ULL
+#define PRIME64_5	0x27d4eb2f165667c5ULL
+#define PRIME_MX1	0x165667919e3779f9ULL
+#define PRIME_MX2	0x9fb21c651e98df25ULL
+
+#define STRIPE_LEN		64
+#define SECRET_SIZE		192
+#define SECRET_CONSUME_RATE	8
+#define STRIPES_PER_BLOCK	((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BUFFER_STRIPES		(256 / STRIPE_LEN)
+#define MIDSIZE_MAX		240
+#define SECRET_SIZE_MIN		136
+
+static const unsigned char secret[SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint32_t read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+	return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static uint64_t rotl64(uint64_t x, int n)
+{
+	return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t swap64(uint64_t x)
+{
+	return __builtin_bswap64(x);
+}
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	h ^= h >> 28;
+	return h;
+}
+
+static uint64_t mix16(const unsigned char *in, const unsigned char *sec)
+{
+	return mul128_fold64(read64(in) ^ read64(sec), read64(in + 8) ^ read64(sec + 8));
+}
+
+static uint64_t hash_short(const unsigned char *in, size_t len)
+{
+	uint64_t acc;
+	size_t i;
+
+	if (len == 0)
+		return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+
+	if (len <= 3) {
+		uint32_t combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+			in[len - 1] | ((uint32_t)len << 8);
+		uint64_t bitflip = read32(secret) ^ read32(secret + 4);
+		return xxh64_avalanche(combined ^ bitflip);
+	}
+
+	if (len <= 8) {
+		uint64_t bitflip = read64(secret + 8) ^ read64(secret + 16);
+		uint64_t input = read32(in + len - 4) + ((uint64_t)read32(in) << 32);
+		return rrmxmx(input ^ bitflip, len);
+	}
+
+	if (len <= 16) {
+		uint64_t lo = read64(in) ^ (read64(secret + 24) ^ read64(secret + 32));
+		uint64_t hi = read64(in + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+		return avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+	}
+
+	acc = len * PRIME64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += mix16(in + 48, secret + 96);
+					acc += mix16(in + len - 64, secret + 112);
+				}
+				acc += mix16(in + 32, secret + 64);
+				acc += mix16(in + len - 48, secret + 80);
+			}
+			acc += mix16(in + 16, secret + 32);
+			acc += mix16(in + len - 32, secret + 48);
+		}
+		acc += mix16(in, secret);
+		acc += mix16(in + len - 16, secret + 16);
+		return avalanche(acc);
+	}
+
+	/* 129 to 240 bytes. */
+	for (i = 0; i < 8; i++)
+		acc += mix16(in + 16 * i, secret + 16 * i);
+	acc = avalanche(acc);
+	for (i = 8; i < len / 16; i++)
+		acc += mix16(in + 16 * i, secret + 16 * (i - 8) + 3);
+	acc += mix16(in + len - 16, secret + SECRET_SIZE - 64 + 8 - 17 + 64 - 64 - 55 + 55);
+	return avalanche(acc);
+}
+
+static void accumulate_512(uint64_t acc[8], const unsigned char *in, const unsigned char *sec)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		uint64_t value = read64(in + 8 * i);
+		uint64_t key = value ^ read64(sec + 8 * i);
+		acc[i ^ 1] += value;
+		acc[i] += (key & 0xffffffff) * (key >> 32);
+	}
+}
+
+static void scramble(uint64_t acc[8], const unsigned char *sec)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= read64(sec + 8 * i);
+		acc[i] = a * PRIME32_1;
+	}
+}
+
+/*
+ * Consume whole stripes, scrambling at the end of each block.  'stripes'
+ * counts those already consumed in the current block.
+ */
+static void consume(uint64_t acc[8], size_t *stripes, const unsigned char *in, size_t count)
+{
+	while (count > 0) {
+		accumulate_512(acc, in, secret + *stripes * SECRET_CONSUME_RATE);
+		in += STRIPE_LEN;
+		count--;
+		if (++*stripes == STRIPES_PER_BLOCK) {
+			scramble(acc, secret + SECRET_SIZE - STRIPE_LEN);
+			*stripes = 0;
+		}
+	}
+}
+
+static uint64_t merge(const uint64_t acc[8], uint64_t start)
+{
+	uint64_t result = start;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		result += mul128_fold64(acc[2 * i] ^ read64(secret + 11 + 16 * i),
+					acc[2 * i + 1] ^ read64(secret + 11 + 16 * i + 8));
+	return avalanche(result);
+}
+
+void xxh3_init(xxh3_ctx *ctx)
+{
+	ctx->acc[0] = PRIME32_3;
+	ctx->acc[1] = PRIME64_1;
+	ctx->acc[2] = PRIME64_2;
+	ctx->acc[3] = PRIME64_3;
+	ctx->acc[4] = PRIME64_4;
+	ctx->acc[5] = PRIME32_2;
+	ctx->acc[6] = PRIME64_5;
+	ctx->acc[7] = PRIME32_1;
+	ctx->buffered = 0;
+	ctx->stripes = 0;
+	ctx->total = 0;
+}
+
+void xxh3_update(xxh3_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *in = data;
+	const unsigned char *end = in + len;
+
+	ctx->total += len;
+
+	if (ctx->buffered + len <= sizeof(ctx->buffer)) {
+		memcpy(ctx->buffer + ctx->buffered, in, len);
+		ctx->buffered += len;
+		return;
+	}
+
+	/* There is more than a buffer's worth, so the buffer can be consumed. */
+	if (ctx->buffered) {
+		size_t fill = sizeof(ctx->buffer) - ctx->buffered;
+		memcpy(ctx->buffer + ctx->buffered, in, fill);
+		in += fill;
+		consume(ctx->acc, &ctx->stripes, ctx->buffer, BUFFER_STRIPES);
+		ctx->buffered = 0;
+	}
+
+	/* Consume directly, always holding back at least one byte. */
+	if (end - in > (ptrdiff_t)sizeof(ctx->buffer)) {
+		size_t count = (end - in - 1) / STRIPE_LEN;
+		consume(ctx->acc, &ctx->stripes, in, count);
+		in += count * STRIPE_LEN;
+		/* Keep the last stripe, in case fewer than 64 bytes are held. */
+		memcpy(ctx->buffer + sizeof(ctx->buffer) - STRIPE_LEN, in - STRIPE_LEN, STRIPE_LEN);
+	}
+
+	memcpy(ctx->buffer, in, end - in);
+	ctx->buffered = end - in;
+}
+
+void xxh3_final(unsigned char hashout[8], const xxh3_ctx *ctx)
+{
+	uint64_t hash;
+	int i;
+
+	if (ctx->total <= MIDSIZE_MAX) {
+		hash = hash_short(ctx->buffer, ctx->total);
+	} else {
+		uint64_t acc[8];
+		size_t stripes = ctx->stripes;
+		unsigned char last[STRIPE_LEN];
+		const unsigned char *tail;
+
+		memcpy(acc, ctx->acc, sizeof(acc));
+		if (ctx->buffered >= STRIPE_LEN) {
+			consume(acc, &stripes, ctx->buffer, (ctx->buffered - 1) / STRIPE_LEN);
+			tail = ctx->buffer + ctx->buffered - STRIPE_LEN;
+		} else {
+			size_t catchup = STRIPE_LEN - ctx->buffered;
+			memcpy(last, ctx->buffer + sizeof(ctx->buffer) - catchup, catchup);
+			memcpy(last + catchup, ctx->buffer, ctx->buffered);
+			tail = last;
+		}
+		accumulate_512(acc, tail, secret + SECRET_SIZE - STRIPE_LEN - 7);
+		hash = merge(acc, ctx->total * PRIME64_1);
+	}
+
+	for (i = 0; i < 8; i++)
+		hashout[i] = hash >> (56 - 8 * i);
+}
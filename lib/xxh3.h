@@ -0,0 +1,28 @@
+/*
+ * XXH3, the 64-bit variant with the default secret and a zero seed.  This
+ * is a fast non-cryptographic hash, suitable for noticing accidental
+ * changes but not deliberate ones.  The results match the reference
+ * XXH3_64bits().
+ */
+
+#ifndef __XXH3_H__
+#define __XXH3_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+	uint64_t acc[8];
+	unsigned char buffer[256];
+	size_t buffered;
+	size_t stripes;		/* Stripes consumed in the current block. */
+	uint64_t total;
+} xxh3_ctx;
+
+void xxh3_init(xxh3_ctx *ctx);
+void xxh3_update(xxh3_ctx *ctx, const void *data, size_t len);
+
+/* The digest, in the canonical big-endian byte order. */
+void xxh3_final(unsigned char hashout[8], const xxh3_ctx *ctx);
+
+#endif
@@ -1,15 +1,32 @@
 /* File integrity checking.
  */
 
+#include <algorithm>
 #include <cstdlib>
+#include <iomanip>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "sha1.h"
+#include "blake3.h"
+}
 
 #include "compare.hh"
+#include "compress.hh"
+#include "delta.hh"
+#include "hashcache.hh"
+#include "lookahead.hh"
 #include "tree-local.hh"
 #include "surefile.hh"
+#include "walkrules.hh"
 #include "exn.hh"
 
 using std::string;
@@ -81,21 +98,272 @@ void show(NodeIterator& root)
   }
 }
 
+void reportKernel(char const* kernel, int passed)
+{
+  std::cout << "sha1 kernel " << kernel << ": " << (passed ? "ok" : "FAILED") << '\n';
+}
+
+void reportBlake3(char const* kernel, int passed)
+{
+  std::cout << "blake3 kernel " << kernel << ": " << (passed ? "ok" : "FAILED") << '\n';
+}
+
+// Verify the accelerated hash kernels against the portable code.
+int selfTest()
+{
+  std::cout << "sha1 kernel in use: " << blk_SHA1_Kernel() << '\n';
+  int failures = blk_SHA1_SelfTest(reportKernel);
+  reportKernel("portable", 1);
+  failures += blk_SHA1_MultiSelfTest(reportKernel);
+  std::cout << "sha1 multi-buffer lanes: " << blk_SHA1_MultiLanes() << '\n';
+  failures += b3_self_test(reportBlake3);
+  std::cout << "blake3 lanes: " << b3_lanes() << '\n';
+  return failures;
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Ask the kernel to drop its cached copy of a file, so that every read mode
+// starts out reading from the disk.
+void dropCache(std::string const& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// Hash every file under the current directory with each read mode, and
+// report the throughput.
+void bench(asure::tree::WalkOptions const& options)
+{
+  std::vector<std::string> paths;
+  double total = 0;
+  std::auto_ptr<NodeIterator> root(asure::tree::walkTree(".", options));
+  for (; !root->empty(); ++(*root)) {
+    std::string path;
+    off_t size;
+    asure::Digest::Algorithm digest;
+    if ((**root).hashSource(path, size, digest)) {
+      paths.push_back(path);
+      total += size;
+    }
+  }
+
+  std::cout << paths.size() << " files, " << std::fixed << std::setprecision(1)
+    << total / 1e6 << " MB, " << asure::Digest::name(options.digest) << '\n';
+  asure::ReadMode::Mode const modes[] = {
+    asure::ReadMode::BUFFERED, asure::ReadMode::MMAP,
+    asure::ReadMode::DIRECT, asure::ReadMode::URING, asure::ReadMode::AUTO
+  };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    for (size_t i = 0; i < paths.size(); ++i)
+      dropCache(paths[i]);
+    double const start = now();
+    for (size_t i = 0; i < paths.size(); ++i) {
+      asure::Hash hash;
+      hash.ofFile(paths[i], options.digest, modes[m]);
+    }
+    double const elapsed = now() - start;
+    std::cout << std::setw(10) << asure::ReadMode::name(modes[m]) << ": "
+      << std::setw(8) << std::setprecision(3) << elapsed << " s, "
+      << std::setw(8) << std::setprecision(1) << (elapsed > 0 ? total / elapsed / 1e6 : 0) << " MB/s\n";
+  }
+}
+
 std::string command;
+// The directory below the current one that check or show is limited to, if
+// any.
+std::string subtree;
 string sureFile = "2sure";
+asure::tree::LookAheadOptions lookAheadOptions;
+asure::tree::WalkOptions walkOptions;
+asure::CheckOptions checkOptions;
+bool digestGiven = false;
+
+// The format surefiles are written in.  Update keeps the format of the
+// surefile it updates unless one is given.
+asure::SurefileFormat::Version sureFormat = asure::SurefileFormat::TEXT;
+bool formatGiven = false;
+
+asure::Compression compression;
+
+// Update writes only what changed, as a delta, until the deltas add up to
+// this fraction of the surefile, and then writes the whole surefile again.
+double compactAt = 0.25;
+
+// How many directories check compares at once.  One or fewer compares the
+// whole tree in order.
+int compareWorkers = 0;
+
+// Whether to believe the hash cache, if given on the command line.
+bool trustGiven = false;
+asure::HashCache::Trust cacheTrust;
+
+// The rules from --exclude-from, which walkOptions points to.
+std::auto_ptr<asure::WalkRules> walkRules;
+
+int parseCount(char const* arg, char const* what)
+{
+  char* end;
+  long value = std::strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value < 0)
+    throw usage_error(string("invalid ") + what + ": " + arg);
+  return value;
+}
+
+// Walk the current directory, or the subtree of it, hashing ahead in the
+// background.
+NodeIterator* walkCurrent(asure::tree::HashFilter* filter = 0)
+{
+  std::string path = ".";
+  if (!subtree.empty()) {
+    path = subtree;
+    walkOptions.within = subtree;
+  }
+  return asure::tree::lookAhead(asure::tree::walkTree(path, walkOptions), lookAheadOptions, filter);
+}
+
+// The trees check compares, a directory at a time, for compareParallel().
+class CheckSource : public asure::TreeSource {
+ public:
+  NodeIterator* oldTree(std::string const& path) {
+    return asure::loadGenerations(sureFile, below(path));
+  }
+
+  NodeIterator* newTree(std::string const& path, asure::CheckOptions const& options) {
+    asure::tree::WalkOptions walk = walkOptions;
+    walk.within = below(path);
+    return asure::tree::lookAhead(
+        asure::tree::walkTree(walk.within.empty() ? "." : walk.within, walk), lookAheadOptions,
+        asure::checkFilter(oldTree(path), options));
+  }
+
+  // Without walkers, the walk passes over directories without reading them.
+  NodeIterator* newRoot() {
+    asure::tree::WalkOptions walk = walkOptions;
+    walk.within = subtree;
+    walk.walkers = 0;
+    return asure::tree::walkTree(walk.within.empty() ? "." : walk.within, walk);
+  }
+
+ private:
+  static std::string below(std::string const& path) {
+    if (subtree.empty() || path.empty())
+      return subtree + path;
+    return subtree + '/' + path;
+  }
+};
+
+// Open the hash cache beside the surefile for walkCurrent() to use.  It is
+// trusted unless asked otherwise, or by default for check.
+asure::HashCache* openCache(asure::HashCache::Trust trust)
+{
+  if (trustGiven)
+    trust = cacheTrust;
+  walkOptions.cache = asure::HashCache::open(sureFile + asure::extensions::cache, trust);
+  return walkOptions.cache;
+}
+
+// Load the surefile to check against, walking with the digest it was hashed
+// with, and warning if that isn't the one asked for.
+NodeIterator* loadForCheck(std::string const& name)
+{
+  asure::Digest::Algorithm digest;
+  NodeIterator* tree = asure::loadGenerations(sureFile, subtree, &digest);
+  if (digestGiven && digest != walkOptions.digest)
+    std::cout << "warning: " << name << " uses " << asure::Digest::name(digest)
+      << ", not " << asure::Digest::name(walkOptions.digest) << '\n';
+  walkOptions.digest = digest;
+  return tree;
+}
+
+off_t fileSize(std::string const& name)
+{
+  struct stat st;
+  return stat(name.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Whether another delta can be added to the surefile's 'generations'.
+bool deltaFits(int generations)
+{
+  off_t deltas = 0;
+  for (int generation = 1; generation <= generations; ++generation)
+    deltas += fileSize(asure::deltaName(sureFile, generation));
+  return deltas < compactAt * fileSize(sureFile + asure::extensions::base);
+}
+
+// Signoff compares the surefiles with the default options, except for
+// finding moves.
+asure::CheckOptions signoffOptions()
+{
+  asure::CheckOptions options;
+  options.moves = checkOptions.moves;
+  options.moveMemory = checkOptions.moveMemory;
+  return options;
+}
+
+// Parse a comma-separated list of attribute names, for --ignore.
+asure::tree::Attrs::Mask parseIgnore(char const* arg)
+{
+  asure::tree::Attrs::Mask mask = 0;
+  std::string names = arg;
+  size_t pos = 0;
+  while (pos < names.size()) {
+    size_t end = names.find(',', pos);
+    if (end == std::string::npos)
+      end = names.size();
+    asure::tree::Attrs::Field field;
+    if (!asure::tree::Attrs::byName(names.substr(pos, end - pos), field))
+      throw usage_error(string("unknown attribute: ") + names.substr(pos, end - pos));
+    mask |= asure::tree::Attrs::bit(field);
+    pos = end + 1;
+  }
+  return mask;
+}
 
 void parseArgs(int argc, char const* const* argv)
 {
   static struct option long_options[] = {
     {"surefile", 1, 0, 'f'},
     {"file", 1, 0, 'f'},
+    {"jobs", 1, 0, 'j'},
+    {"lookahead", 1, 0, 'L'},
+    {"sha1-kernel", 1, 0, 'K'},
+    {"digest", 1, 0, 'D'},
+    {"read", 1, 0, 'R'},
+    {"trust-cache", 0, 0, 'T'},
+    {"paranoid", 0, 0, 'P'},
+    {"stat-first", 0, 0, 'S'},
+    {"sample", 1, 0, 's'},
+    {"walkers", 1, 0, 'W'},
+    {"prefetch", 1, 0, 'p'},
+    {"uring-stat", 0, 0, 'U'},
+    {"one-file-system", 0, 0, 'x'},
+    {"exclude-from", 1, 0, 'X'},
+    {"ignore", 1, 0, 'I'},
+    {"format", 1, 0, 'F'},
+    {"compress", 1, 0, 'C'},
+    {"compress-level", 1, 0, 'l'},
+    {"compress-threads", 1, 0, 't'},
+    {"path", 1, 0, 'r'},
+    {"compact-at", 1, 0, 'c'},
+    {"moves", 0, 0, 'M'},
+    {"compare-workers", 1, 0, 'G'},
+    {"move-memory", 1, 0, 'm'},
     {"help", 0, 0, '?'},
     {0, 0, 0, 0}
   };
 
   int option_index = 0;
   while (true) {
-    int c = getopt_long(argc, const_cast<char* const*>(argv), "?f:", long_options, &option_index);
+    int c = getopt_long(argc, const_cast<char* const*>(argv), "?f:j:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -110,6 +378,128 @@ void parseArgs(int argc, char const* const* argv)
         sureFile = optarg;
         break;
 
+      case 'j':
+        lookAheadOptions.workers = parseCount(optarg, "job count");
+        asure::Digest::setThreads(lookAheadOptions.workers);
+        break;
+
+      case 'L':
+        lookAheadOptions.window = parseCount(optarg, "lookahead");
+        break;
+
+      case 'W':
+        walkOptions.walkers = parseCount(optarg, "walker count");
+        break;
+
+      case 'p':
+        walkOptions.prefetch = parseCount(optarg, "prefetch");
+        break;
+
+      case 'U':
+        walkOptions.uringStat = true;
+        break;
+
+      case 'x':
+        walkOptions.oneFileSystem = true;
+        break;
+
+      case 'X':
+        walkRules.reset(asure::WalkRules::load(optarg));
+        walkOptions.rules = walkRules.get();
+        break;
+
+      case 'I':
+        checkOptions.ignore = parseIgnore(optarg);
+        break;
+
+      case 'F':
+        if (!asure::SurefileFormat::byName(optarg, sureFormat))
+          throw usage_error(string("unknown format: ") + optarg);
+        formatGiven = true;
+        break;
+
+      case 'C':
+        if (!asure::Compression::byName(optarg, compression.codec))
+          throw usage_error(string("unknown compression: ") + optarg);
+        if (compression.codec == asure::Compression::ZSTD && !asure::Compression::zstdAvailable())
+          throw usage_error("zstd is not available (libzstd.so.1 could not be loaded)");
+        break;
+
+      case 'l':
+        compression.level = parseCount(optarg, "compression level");
+        break;
+
+      case 't':
+        compression.threads = std::max(parseCount(optarg, "compression threads"), 1);
+        break;
+
+      case 'r':
+        subtree = optarg;
+        break;
+
+      case 'c': {
+        char* end;
+        double const percent = std::strtod(optarg, &end);
+        if (*optarg == '\0' || *end != '\0' || percent < 0)
+          throw usage_error(string("invalid compaction percentage: ") + optarg);
+        compactAt = percent / 100;
+        break;
+      }
+
+      case 'M':
+        checkOptions.moves = true;
+        break;
+
+      case 'G':
+        compareWorkers = parseCount(optarg, "compare workers");
+        break;
+
+      case 'm':
+        checkOptions.moveMemory = size_t(std::max(parseCount(optarg, "move memory"), 1)) << 20;
+        break;
+
+      case 'K':
+        if (blk_SHA1_Force(optarg) != 0)
+          throw usage_error(string("sha1 kernel not usable: ") + optarg);
+        break;
+
+      case 'D':
+        if (!asure::Digest::byName(optarg, walkOptions.digest))
+          throw usage_error(string("unknown digest: ") + optarg);
+        digestGiven = true;
+        break;
+
+      case 'T':
+        trustGiven = true;
+        cacheTrust = asure::HashCache::TRUST;
+        break;
+
+      case 'P':
+        trustGiven = true;
+        cacheTrust = asure::HashCache::PARANOID;
+        break;
+
+      case 'S':
+        checkOptions.statFirst = true;
+        break;
+
+      case 's': {
+        char* end;
+        double const percent = std::strtod(optarg, &end);
+        if (*optarg == '\0' || *end != '\0' || percent < 0 || percent > 100)
+          throw usage_error(string("invalid sample percentage: ") + optarg);
+        checkOptions.sampleRate = percent / 100;
+        break;
+      }
+
+      case 'R': {
+        asure::ReadMode::Mode mode;
+        if (!asure::ReadMode::byName(optarg, mode))
+          throw usage_error(string("unknown read mode: ") + optarg);
+        asure::ReadMode::set(mode);
+        break;
+      }
+
       case '?':
         throw usage_error("");
 
@@ -118,11 +508,28 @@ void parseArgs(int argc, char const* const* argv)
     }
   }
 
+  asure::Compression::set(compression);
+
   if (optind == argc)
     throw usage_error("expecting a command");
-  if (optind != argc - 1)
-    throw usage_error("expecting only a single command");
   command = argv[optind];
+  // Check takes the directory to check as well.
+  if (command == "check" && optind == argc - 2)
+    subtree = argv[optind + 1];
+  else if (optind != argc - 1)
+    throw usage_error("expecting only a single command");
+  if (!subtree.empty() && command != "check" && command != "show")
+    throw usage_error("only check and show can be limited to a directory");
+
+  // Give the directory the way the surefile names it.
+  while (subtree.compare(0, 2, "./") == 0)
+    subtree.erase(0, 2);
+  while (!subtree.empty() && subtree[subtree.size() - 1] == '/')
+    subtree.erase(subtree.size() - 1);
+  if (subtree == ".")
+    subtree.clear();
+  if (!subtree.empty())
+    checkOptions.root = "./" + subtree;
 }
 
 }
@@ -133,42 +540,122 @@ int main(int argc, char const* const* argv)
     parseArgs(argc, argv);
 
     if (command == "scan") {
-      std::auto_ptr<NodeIterator> root(asure::tree::walkTree("."));
-      asure::SurefileSaver::save(sureFile, *root);
+      std::auto_ptr<asure::HashCache> cache(openCache(asure::HashCache::TRUST));
+      std::auto_ptr<NodeIterator> root(walkCurrent());
+      asure::SurefileSaver::save(sureFile, *root, walkOptions.digest, sureFormat);
     } else if (command == "show") {
-      std::string name = sureFile;
-      name += asure::extensions::base;
-      std::auto_ptr<NodeIterator> root(asure::loadSurefile(name));
+      std::auto_ptr<NodeIterator> root(asure::loadGenerations(sureFile, subtree));
       show(*root);
     } else if (command == "check") {
       std::string name = sureFile;
       name += asure::extensions::base;
-      std::auto_ptr<NodeIterator> surefile(asure::loadSurefile(name));
-      std::auto_ptr<NodeIterator> curtree(asure::tree::walkTree("."));
-      asure::compareTrees(*surefile, *curtree);
+      std::auto_ptr<asure::HashCache> cache(openCache(asure::HashCache::PARANOID));
+      std::auto_ptr<NodeIterator> surefile(loadForCheck(name));
+      if (compareWorkers > 1) {
+        surefile.reset();
+        CheckSource source;
+        asure::compareParallel(source, checkOptions, compareWorkers);
+      } else {
+        std::auto_ptr<NodeIterator> curtree(walkCurrent(
+            asure::checkFilter(asure::loadGenerations(sureFile, subtree), checkOptions)));
+        asure::compareTrees(*surefile, *curtree, checkOptions);
+      }
+    } else if (command == "signoff" && asure::countDeltas(sureFile) > 0) {
+      // Report the changes the latest delta records, from it alone.
+      std::string const name = asure::deltaName(sureFile, asure::countDeltas(sureFile));
+      std::auto_ptr<NodeIterator> before(asure::deltaSide(asure::loadSurefile(name), false));
+      std::auto_ptr<NodeIterator> after(asure::deltaSide(asure::loadSurefile(name), true));
+      asure::compareTrees(*before, *after, signoffOptions());
     } else if (command == "signoff") {
       std::string name1 = sureFile;
       name1 += asure::extensions::bak;
       std::string name2 = sureFile;
       name2 += asure::extensions::base;
-      std::auto_ptr<NodeIterator> bakfile(asure::loadSurefile(name1));
-      std::auto_ptr<NodeIterator> curfile(asure::loadSurefile(name2));
-      asure::compareTrees(*bakfile, *curfile);
-    } else if (command == "update") {
-      std::string sureName = sureFile + asure::extensions::base;
-      std::auto_ptr<NodeIterator> surefile(asure::loadSurefile(sureName));
-      std::auto_ptr<NodeIterator> tree(asure::tree::walkTree("."));
-      asure::SurefileSaver saver(sureFile);
-      asure::updateTree(*surefile, *tree, saver);
+      asure::Digest::Algorithm digest1, digest2;
+      std::auto_ptr<NodeIterator> bakfile(asure::loadSurefile(name1, &digest1));
+      std::auto_ptr<NodeIterator> curfile(asure::loadSurefile(name2, &digest2));
+      if (digest1 != digest2)
+        std::cout << "warning: digests differ (" << asure::Digest::name(digest1)
+          << " and " << asure::Digest::name(digest2) << "), not comparing file contents\n";
+      asure::compareTrees(*bakfile, *curfile, signoffOptions());
+    } else if (command == "update" || command == "check-update") {
+      // Keep the surefile's digest unless a different one is asked for, in
+      // which case every file has to be hashed again.  Check-update reports
+      // what changed as check does, in the same pass, so it doesn't trust
+      // the hash cache by default either.
+      bool const check = command == "check-update";
+      asure::Digest::Algorithm digest;
+      asure::SurefileFormat::Version format;
+      std::auto_ptr<asure::HashCache> cache(
+          openCache(check ? asure::HashCache::PARANOID : asure::HashCache::TRUST));
+      std::auto_ptr<NodeIterator> surefile(asure::loadGenerations(sureFile, "", &digest, &format));
+      if (!digestGiven)
+        walkOptions.digest = digest;
+      if (!formatGiven)
+        sureFormat = format;
+      bool const reuse = digest == walkOptions.digest;
+      size_t const renameMemory = checkOptions.moves ? checkOptions.moveMemory : 0;
+      std::auto_ptr<NodeIterator> old(asure::loadGenerations(sureFile));
+      std::auto_ptr<NodeIterator> tree(walkCurrent(
+          check ? asure::checkUpdateFilter(old.release(), checkOptions, reuse, renameMemory) :
+          asure::updateFilter(old.release(), reuse, renameMemory)));
+      // A delta has to have the surefile's digest and format.
+      int const generations = asure::countDeltas(sureFile);
+      bool const delta = reuse && sureFormat == format && deltaFits(generations);
+      std::auto_ptr<asure::SurefileSaver> saver(
+          delta ? new asure::SurefileSaver(sureFile, digest, format, generations + 1) :
+          new asure::SurefileSaver(sureFile, walkOptions.digest, sureFormat));
+      if (check)
+        asure::checkUpdate(*surefile, *tree, *saver, delta, checkOptions, reuse, renameMemory);
+      else if (delta)
+        asure::updateDelta(*surefile, *tree, *saver, reuse, renameMemory);
+      else
+        asure::updateTree(*surefile, *tree, *saver, reuse, renameMemory);
+    } else if (command == "compact") {
+      // Fold the deltas into a new surefile.
+      asure::Digest::Algorithm digest;
+      asure::SurefileFormat::Version format;
+      std::auto_ptr<NodeIterator> surefile(asure::loadGenerations(sureFile, "", &digest, &format));
+      if (!formatGiven)
+        sureFormat = format;
+      // The backup is left one delta short, so that signoff still shows the
+      // last update.  Without deltas there is only the format to change, and
+      // the backup is still the generation before.
+      int const generations = asure::countDeltas(sureFile);
+      if (generations != 0 || sureFormat != format) {
+        asure::SurefileSaver saver(sureFile, digest, sureFormat);
+        if (generations == 0)
+          saver.keepBackup();
+        else
+          saver.backupGenerations(generations - 1);
+        for (; !surefile->empty(); ++*surefile)
+          saver.writeNode(**surefile);
+        saver.close();
+      }
+    } else if (command == "selftest") {
+      if (selfTest() != 0)
+        std::exit(1);
+    } else if (command == "bench") {
+      bench(walkOptions);
     } else if (command == "walk") {
-      std::auto_ptr<NodeIterator> root(asure::tree::walkTree("."));
+      std::auto_ptr<NodeIterator> root(asure::tree::walkTree(".", walkOptions));
       show(*root);
     } else
       throw usage_error("unknown command: " + command);
   }
   catch (usage_error& err) {
     cout << "Asure, version 2.01\n";
-    cout << "Usage: asure [{-f|--surefile|--file} name] {scan|update|check|signoff|show|walk}\n\n";
+    cout << "Usage: asure [{-f|--surefile|--file} name] [{-j|--jobs} n] [--lookahead n]\n"
+         << "             [--sha1-kernel name] [--digest {sha1|sha256|blake3|xxh3}]\n"
+         << "             [--read {auto|buffered|mmap|direct|uring}] [--trust-cache|--paranoid]\n"
+         << "             [--stat-first [--sample percent]] [--walkers n] [--prefetch n]\n"
+         << "             [--uring-stat] [--one-file-system] [--exclude-from rulefile]\n"
+         << "             [--ignore att,...] [--format {text|binary}]\n"
+         << "             [--compress {gzip|zstd}] [--compress-level n] [--compress-threads n]\n"
+         << "             [--path dir] [--compact-at percent] [--moves [--move-memory mb]]\n"
+         << "             [--compare-workers n]\n"
+         << "             {scan|update|check-update|compact|check [dir]|signoff|show|\n"
+         << "              walk|selftest|bench}\n\n";
     cout << err.what() << '\n';
   }
   catch (asure::Exception_base& e) {